@@ -0,0 +1,443 @@
+/**
+ * hpack.h
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * HPACK header compression (RFC 7541) for HTTP/2 support of httpserver
+ * module
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2014 Null Team
+ *
+ * This software is distributed under multiple licenses;
+ * see the COPYING file in the main directory for licensing
+ * information for this specific distribution.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __HPACK_H
+#define __HPACK_H
+
+#include <yateclass.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_ENTRY_OVERHEAD 32
+
+namespace { // anonymous
+
+using namespace TelEngine;
+
+struct HpackStaticEntry
+{
+    const char* name;
+    const char* value;
+};
+
+static const HpackStaticEntry s_hpackStatic[HPACK_STATIC_ENTRIES] = {
+    { ":authority", 0 },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", 0 },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", 0 },
+    { "accept-ranges", 0 },
+    { "accept", 0 },
+    { "access-control-allow-origin", 0 },
+    { "age", 0 },
+    { "allow", 0 },
+    { "authorization", 0 },
+    { "cache-control", 0 },
+    { "content-disposition", 0 },
+    { "content-encoding", 0 },
+    { "content-language", 0 },
+    { "content-length", 0 },
+    { "content-location", 0 },
+    { "content-range", 0 },
+    { "content-type", 0 },
+    { "cookie", 0 },
+    { "date", 0 },
+    { "etag", 0 },
+    { "expect", 0 },
+    { "expires", 0 },
+    { "from", 0 },
+    { "host", 0 },
+    { "if-match", 0 },
+    { "if-modified-since", 0 },
+    { "if-none-match", 0 },
+    { "if-range", 0 },
+    { "if-unmodified-since", 0 },
+    { "last-modified", 0 },
+    { "link", 0 },
+    { "location", 0 },
+    { "max-forwards", 0 },
+    { "proxy-authenticate", 0 },
+    { "proxy-authorization", 0 },
+    { "range", 0 },
+    { "referer", 0 },
+    { "refresh", 0 },
+    { "retry-after", 0 },
+    { "server", 0 },
+    { "set-cookie", 0 },
+    { "strict-transport-security", 0 },
+    { "transfer-encoding", 0 },
+    { "user-agent", 0 },
+    { "vary", 0 },
+    { "via", 0 },
+    { "www-authenticate", 0 },
+};
+
+// Huffman code (RFC 7541 B) is canonical: codes of each length are
+// consecutive numbers, first of them is given per length along with how
+// many there are and where their symbols start in s_hpackSymbols
+static const unsigned short s_hpackSymbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256
+};
+
+static const int s_hpackFirst[31] = {
+    0, 0, 0, 0, 0, 0, 20, 92,
+    248, 508, 1016, 2042, 4090, 8184, 16380, 32764,
+    65534, 131068, 262136, 524272, 1048550, 2097116, 4194258, 8388568,
+    16777194, 33554412, 67108832, 134217694, 268435426, 536870910, 1073741820
+};
+
+static const unsigned char s_hpackCount[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const unsigned short s_hpackOffset[31] = {
+    0, 0, 0, 0, 0, 0, 10, 36, 68, 74, 74, 79, 82, 84, 90, 92,
+    95, 95, 95, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 253, 253
+};
+
+/**
+ * Header block decoder, keeps dynamic table of one HTTP/2 connection
+ */
+class HpackDecoder
+{
+public:
+    inline HpackDecoder(unsigned int maxSize = 4096, unsigned int maxList = 0)
+	: m_size(0), m_maxSize(maxSize), m_limit(maxSize),
+	  m_listSize(0), m_maxList(maxList)
+	{ }
+
+    /**
+     * Decode a complete header block
+     * @param buf Header block, possibly gathered from several frames
+     * @param len Length of header block
+     * @param dest List receiving header fields in their order
+     * @return False on compression error or if decoded header list grows
+     *  over maxList(), connection can't go on
+     */
+    bool decode(const unsigned char* buf, unsigned int len, NamedList& dest);
+
+    inline unsigned int size() const
+	{ return m_size; }
+    // Header list size of last block as defined for SETTINGS_MAX_HEADER_LIST_SIZE
+    inline unsigned int listSize() const
+	{ return m_listSize; }
+    // Limit of decoded header list size, 0 for none
+    inline unsigned int maxList() const
+	{ return m_maxList; }
+    inline void maxList(unsigned int len)
+	{ m_maxList = len; }
+
+private:
+    static bool integer(const unsigned char*& ptr, const unsigned char* end,
+	unsigned int prefix, unsigned int& value);
+    static bool string(const unsigned char*& ptr, const unsigned char* end, String& dest);
+    static bool huffman(const unsigned char* ptr, unsigned int len, String& dest);
+    bool entry(unsigned int index, String& name, String* value) const;
+    void add(const String& name, const String& value);
+    void evict(unsigned int maxSize);
+    bool listed(const String& name, const String& value);
+    ObjList m_table;        // newest entry first
+    unsigned int m_size;    // as defined by RFC, with entry overhead
+    unsigned int m_maxSize; // set by table size updates
+    unsigned int m_limit;   // what we allowed in SETTINGS
+    unsigned int m_listSize;
+    unsigned int m_maxList;
+};
+
+/**
+ * Header block encoder. It doesn't use dynamic table, so it keeps no state:
+ * fields found in static table are indexed, others are literals.
+ */
+class HpackEncoder
+{
+public:
+    static void status(DataBlock& buf, int code);
+    static void header(DataBlock& buf, const char* name, unsigned int nameLen,
+	const char* value, unsigned int valueLen);
+    static void integer(DataBlock& buf, unsigned char first, unsigned int prefix, unsigned int value);
+};
+
+inline bool HpackDecoder::integer(const unsigned char*& ptr, const unsigned char* end,
+    unsigned int prefix, unsigned int& value)
+{
+    if (ptr >= end)
+	return false;
+    unsigned int mask = (1 << prefix) - 1;
+    value = *ptr++ & mask;
+    if (value < mask)
+	return true;
+    for (unsigned int shift = 0; ptr < end && shift < 28; shift += 7) {
+	unsigned char c = *ptr++;
+	value += (unsigned int)(c & 0x7f) << shift;
+	if (!(c & 0x80))
+	    return true;
+    }
+    return false;
+}
+
+inline bool HpackDecoder::string(const unsigned char*& ptr, const unsigned char* end, String& dest)
+{
+    if (ptr >= end)
+	return false;
+    bool huff = (*ptr & 0x80) != 0;
+    unsigned int len = 0;
+    if (!integer(ptr, end, 7, len) || len > (unsigned int)(end - ptr))
+	return false;
+    const unsigned char* str = ptr;
+    ptr += len;
+    if (huff)
+	return huffman(str, len, dest);
+    dest.assign((const char*)str, len);
+    return true;
+}
+
+// Canonical Huffman decoding, tables are constant so threads share them
+inline bool HpackDecoder::huffman(const unsigned char* ptr, unsigned int len, String& dest)
+{
+    char out[256];
+    unsigned int used = 0;
+    dest.clear();
+    int code = 0;
+    int bits = 0;
+    for (unsigned int i = 0; i < len; i++) {
+	for (int b = 7; b >= 0; b--) {
+	    code = (code << 1) | ((ptr[i] >> b) & 1);
+	    bits++;
+	    int idx = code - s_hpackFirst[bits];
+	    if (idx < 0 || idx >= s_hpackCount[bits])
+		continue;
+	    unsigned int sym = s_hpackSymbols[s_hpackOffset[bits] + idx];
+	    if (sym == 256)
+		return false; // EOS must not be decoded
+	    out[used++] = (char)sym;
+	    if (used == sizeof(out)) {
+		dest.append(out, used);
+		used = 0;
+	    }
+	    code = 0;
+	    bits = 0;
+	}
+	if (bits > 30)
+	    return false;
+    }
+    // padding is at most 7 bits, all ones
+    if (bits > 7 || code != (1 << bits) - 1)
+	return false;
+    if (used)
+	dest.append(out, used);
+    return true;
+}
+
+inline bool HpackDecoder::entry(unsigned int index, String& name, String* value) const
+{
+    if (!index)
+	return false;
+    if (index <= HPACK_STATIC_ENTRIES) {
+	const HpackStaticEntry& e = s_hpackStatic[index - 1];
+	name = e.name;
+	if (value)
+	    *value = e.value;
+	return true;
+    }
+    const NamedString* ns = static_cast<const NamedString*>(m_table[index - HPACK_STATIC_ENTRIES - 1]);
+    if (!ns)
+	return false;
+    name = ns->name();
+    if (value)
+	*value = *ns;
+    return true;
+}
+
+inline void HpackDecoder::add(const String& name, const String& value)
+{
+    unsigned int size = name.length() + value.length() + HPACK_ENTRY_OVERHEAD;
+    if (size > m_maxSize) {
+	// too large entry just empties the table
+	evict(0);
+	return;
+    }
+    evict(m_maxSize - size);
+    m_table.insert(new NamedString(name, value));
+    m_size += size;
+}
+
+// Account a decoded field, indexed ones may expand a small block a lot
+inline bool HpackDecoder::listed(const String& name, const String& value)
+{
+    m_listSize += name.length() + value.length() + HPACK_ENTRY_OVERHEAD;
+    return !m_maxList || m_listSize <= m_maxList;
+}
+
+// Drop oldest entries until table fits in given size
+inline void HpackDecoder::evict(unsigned int maxSize)
+{
+    while (m_size > maxSize) {
+	ObjList* last = m_table.last();
+	const NamedString* ns = last ? static_cast<const NamedString*>(last->get()) : 0;
+	if (!ns) {
+	    m_size = 0;
+	    break;
+	}
+	m_size -= ns->name().length() + ns->length() + HPACK_ENTRY_OVERHEAD;
+	m_table.remove(ns);
+    }
+}
+
+inline bool HpackDecoder::decode(const unsigned char* buf, unsigned int len, NamedList& dest)
+{
+    const unsigned char* ptr = buf;
+    const unsigned char* end = buf + len;
+    bool fields = false;
+    m_listSize = 0;
+    while (ptr < end) {
+	unsigned char c = *ptr;
+	unsigned int index = 0;
+	if (c & 0x80) {
+	    // indexed header field
+	    String name, value;
+	    if (!(integer(ptr, end, 7, index) && entry(index, name, &value) && listed(name, value)))
+		return false;
+	    dest.addParam(name, value);
+	    fields = true;
+	    continue;
+	}
+	if ((c & 0xe0) == 0x20) {
+	    // dynamic table size update, only allowed before first field
+	    if (fields || !integer(ptr, end, 5, index) || index > m_limit)
+		return false;
+	    m_maxSize = index;
+	    evict(m_maxSize);
+	    continue;
+	}
+	// literal, with incremental indexing (01), without (0000) or never (0001)
+	bool indexing = (c & 0xc0) == 0x40;
+	if (!integer(ptr, end, indexing ? 6 : 4, index))
+	    return false;
+	String name, value;
+	if (index) {
+	    if (!entry(index, name, 0))
+		return false;
+	}
+	else if (!string(ptr, end, name))
+	    return false;
+	if (!(string(ptr, end, value) && listed(name, value)))
+	    return false;
+	if (indexing)
+	    add(name, value);
+	dest.addParam(name, value);
+	fields = true;
+    }
+    return true;
+}
+
+inline void HpackEncoder::integer(DataBlock& buf, unsigned char first, unsigned int prefix, unsigned int value)
+{
+    unsigned char tmp[8];
+    unsigned int n = 0;
+    unsigned int mask = (1 << prefix) - 1;
+    if (value < mask)
+	tmp[n++] = first | value;
+    else {
+	tmp[n++] = first | mask;
+	value -= mask;
+	while (value >= 0x80) {
+	    tmp[n++] = (value & 0x7f) | 0x80;
+	    value >>= 7;
+	}
+	tmp[n++] = value;
+    }
+    buf.append(tmp, n);
+}
+
+inline void HpackEncoder::status(DataBlock& buf, int code)
+{
+    // :status 200, 204, 206, 304, 400, 404, 500 are in static table
+    for (unsigned int i = 7; i < 14; i++) {
+	if (::atoi(s_hpackStatic[i].value) == code) {
+	    integer(buf, 0x80, 7, i + 1);
+	    return;
+	}
+    }
+    char tmp[16];
+    unsigned int len = ::snprintf(tmp, sizeof(tmp), "%d", code);
+    // literal without indexing, name from static entry 8
+    integer(buf, 0x00, 4, 8);
+    integer(buf, 0x00, 7, len);
+    buf.append(tmp, len);
+}
+
+// Name must be lower case
+inline void HpackEncoder::header(DataBlock& buf, const char* name, unsigned int nameLen,
+    const char* value, unsigned int valueLen)
+{
+    unsigned int index = 0;
+    for (unsigned int i = 14; i < HPACK_STATIC_ENTRIES; i++) {
+	const HpackStaticEntry& e = s_hpackStatic[i];
+	if (::strlen(e.name) != nameLen || ::memcmp(e.name, name, nameLen))
+	    continue;
+	index = i + 1;
+	break;
+    }
+    integer(buf, 0x00, 4, index);
+    if (!index) {
+	integer(buf, 0x00, 7, nameLen);
+	buf.append(const_cast<char*>(name), nameLen);
+    }
+    integer(buf, 0x00, 7, valueLen);
+    if (valueLen)
+	buf.append(const_cast<char*>(value), valueLen);
+}
+
+}; // anonymous namespace
+
+#endif /* __HPACK_H */
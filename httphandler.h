@@ -0,0 +1,217 @@
+/**
+ * httphandler.h
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Interface of handlers called directly by httpserver module, without
+ * going through http.route, http.preserve and http.serve messages
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2014 Null Team
+ *
+ * This software is distributed under multiple licenses;
+ * see the COPYING file in the main directory for licensing
+ * information for this specific distribution.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __HTTPHANDLER_H
+#define __HTTPHANDLER_H
+
+#include <yateclass.h>
+#include <yatengine.h>
+
+namespace TelEngine {
+
+/**
+ * Token of a response given after handler returned. Connection waits for
+ * it without holding a thread once handler called defer(). Complete it from
+ * any thread with a message filled like a handled http.serve: status,
+ * ohdr_Xxxxx and keepalive parameters, body in retValue or in userData Stream.
+ */
+class HttpDeferred : public RefObject
+{
+public:
+    virtual void* getObject(const String& name) const
+    {
+	if (name == YATOM("HttpDeferred"))
+	    return const_cast<HttpDeferred*>(this);
+	return RefObject::getObject(name);
+    }
+    // Identifier to put in token parameter of http.complete message
+    virtual const String& id() const = 0;
+    // Response will come through complete(). Call it before handler returns;
+    // a response left in http.serve message is still sent instead
+    virtual void defer() = 0;
+    // Return false if request is gone (timed out, connection closed)
+    virtual bool complete(Message& msg) = 0;
+};
+
+class HttpBody;
+
+/**
+ * Told about request body data as it arrives, see HttpBody::reader()
+ */
+class HttpBodyReader
+{
+public:
+    virtual ~HttpBodyReader()
+	{ }
+    // Called from server's event loop when data arrives or body ends, keep
+    // it short. Data left unread waits in body and holds back the sender
+    virtual void bodyReady(HttpBody& body) = 0;
+};
+
+/**
+ * Request body given to http.serve (msg.userObject("HttpBody")) or to a
+ * direct handler while it still arrives. Server stops reading from client
+ * once a window of data waits unread. Read it from any thread.
+ */
+class HttpBody : public RefObject
+{
+public:
+    virtual void* getObject(const String& name) const
+    {
+	if (name == YATOM("HttpBody"))
+	    return const_cast<HttpBody*>(this);
+	return RefObject::getObject(name);
+    }
+    // Copy up to len bytes, wait up to maxwait usec (-1 forever) for some
+    // Return 0 at end of body, -1 if none arrived yet or body was cut short
+    // Won't wait in a handler run by connection's own thread (no workers)
+    virtual int read(void* buf, unsigned int len, long maxwait = 0) = 0;
+    // Whole body was read
+    virtual bool finished() const = 0;
+    // Body will not end: connection closed, body too long or malformed
+    virtual bool failed() const = 0;
+    // Have reader called as data arrives (right away if some waits), NULL to stop
+    virtual void reader(HttpBodyReader* rd) = 0;
+};
+
+/**
+ * Request and response of one exchange as a direct handler sees them.
+ * It is only valid during the handler call it was passed to.
+ */
+class HttpExchange
+{
+public:
+    virtual ~HttpExchange()
+	{ }
+    // Name of listener section that accepted the request
+    virtual const String& server() const = 0;
+    virtual const String& method() const = 0;
+    virtual const String& uri() const = 0;
+    virtual const String& version() const = 0;
+    virtual const String& address() const = 0;
+    virtual String header(const char* name) const = 0;
+    // Request parameter as http.* messages carry it (ip_host, hdr_X, ...)
+    // Empty if there is no such parameter
+    virtual const String& param(const String& name) = 0;
+    // Request body buffered by server, NULL if none or a stream took it
+    virtual const DataBlock* body() const = 0;
+    // Before body is read: have it written to a stream, change size limit
+    virtual void bodyStream(Stream* strm, RefObject* ref) = 0;
+    virtual void maxBody(unsigned int len) = 0;
+    // In preserve(): call serve() before body is read, window of 0 takes
+    // listener's bodywindow. Body then comes through streamedBody(), with
+    // no size limit unless maxBody() is called afterwards
+    virtual void streamBody(unsigned int window = 0) = 0;
+    virtual HttpBody* streamedBody() = 0;
+    // Response is 200 without body unless handler says otherwise
+    virtual void status(int code) = 0;
+    virtual void setHeader(const char* name, const char* value) = 0;
+    virtual void setBody(const String& body) = 0;
+    virtual void setBody(const DataBlock& body) = 0;
+    // Length is -1 if not known, file is given when stream is a plain file
+    virtual void setBody(Stream* strm, RefObject* ref, unsigned int length, File* file = 0) = 0;
+    virtual void keepAlive(bool keep) = 0;
+    // Answer later, serve() returns 0 and token gets the response
+    virtual HttpDeferred* defer() = 0;
+};
+
+/**
+ * Handler of requests for a path, called from httpserver's worker or event
+ * loop thread. Methods return 0 to go on, an HTTP status to answer with
+ * an error response or -1 to drop the connection.
+ */
+class HttpHandler : public RefObject
+{
+public:
+    virtual void* getObject(const String& name) const
+    {
+	if (name == YATOM("HttpHandler"))
+	    return const_cast<HttpHandler*>(this);
+	return RefObject::getObject(name);
+    }
+    // Request head is complete, body is not read yet
+    virtual int preserve(HttpExchange& xchg)
+	{ return 0; }
+    // Whole request is read, fill in response
+    virtual int serve(HttpExchange& xchg) = 0;
+};
+
+/**
+ * Ask httpserver to call handler for requests whose path (URI without
+ * query) is equal to or, if prefix is set, starts with given one.
+ * Empty method matches any, a server limits it to one listener.
+ * Return false if httpserver is not loaded yet.
+ */
+inline bool httpRegister(HttpHandler* handler, const char* path, bool prefix = false,
+    const char* method = 0, const char* server = 0)
+{
+    Message m("http.register");
+    m.userData(handler);
+    m.addParam("path", path);
+    m.addParam("prefix", String::boolText(prefix));
+    if (method)
+	m.addParam("method", method);
+    if (server)
+	m.addParam("server", server);
+    return Engine::dispatch(m);
+}
+
+/**
+ * Remove handler from a path or, with no path, from all of them
+ */
+inline bool httpUnregister(HttpHandler* handler, const char* path = 0)
+{
+    Message m("http.register");
+    m.userData(handler);
+    m.addParam("operation", "remove");
+    if (path)
+	m.addParam("path", path);
+    return Engine::dispatch(m);
+}
+
+/**
+ * Request parameter of an http.* message. httpserver may leave some out of
+ * message and produce them only when a handler asks for them by name.
+ * Return NULL if there is no such parameter.
+ */
+inline const char* httpParam(const Message& msg, const char* name)
+{
+    const char* val = msg.getValue(name, 0);
+    if (val)
+	return val;
+    const NamedString* param = static_cast<const NamedString*>(msg.userObject(name));
+    return param ? param->c_str() : 0;
+}
+
+/**
+ * Copy into message all request parameters httpserver left out of it
+ */
+inline void httpParams(Message& msg)
+{
+    NamedList* req = static_cast<NamedList*>(msg.userObject(YATOM("NamedList")));
+    if (req)
+	msg.copyParams(*req);
+}
+
+}; // namespace TelEngine
+
+#endif /* __HTTPHANDLER_H */
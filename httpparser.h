@@ -0,0 +1,442 @@
+/**
+ * httpparser.h
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Incremental HTTP request head parser shared by httpserver module
+ * and it's benchmarks
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2014 Null Team
+ *
+ * This software is distributed under multiple licenses;
+ * see the COPYING file in the main directory for licensing
+ * information for this specific distribution.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __HTTPPARSER_H
+#define __HTTPPARSER_H
+
+#include <yateclass.h>
+#include <string.h>
+
+#define HTTP_MAX_HEADERS 100
+
+namespace { // anonymous
+
+using namespace TelEngine;
+
+/**
+ * Request line and header fields found by parser, as offsets in input buffer
+ */
+struct HttpField
+{
+    unsigned int nameOffs;
+    unsigned int nameLen;
+    unsigned int valueOffs;
+    unsigned int valueLen;
+};
+
+/**
+ * Single pass request head parser. It keeps it's state between calls, so
+ * when head arrives in pieces each byte is looked at only once.
+ * Buffer may be reallocated between calls but must keep it's content.
+ */
+class HttpHeadParser
+{
+public:
+    enum Result {
+	Incomplete,   // need more data
+	Complete,     // head ends at length()
+	Invalid,      // malformed request line or header
+	TooLarge,     // head or header count over the limit
+    };
+
+    inline HttpHeadParser(unsigned int maxHead = 8192)
+	: m_maxHead(maxHead)
+	{ reset(); }
+
+    /**
+     * Prepare for next request head
+     */
+    inline void reset()
+    {
+	m_state = Start;
+	m_pos = 0;
+	m_count = 0;
+	m_result = Incomplete;
+	m_verOffs = 0;
+	m_verLen = 0;
+	::memset(&m_line, 0, sizeof(m_line));
+    }
+
+    /**
+     * Continue parsing where last call stopped
+     * @param buf Start of received data, request head starts at buf[0]
+     * @param len Number of bytes in buffer
+     * @return One of Result values
+     */
+    int parse(const char* buf, unsigned int len);
+
+    inline unsigned int length() const
+	{ return m_pos; }
+    inline unsigned int count() const
+	{ return m_count; }
+    inline const HttpField& header(unsigned int index) const
+	{ return m_fields[index]; }
+    // method is kept as name and uri as value of request line
+    inline const HttpField& requestLine() const
+	{ return m_line; }
+    inline unsigned int versionOffs() const
+	{ return m_verOffs; }
+    inline unsigned int versionLen() const
+	{ return m_verLen; }
+    inline void maxHead(unsigned int len)
+	{ m_maxHead = len; }
+    inline unsigned int maxHead() const
+	{ return m_maxHead; }
+
+    /**
+     * Copy a field value to a String, folded lines are joined with a space
+     */
+    static void value(String& dest, const char* buf, unsigned int offs, unsigned int len);
+
+private:
+    enum State {
+	Start,        // skipping empty lines before request
+	Method,
+	UriStart,
+	Uri,
+	VersionStart,
+	Version,
+	LineLF,       // got CR, need LF
+	HdrStart,     // beginning of a line: header, fold or end
+	HdrName,
+	ValueStart,
+	Value,
+	EndLF,        // got CR of empty line
+    };
+    bool checkVersion(const char* buf) const;
+    static inline bool tokenChar(char c)
+    {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+	    (c && ::strchr("!#$%&'*+-.^_`|~", c));
+    }
+
+    unsigned int m_maxHead;
+    int m_state;
+    unsigned int m_pos;
+    unsigned int m_count;
+    int m_result;
+    unsigned int m_verOffs;
+    unsigned int m_verLen;
+    HttpField m_line;
+    HttpField m_fields[HTTP_MAX_HEADERS];
+};
+
+inline bool HttpHeadParser::checkVersion(const char* buf) const
+{
+    // HTTP/<digit>.<digit>+
+    const char* v = buf + m_verOffs;
+    if (m_verLen < 8 || ::strncasecmp(v, "HTTP/", 5) || v[5] < '0' || v[5] > '9' || v[6] != '.')
+	return false;
+    for (unsigned int i = 7; i < m_verLen; i++)
+	if (v[i] < '0' || v[i] > '9')
+	    return false;
+    return true;
+}
+
+inline int HttpHeadParser::parse(const char* buf, unsigned int len)
+{
+    if (m_result != Incomplete)
+	return m_result;
+    if (len > m_maxHead)
+	len = m_maxHead;
+    for (; m_pos < len; m_pos++) {
+	char c = buf[m_pos];
+	switch (m_state) {
+	    case Start:
+		if (c == '\r' || c == '\n')
+		    continue;
+		m_line.nameOffs = m_pos;
+		m_state = Method;
+		// fall through
+	    case Method:
+		if (c == ' ') {
+		    m_line.nameLen = m_pos - m_line.nameOffs;
+		    if (!m_line.nameLen)
+			return (m_result = Invalid);
+		    m_state = UriStart;
+		}
+		else if (!((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')))
+		    return (m_result = Invalid);
+		continue;
+	    case UriStart:
+		if (c == ' ' || c == '\t')
+		    continue;
+		m_line.valueOffs = m_pos;
+		m_state = Uri;
+		// fall through
+	    case Uri:
+		if (c == ' ' || c == '\t') {
+		    m_line.valueLen = m_pos - m_line.valueOffs;
+		    m_state = VersionStart;
+		}
+		else if (c == '\r' || c == '\n')
+		    return (m_result = Invalid);
+		continue;
+	    case VersionStart:
+		if (c == ' ' || c == '\t')
+		    continue;
+		m_verOffs = m_pos;
+		m_state = Version;
+		// fall through
+	    case Version:
+		if (c != '\r' && c != '\n')
+		    continue;
+		m_verLen = m_pos - m_verOffs;
+		if (!checkVersion(buf))
+		    return (m_result = Invalid);
+		break;
+	    case HdrStart:
+		if (c == '\r') {
+		    m_state = EndLF;
+		    continue;
+		}
+		if (c == '\n') {
+		    m_pos++;
+		    return (m_result = Complete);
+		}
+		if (c == ' ' || c == '\t') {
+		    // folded line continues previous value
+		    if (!m_count)
+			return (m_result = Invalid);
+		    m_state = Value;
+		    continue;
+		}
+		if (m_count >= HTTP_MAX_HEADERS)
+		    return (m_result = TooLarge);
+		m_fields[m_count].nameOffs = m_pos;
+		m_fields[m_count].valueLen = 0;
+		m_state = HdrName;
+		// fall through
+	    case HdrName:
+		if (c == ':') {
+		    HttpField& f = m_fields[m_count];
+		    f.nameLen = m_pos - f.nameOffs;
+		    if (!f.nameLen)
+			return (m_result = Invalid);
+		    f.valueOffs = m_pos + 1;
+		    m_count++;
+		    m_state = ValueStart;
+		}
+		else if (!tokenChar(c))
+		    // blanks before colon included (RFC 7230 3.2.4)
+		    return (m_result = Invalid);
+		continue;
+	    case ValueStart:
+		if (c == ' ' || c == '\t') {
+		    m_fields[m_count - 1].valueOffs = m_pos + 1;
+		    continue;
+		}
+		if (c == '\r' || c == '\n')
+		    break;
+		m_state = Value;
+		// fall through
+	    case Value:
+		if (c == '\r' || c == '\n')
+		    break;
+		if (c != ' ' && c != '\t') {
+		    // value ends at last non blank seen so far
+		    HttpField& f = m_fields[m_count - 1];
+		    f.valueLen = m_pos + 1 - f.valueOffs;
+		}
+		continue;
+	    case LineLF:
+		if (c != '\n')
+		    return (m_result = Invalid);
+		m_state = HdrStart;
+		continue;
+	    case EndLF:
+		if (c != '\n')
+		    return (m_result = Invalid);
+		m_pos++;
+		return (m_result = Complete);
+	}
+	// got end of request line or header line
+	m_state = (c == '\r') ? LineLF : HdrStart;
+    }
+    if (m_pos >= m_maxHead)
+	return (m_result = TooLarge);
+    return Incomplete;
+}
+
+inline void HttpHeadParser::value(String& dest, const char* buf, unsigned int offs, unsigned int len)
+{
+    const char* v = buf + offs;
+    unsigned int i = 0;
+    for (; i < len; i++)
+	if (v[i] == '\r' || v[i] == '\n')
+	    break;
+    if (i == len) {
+	dest.assign(v, len);
+	return;
+    }
+    // unfold, every line break with it's leading blanks becomes a space
+    dest.assign(v, i);
+    while (i < len) {
+	while (i < len && (v[i] == '\r' || v[i] == '\n' || v[i] == ' ' || v[i] == '\t'))
+	    i++;
+	unsigned int start = i;
+	while (i < len && v[i] != '\r' && v[i] != '\n')
+	    i++;
+	dest << " ";
+	dest.append(v + start, i - start);
+    }
+}
+
+/**
+ * Header names the server itself looks at, interned to small integers
+ */
+enum HttpHeaderId {
+    HttpHdrOther = 0,
+    HttpHdrConnection,
+    HttpHdrContentLength,
+    HttpHdrTransferEncoding,
+    HttpHdrUpgrade,
+    HttpHdrHost,
+    HttpHdrContentType,
+    HttpHdrExpect,
+    HttpHdrAcceptEncoding,
+    HttpHdrRange,
+    HttpHdrIfRange,
+    HttpHdrCount
+};
+
+static const TokenDict s_httpHeaderIds[] = {
+    { "Connection", HttpHdrConnection },
+    { "Content-Length", HttpHdrContentLength },
+    { "Transfer-Encoding", HttpHdrTransferEncoding },
+    { "Upgrade", HttpHdrUpgrade },
+    { "Host", HttpHdrHost },
+    { "Content-Type", HttpHdrContentType },
+    { "Expect", HttpHdrExpect },
+    { "Accept-Encoding", HttpHdrAcceptEncoding },
+    { "Range", HttpHdrRange },
+    { "If-Range", HttpHdrIfRange },
+    { 0, 0 }
+};
+
+/**
+ * Header fields of a request head as views into it's buffer, with
+ * interned ids and a hash index for case insensitive lookup by name.
+ * Building and searching it does not allocate memory.
+ */
+class HttpHeaderTable
+{
+public:
+    inline HttpHeaderTable()
+	: m_buf(0), m_count(0)
+	{
+	    ::memset(m_first, 0, sizeof(m_first));
+	    ::memset(m_hash, 0, sizeof(m_hash));
+	}
+
+    /**
+     * Index fields found by parser
+     * @param buf Request head, must stay unchanged while table is used
+     * @param head Parser that completed the head
+     */
+    void build(const char* buf, const HttpHeadParser& head);
+
+    /**
+     * Find a header, when repeated the last one wins
+     * @return Field index or -1 if missing
+     */
+    int find(const char* name, int len = -1) const;
+    inline int find(int id) const
+	{ return (id > HttpHdrOther && id < HttpHdrCount) ? (int)m_first[id] - 1 : -1; }
+
+    inline unsigned int count() const
+	{ return m_count; }
+    inline const HttpField& field(unsigned int index) const
+	{ return m_fields[index]; }
+    inline const char* name(unsigned int index) const
+	{ return m_buf + m_fields[index].nameOffs; }
+    inline const char* value(unsigned int index) const
+	{ return m_buf + m_fields[index].valueOffs; }
+
+    static int id(const char* name, unsigned int len);
+
+private:
+    static unsigned int hash(const char* name, unsigned int len);
+    const char* m_buf;
+    unsigned int m_count;
+    HttpField m_fields[HTTP_MAX_HEADERS];
+    unsigned char m_first[HttpHdrCount];
+    unsigned char m_hash[2 * HTTP_MAX_HEADERS];
+};
+
+inline int HttpHeaderTable::id(const char* name, unsigned int len)
+{
+    for (const TokenDict* t = s_httpHeaderIds; t->token; t++)
+	if (::strlen(t->token) == len && !::strncasecmp(t->token, name, len))
+	    return t->value;
+    return HttpHdrOther;
+}
+
+inline unsigned int HttpHeaderTable::hash(const char* name, unsigned int len)
+{
+    unsigned int h = 2166136261u;
+    for (unsigned int i = 0; i < len; i++)
+	h = (h ^ (unsigned char)(name[i] | 0x20)) * 16777619u;
+    return h;
+}
+
+inline void HttpHeaderTable::build(const char* buf, const HttpHeadParser& head)
+{
+    m_buf = buf;
+    m_count = head.count();
+    ::memset(m_first, 0, sizeof(m_first));
+    ::memset(m_hash, 0, sizeof(m_hash));
+    for (unsigned int i = 0; i < m_count; i++) {
+	const HttpField& f = m_fields[i] = head.header(i);
+	const char* n = buf + f.nameOffs;
+	int hid = id(n, f.nameLen);
+	if (hid)
+	    m_first[hid] = i + 1;
+	// open addressing, a repeated name takes over it's slot
+	for (unsigned int s = hash(n, f.nameLen) % sizeof(m_hash); ; s = (s + 1) % sizeof(m_hash)) {
+	    unsigned int o = m_hash[s];
+	    if (o && (m_fields[o - 1].nameLen != f.nameLen ||
+		    ::strncasecmp(buf + m_fields[o - 1].nameOffs, n, f.nameLen)))
+		continue;
+	    m_hash[s] = i + 1;
+	    break;
+	}
+    }
+}
+
+inline int HttpHeaderTable::find(const char* name, int len) const
+{
+    if (len < 0)
+	len = ::strlen(name);
+    for (unsigned int s = hash(name, len) % sizeof(m_hash); ; s = (s + 1) % sizeof(m_hash)) {
+	unsigned int o = m_hash[s];
+	if (!o)
+	    return -1;
+	const HttpField& f = m_fields[o - 1];
+	if (f.nameLen == (unsigned int)len && !::strncasecmp(m_buf + f.nameOffs, name, len))
+	    return o - 1;
+    }
+}
+
+}; // anonymous namespace
+
+#endif /* __HTTPPARSER_H */
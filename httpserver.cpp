@@ -21,10 +21,48 @@
 
 #include <yateclass.h>
 #include <yatephone.h>
-#include <yatemime.h> // for getUnfoldedLine
+#include "httpparser.h"
+#include "hpack.h"
+#include "httphandler.h"
 #include <string.h>
 #include <stdio.h> // for snprintf
 #include <stdlib.h> // for atoi
+#include <time.h> // for gmtime_r
+#ifdef __linux__
+# include <sys/epoll.h>
+# include <unistd.h>
+# include <sys/eventfd.h>
+# include <sys/sendfile.h>
+# define HAVE_EPOLL
+# define HAVE_SENDFILE
+#endif
+#ifdef HAVE_LIBURING
+# include <liburing.h>
+#endif
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+# include <brotli/encode.h>
+#endif
+#ifndef HAVE_EPOLL
+// TLS handshakes are run by epoll driven threads
+# undef HAVE_OPENSSL
+#endif
+#ifdef HAVE_OPENSSL
+# include <openssl/ssl.h>
+# include <openssl/err.h>
+# include <openssl/rand.h>
+# if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+# else
+#  include <openssl/hmac.h>
+# endif
+# if OPENSSL_VERSION_NUMBER >= 0x30000000L && defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+// records encrypted by kernel, SSL_sendfile() available
+#  define HAVE_KTLS
+# endif
+#endif
 
 /**
  * Message http.preserve is dispatched after request headers is received.
@@ -33,6 +71,24 @@
 
 #define HDR_BUFFER_SIZE 2048
 #define BODY_BUF_SIZE 4096
+#define REACTOR_EVENTS 64
+#define REACTOR_WAIT_MS 500
+#define URING_ENTRIES 256
+#define URING_BGID 1
+#define PIPELINE_BATCH 65536
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_SIZE 16384
+#define H2_WINDOW 65535
+#define H2_MAX_BLOCK 65536
+#define ENCODER_BUF_SIZE 16384
+#define METRIC_SLOTS 16
+#define METRIC_BUCKETS 24
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 3
+#define TLS_KEY_NAME 16
 #ifndef min
 # define min(a,b) ((a)<(b)?(a):(b))
 #endif
@@ -77,6 +133,7 @@ static TokenDict s_httpResponseCodes[] = {
     { "Unsupported Media Type", 415 },
     { "Requested Range Not Satisfiable", 416 },
     { "Expectation Failed", 417 },
+    { "Request Header Fields Too Large", 431 },
     { "Server Internal Error", 500 },
     { "Not Implemented", 501 },
     { "Bad Gateway", 502 },
@@ -86,18 +143,59 @@ static TokenDict s_httpResponseCodes[] = {
     { 0, 0 },
 };
 
+#define STATUS_CODES 64
+
+// Status lines of known codes rendered once, for HTTP/1.0 and HTTP/1.1
+static String s_statusLines[2][STATUS_CODES];
+static unsigned char s_statusIndex[600];
+
 //we gonna create here the list with all the new connections.
 static ObjList s_connList;
 
 // the incomming connections listeners list
 static ObjList s_listeners;
 
+// listeners replaced or removed by reload, kept until their connections end
+static ObjList s_draining;
+
+// Live connections of a listener or of a peer on it
+class ConnCount : public String
+{
+public:
+    inline ConnCount(const String& key)
+	: String(key), m_count(0)
+	{ }
+    unsigned int m_count;
+};
+
+// admission limits from [general], connection counts and canned 503 are
+// guarded by s_mutex
+static unsigned int s_maxConns = 0;
+static unsigned int s_connCount = 0;
+static HashList s_connCounts(64);
+static bool s_shedCongestion = true;
+static unsigned int s_maxMessages = 0;
+static unsigned int s_retryAfter = 5;
+static String s_busyResponse;
+static unsigned int s_maxHandshakes = 1024;
+
 class YHttpMessage;
 class YHttpRequest;
 class YHttpResponse;
 
 class Connection;
 class HTTPServerThread;
+class HTTPReactor;
+class HTTPUring;
+class HTTPWorkers;
+class HTTP2Session;
+class HTTPServerListener;
+class HTTPMetrics;
+class DeferredResponse;
+class StreamedBody;
+class ConnTimers;
+class TLSContext;
+class TLSSocket;
 
 class BodyBuffer: public RefObject, public MemoryStream
 {
@@ -114,6 +212,169 @@ public:
 	{ }
     DataBlock& data()
 	{ return m_data; }
+    // Make it empty for next request
+    void reset()
+	{ m_data.clear(); m_offset = 0; }
+};
+
+// Counters and phase latency histograms of a listener section, shared by
+// it's shards. Threads add to their own slot without locking
+class HTTPMetrics : public RefObject
+{
+public:
+    enum Counter {
+	Accepted,
+	Closed,
+	Requests,
+	Reused,       // requests after the first on a connection
+	Direct,       // requests served by a handler from route table
+	Deferred,     // responses given later through a token
+	Streamed,     // request bodies given to handler while they arrived
+	DeferExpired, // deferred requests answered 504 after defertimeout
+	Status1xx,
+	Status2xx,
+	Status3xx,
+	Status4xx,
+	Status5xx,
+	BytesIn,
+	BytesOut,
+	RejectLimit,  // listener or global connection limit
+	RejectPeer,   // per address connection limit
+	RejectLoad,   // engine congested at accept time
+	RejectShed,   // request answered 503 on engine congestion
+	Compressed,
+	CompressIn,
+	CompressOut,
+	CompressUsec,
+	TlsFull,      // TLS handshakes that set up a new session
+	TlsResumed,   // TLS handshakes resuming a cached or ticket session
+	TlsFailed,
+	TlsKernel,    // TLS connections whose records kernel encrypts
+	CounterCount
+    };
+    enum Phase {
+	HeadParse,
+	Route,        // http.route and http.upgrade
+	Preserve,
+	BodyRead,
+	Serve,
+	Send,
+	Handshake,    // TLS, from accept to handshake done
+	PhaseCount
+    };
+    HTTPMetrics(const String& name);
+    ~HTTPMetrics();
+    inline const String& name() const
+	{ return m_name; }
+    inline void add(int counter, u_int64_t val = 1)
+	{ __sync_fetch_and_add(&m_slots[slot()].counters[counter],val); }
+    // open connections, not touched by reset
+    inline void active(int delta)
+	{ __sync_fetch_and_add(&m_active,delta); }
+    inline int active() const
+	{ return m_active; }
+    void time(int phase, u_int64_t usec);
+    u_int64_t get(int counter) const;
+    void status(String& str) const;
+    void dump(String& str) const;
+    void reset();
+    static const TokenDict s_phases[];
+private:
+    struct Slot {
+	u_int64_t counters[CounterCount];
+	u_int64_t usec[PhaseCount];
+	u_int64_t buckets[PhaseCount][METRIC_BUCKETS];
+    };
+    static unsigned int slot();
+    String m_name;
+    int m_active;
+    Slot m_slots[METRIC_SLOTS];
+};
+
+// Compressing view of a response body, send paths read it like the body itself
+class BodyEncoder: public RefObject, public Stream
+{
+public:
+    enum Encoding {
+	Identity = 0,
+	Gzip = 1,
+	Deflate = 2,
+	Brotli = 4,
+    };
+    BodyEncoder(HTTPMetrics* metrics, int encoding, Stream* body, RefObject* ref, unsigned int length);
+    ~BodyEncoder();
+    bool init(int level);
+    virtual bool terminate()
+	{ return true; }
+    virtual bool valid() const
+	{ return true; }
+    virtual int writeData(const void* buffer, int length)
+	{ return -1; }
+    virtual int readData(void* buffer, int length);
+    inline const char* name() const
+	{ return lookup(m_encoding, s_encodings); }
+    static int available();
+    static int negotiate(const String& accept, int offered);
+    static const TokenDict s_encodings[];
+private:
+    int encode(unsigned char* out, unsigned int len);
+    RefPointer<HTTPMetrics> m_metrics;
+    int/*Encoding*/ m_encoding;
+    Stream* m_body;
+    RefPointer<RefObject> m_bodyRef;
+    unsigned int m_bodyLeft;
+    DataBlock m_in;
+    unsigned int m_inPos;
+    unsigned int m_inLen;
+    bool m_inEof;
+    bool m_done;
+    u_int64_t m_bytesIn;
+    u_int64_t m_bytesOut;
+    u_int64_t m_cpuNsec;
+#ifdef HAVE_ZLIB
+    z_stream m_zlib;
+    bool m_zlibInit;
+#endif
+#ifdef HAVE_BROTLI
+    BrotliEncoderState* m_brotli;
+#endif
+};
+
+// One range of a multipart/byteranges body: delimiter and part headers,
+// then length bytes of body from start
+class RangePart : public String
+{
+public:
+    inline RangePart(unsigned int start, unsigned int length)
+	: m_start(start), m_length(length)
+	{ }
+    unsigned int m_start;
+    unsigned int m_length;
+};
+
+// Several ranges of a seekable body, each in it's own part
+class RangeBody: public RefObject, public Stream
+{
+public:
+    RangeBody(Stream* body, RefObject* ref, int64_t base, ObjList& parts,
+	const String& boundary, const String& type, unsigned int total);
+    virtual bool terminate()
+	{ return true; }
+    virtual bool valid() const
+	{ return true; }
+    virtual int writeData(const void* buffer, int length)
+	{ return -1; }
+    virtual int readData(void* buffer, int length);
+    inline unsigned int length() const
+	{ return m_length; }
+private:
+    Stream* m_body;
+    RefPointer<RefObject> m_bodyRef;
+    int64_t m_base;
+    ObjList m_parts;
+    ObjList* m_part;         // part being read
+    unsigned int m_pos;      // position in it's headers and then in it's data
+    unsigned int m_length;
 };
 
 class YHttpMessage: public RefObject
@@ -122,7 +383,7 @@ class YHttpMessage: public RefObject
     friend class Connection;
 public:
     YHttpMessage();
-    const static unsigned long UnknownLength = -1UL;
+    const static unsigned int UnknownLength = (unsigned int)-1;
     virtual ~YHttpMessage();
     Connection* connection()
 	{ return m_conn; }
@@ -141,8 +402,8 @@ public:
 	{ m_headers.setParam(name, value); }
     String getHeader(const char* name) const
 	{ return m_headers.getValue(name); }
-    bool hasHeader(const char* name) const
-	{ return NULL != m_headers.getParam(name); }
+    void clearHeader(const char* name);
+    bool hasHeader(const char* name) const;
     const String& httpVersion() const
 	{ return m_httpVersion; }
     void httpVersion(const String& v)
@@ -161,10 +422,17 @@ public:
 	b->deref();
 	contentLength(body.length());
     }
-    void setBody(TelEngine::Stream* strm, TelEngine::RefObject* ref)
-	{ m_bodyStream = strm; m_bodyObjectRef = ref; }
+    void setBody(TelEngine::Stream* strm, TelEngine::RefObject* ref, TelEngine::File* file = 0)
+	{ m_bodyStream = strm; m_bodyObjectRef = ref; m_bodyFile = file; }
     Stream* bodyStream() const
 	{ return m_bodyStream; }
+    RefObject* bodyRef() const
+	{ return m_bodyObjectRef; }
+    // Body stream when it is a plain file, kept alive by body object reference
+    File* bodyFile() const
+	{ return m_bodyFile; }
+protected:
+    void clear();
 private:
     NamedList m_headers;
     unsigned int m_contentLength;
@@ -172,6 +440,7 @@ private:
     Connection* m_conn;
     String m_httpVersion;
     TelEngine::Stream* m_bodyStream;
+    TelEngine::File* m_bodyFile;
     TelEngine::RefPointer<TelEngine::RefObject> m_bodyObjectRef;
 };
 
@@ -182,11 +451,23 @@ public:
     YHttpRequest(Connection* conn = NULL);
     String m_method, m_uri;
 public:
-    bool parse(const char* buf, int len);
-    void fill(TelEngine::Message& m);
+    bool parse(const char* buf, const HttpHeadParser& head);
+    void fill(TelEngine::Message& m, bool headers = true);
+    void fillHeaders(NamedList& dest, bool missing = false);
     bool bodyExpected() const;
+    bool bodyChunked() const;
+    // Head headers are looked up in table, trailers in parent's list
+    String getHeader(const char* name) const;
+    bool hasHeader(const char* name) const
+	{ return m_table.find(name) >= 0 || YHttpMessage::hasHeader(name); }
+    // Unfolded view of a head header, returns NULL if missing
+    const char* header(int id, unsigned int& len) const;
+    void clear();
+    // direct handler found in route table, messages are skipped if set
+    RefPointer<HttpHandler> m_handler;
 private:
-    bool parseFirst(String& line);
+    DataBlock m_raw;
+    HttpHeaderTable m_table;
 };
 
 class YHttpResponse: public YHttpMessage
@@ -200,8 +481,8 @@ public:
 	{ m_rc = rc; m_statusText = lookup(m_rc, s_httpResponseCodes); }
     String& statusText()
 	{ return m_statusText; }
-    void update(const Message& msg);
-    bool build(DataBlock& buf);
+    void update(const NamedList& params);
+    void clear();
 public:
     int m_rc;
     String m_statusText;
@@ -223,26 +504,242 @@ private:
     Socket** m_sock;
 };
 
+// Direct handler registered for a method and path
+class HTTPRoute : public GenObject
+{
+public:
+    inline HTTPRoute(HttpHandler* handler, const String& path, bool prefix,
+	const String& method, const String& server)
+	: m_handler(handler), m_path(path), m_prefix(prefix), m_method(method), m_server(server)
+	{ }
+    RefPointer<HttpHandler> m_handler;
+    String m_path;
+    bool m_prefix;
+    String m_method;  // empty for any
+    String m_server;  // listener name, empty for all
+};
+
+// Node of route trie, edge from parent is a run of path characters
+class RouteNode : public GenObject
+{
+public:
+    inline RouteNode(const char* label, unsigned int len)
+	: m_label(label, len)
+	{ }
+    void insert(HTTPRoute* route, const char* path, unsigned int len);
+    HTTPRoute* match(const String& method, const String& server, bool exact) const;
+    String m_label;
+    ObjList m_children;
+    ObjList m_routes;     // routes whose path ends here, owned by table
+};
+
+// Paths served by direct handlers, handles http.register messages
+class HTTPRoutes : public Mutex
+{
+public:
+    HTTPRoutes();
+    ~HTTPRoutes();
+    bool received(Message& msg);
+    HttpHandler* find(const String& method, const String& uri, const String& server);
+    void list(String& str);
+    inline unsigned int count() const
+	{ return m_count; }
+private:
+    void add(HttpHandler* handler, const String& path, bool prefix,
+	const String& method, const String& server);
+    unsigned int remove(HttpHandler* handler, const String& path);
+    void rebuild();
+    ObjList m_routes;
+    RouteNode* m_root;
+    unsigned int m_count;
+};
+
+static HTTPRoutes s_routes;
+
+// Event loop that takes a connection back after a worker is done with it
+class HTTPDriver
+{
+public:
+    virtual ~HTTPDriver()
+	{ }
+    virtual void resume(Connection* conn, void* data) = 0;
+    // Another thread completed what a waiting connection needs (deferred
+    // response, room in streamed body), connection is referenced
+    virtual void wake(Connection* conn) = 0;
+};
+
+// Token of a response a handler gives later, see HttpDeferred
+// Registered by id until it's request is done with it
+class DeferredResponse : public HttpDeferred, public Mutex
+{
+public:
+    DeferredResponse(Connection* conn, unsigned int timeout);
+    virtual const String& id() const
+	{ return m_id; }
+    virtual const String& toString() const
+	{ return m_id; }
+    virtual bool complete(Message& msg);
+    virtual void defer();
+    bool park(HTTPDriver* driver, bool timed = true);
+    void detach();
+    bool deferred();
+    inline bool done() const
+	{ return m_done; }
+    inline int status() const
+	{ return m_status; }
+    inline bool expired() const
+	{ return m_expired; }
+    static DeferredResponse* find(const String& id);
+    static void expire(u_int32_t now);
+    static unsigned int count();
+    // response, valid once done
+    NamedList m_params;
+    String m_body;
+    Stream* m_stream;
+    RefPointer<RefObject> m_ref;
+    File* m_file;
+private:
+    bool finish(int status);
+    String m_id;
+    Connection* m_conn;
+    HTTPDriver* m_driver;
+    bool m_deferred;
+    bool m_parked;
+    bool m_done;
+    bool m_expired;
+    int m_status;
+    unsigned int m_timeout;
+    u_int32_t m_deadline;
+};
+
+// Request body handed to handler while it arrives, see HttpBody
+// Written in connection's event loop, read from any thread
+class StreamedBody : public HttpBody, public Stream, public Mutex
+{
+public:
+    StreamedBody(Connection* conn, HTTPDriver* driver, unsigned int window);
+    virtual void* getObject(const String& name) const;
+    virtual int read(void* buf, unsigned int len, long maxwait);
+    virtual bool finished() const;
+    virtual bool failed() const
+	{ return m_failed; }
+    virtual void reader(HttpBodyReader* rd);
+    virtual bool terminate();
+    virtual bool valid() const
+	{ return !m_failed; }
+    virtual int writeData(const void* buffer, int length);
+    virtual int readData(void* buffer, int length)
+	{ return read(buffer, length, 0); }
+    unsigned int room();
+    unsigned int ack();
+    void detach();
+    void nowait(bool on);
+    inline bool ended() const
+	{ return m_ended; }
+private:
+    void notify();
+    Semaphore m_sem;
+    DataBlock m_data;
+    unsigned int m_offset;
+    unsigned int m_window;
+    unsigned int m_consumed;  // read since connection last took it
+    Connection* m_conn;
+    HTTPDriver* m_driver;
+    HttpBodyReader* m_reader;
+    bool m_ended;
+    bool m_failed;
+    bool m_waiting;           // reader waits on semaphore
+    bool m_woke;              // connection was woken to take consumed
+    bool m_nowait;            // reader runs on connection's thread, nothing arrives meanwhile
+};
+
 class HTTPServerListener : public RefObject
 {
     friend class HTTPServerThread;
+    friend class HTTPUring;
 public:
-    inline HTTPServerListener(const NamedList& sect)
-	: m_cfg(sect)
+    inline HTTPServerListener(const NamedList& sect, HTTPMetrics* metrics, unsigned int shard = 0, unsigned int shards = 1)
+	: m_cfg(sect), m_shard(shard), m_shards(shards), m_reactor(false), m_uring(0),
+	  m_metrics(metrics), m_headers(""), m_encodings(0), m_compressLevel(6), m_compressMin(0),
+	  m_compressTypes(0), m_maxConns(0), m_maxPerPeer(0), m_stopping(false), m_takenOver(false),
+	  m_drainUntil(0), m_handshakeTimeout(0)
 	{ }
     ~HTTPServerListener();
-    void init();
+    bool init(RefPointer<HTTPWorkers>& workers, HTTPServerListener* prev = 0);
+    void stop();
     inline NamedList& cfg()
 	{ return m_cfg; }
+    inline unsigned int shard() const
+	{ return m_shard; }
+    inline unsigned int shards() const
+	{ return m_shards; }
+    // not accepting any more, connections are asked to close
+    inline bool draining() const
+	{ return m_drainUntil != 0; }
+    static void drain(u_int32_t now);
+    inline HTTPWorkers* workers() const
+	{ return m_workers; }
+    inline HTTPMetrics* metrics() const
+	{ return m_metrics; }
     const String& address() const
 	{ return m_address; }
+    // headers added to every response, from ohdr_ keys of listener section
+    inline const NamedList& headers() const
+	{ return m_headers; }
+    inline const String& headersBlock() const
+	{ return m_headersBlock; }
+    // response compression, from compress* keys of listener section
+    inline int encodings() const
+	{ return m_encodings; }
+    inline int compressLevel() const
+	{ return m_compressLevel; }
+    inline unsigned int compressMin() const
+	{ return m_compressMin; }
+    bool compressType(const String& type) const;
+    bool admit(Socket* sock, const SocketAddr& sa);
+    Connection* checkCreate(Socket* sock, const SocketAddr& sa, bool nonblock = false, TLSSocket* tls = 0);
+    // seconds an accepted TLS connection may take to finish it's handshake
+    inline unsigned int handshakeTimeout() const
+	{ return m_handshakeTimeout; }
+#ifdef HAVE_OPENSSL
+    // TLS done by module itself, NULL if socket.ssl handler does it
+    inline TLSContext* tls() const
+	{ return m_tls; }
+#endif
 private:
+    void initCompress();
     void run();
-    bool initSocket();
-    Connection* checkCreate(Socket* sock, const SocketAddr& sa);
+    bool initSocket(HTTPServerListener* prev);
+    bool bindSocket(const SocketAddr& sa);
+    Socket* accept(SocketAddr& sa, bool nonblock);
+    void acceptPending(bool nonblock);
+    Connection* create(Socket* sock, const SocketAddr& sa, bool nonblock, TLSSocket* tls);
+    void initBackend();
+    void initWorkers();
     NamedList m_cfg;
+    unsigned int m_shard;
+    unsigned int m_shards;
     Socket m_socket;
     String m_address;
+    bool m_reactor;
+    HTTPUring* m_uring;
+    RefPointer<HTTPWorkers> m_workers;
+    RefPointer<HTTPMetrics> m_metrics;
+    NamedList m_headers;
+    String m_headersBlock;
+    int m_encodings;
+    int m_compressLevel;
+    unsigned int m_compressMin;
+    ObjList* m_compressTypes;
+    unsigned int m_maxConns;
+    unsigned int m_maxPerPeer;
+    bool m_stopping;
+    bool m_takenOver;         // replacing listener holds socket open
+    u_int32_t m_drainUntil;
+    unsigned int m_handshakeTimeout;
+#ifdef HAVE_OPENSSL
+    RefPointer<TLSContext> m_tls;
+#endif
 };
 
 class HTTPServerThread : public Thread
@@ -257,8 +754,23 @@ private:
     RefPointer<HTTPServerListener> m_listener;
 };
 
-class Connection: public RefObject, public Thread
+// Thread serving one connection (threaded mode) or running an upgraded one
+class ConnectionThread : public Thread
+{
+public:
+    inline ConnectionThread(Connection* conn)
+	: Thread("HTTPServer connection"), m_conn(conn)
+	{ }
+    virtual void run();
+private:
+    RefPointer<Connection> m_conn;
+};
+
+class Connection: public RefObject, public HttpExchange
 {
+    friend class HTTPReactor;
+    friend class HTTP2Session;
+    friend class ConnTimers;
 public:
     enum ConnToken {
 	KeepAlive = 1,
@@ -267,53 +779,719 @@ public:
 	Trailers = 4,
 	Upgrade = 8,
     };
+    enum State {
+	ReadHead,     // waiting for complete request head
+	Dispatching,  // a worker is running message handlers
+	ReadBody,     // feeding request body to its stream
+	SendResponse, // transmitting response head and body
+	Upgraded,     // socket is handed over to http.upgrade handler
+	Http2,        // HTTP/2 frames, streams are handled by m_h2
+    };
+    enum Chunk {
+	ChunkNone,    // body is not chunked
+	ChunkSize,    // waiting for chunk size line
+	ChunkData,    // feeding chunk payload
+	ChunkEnd,     // waiting for CRLF after payload
+	ChunkTrailer, // waiting for trailer lines
+    };
+    enum Job {
+	JobRoute,     // http.route, http.upgrade, http.preserve
+	JobServe,     // http.serve
+	JobDeferred,  // response of a deferred http.serve arrived
+    };
 private:
     static TokenDict s_connTokens[];
-    void connectionHeader(const char* hdr);
+    void connectionHeader(const char* hdr, unsigned int len);
     String connectionHeader();
 public:
-    Connection(Socket* sock, HTTPServerListener* listener);
+    Connection(Socket* sock, HTTPServerListener* listener, TLSSocket* tls = 0);
     ~Connection();
 
     virtual void* getObject (const String& name) const;
-    virtual void run();
     void runConnection();
-    inline const String& address() const
+    void runUpgrade();
+    bool readable(bool drain = true);
+    bool writable();
+    bool input(const void* data, int len);
+    bool output(const void*& data, unsigned int& len);
+    void sent(unsigned int len);
+    void runJob();
+    bool resume();
+    bool woken();
+    void reset();
+    inline bool wantRead() const
+	{ return m_state == ReadHead || m_state == ReadBody || m_state == Http2; }
+    inline bool wantWrite() const;
+    // HTTP/2 peer may send frames while we are still writing
+    inline bool duplex() const
+	{ return m_state == Http2; }
+    inline bool upgraded() const
+	{ return m_state == Upgraded; }
+    inline bool dispatching() const
+	{ return m_state == Dispatching; }
+    // A worker runs a job of this connection, it can't be reset meanwhile
+    inline bool working() const
+	{ return m_working; }
+    // Event loop gave up on connection, it is closed once worker is back
+    inline void drop()
+	{ m_dropped = true; }
+    // Streamed request body waits for it's reader to make room
+    inline bool stalled() const
+	{ return m_state == ReadBody && m_reqStream && !m_reqStream->room(); }
+    inline void driver(HTTPDriver* drv, void* data = 0)
+	{ m_driver = drv; m_driverData = data; }
+    inline void* driverData() const
+	{ return m_driverData; }
+    inline u_int64_t queued() const
+	{ return m_queued; }
+    inline void wakeDriver()
+	{ m_driver->resume(this, m_driverData); }
+    // Listener is draining, let event loop tell HTTP/2 peer
+    inline void drain()
+	{ if (m_driver && ref()) m_driver->wake(this); }
+    inline HTTPServerListener* listener() const
+	{ return m_listener; }
+    inline Socket* socket() const
+	{ return m_socket; }
+    virtual const String& address() const
 	{ return m_remote.addr(); }
     inline const NamedList& cfg() const
 	{ return m_listener->cfg(); }
-    void checkTimer(u_int64_t time);
+    // Put current phase's deadline on timer wheel, after each event handled
+    void timer();
+    // Timer wheel found deadline passed, return true if connection timed out
+    bool checkTimer(u_int32_t now);
+    void expire(int kind);
+    // HttpExchange, current request as direct handlers see it
+    virtual const String& server() const
+	{ return cfg(); }
+    virtual const String& method() const
+	{ return m_req->m_method; }
+    virtual const String& uri() const
+	{ return m_req->m_uri; }
+    virtual const String& version() const
+	{ return m_req->httpVersion(); }
+    virtual String header(const char* name) const
+	{ return m_req->getHeader(name); }
+    virtual const String& param(const String& name);
+    virtual const DataBlock* body() const
+	{ return m_reqBodyBuffer ? &m_reqBodyBuffer->data() : 0; }
+    virtual void bodyStream(Stream* strm, RefObject* ref)
+	{ m_req->setBody(strm, ref); }
+    virtual void maxBody(unsigned int len)
+	{ m_bodyMax = len; }
+    virtual void streamBody(unsigned int window = 0);
+    virtual HttpBody* streamedBody()
+	{ return m_reqStream; }
+    virtual void status(int code)
+	{ m_rsp->status(code); }
+    virtual void setHeader(const char* name, const char* value)
+	{ m_rsp->setHeader(name, value); }
+    virtual void setBody(const String& body)
+	{ m_rsp->setBody(body); }
+    virtual void setBody(const DataBlock& body)
+	{ m_rsp->setBody(body); }
+    virtual void setBody(Stream* strm, RefObject* ref, unsigned int length, File* file = 0);
+    virtual void keepAlive(bool keep)
+	{ m_keepalive = keep; }
+    virtual HttpDeferred* defer();
+    DeferredResponse* token();
 private:
-    bool received(unsigned long rlen);
-    bool readRequestBody(Message& msg);
+    void counted(bool add);
+    NamedList* requestParams();
+    const NamedString* requestParam(const String& name);
+    bool received();
+    void consume(unsigned int len);
+    inline const char* rcvData() const
+	{ return (const char*)m_rcvBuffer.data() + m_rcvOffset; }
+    inline unsigned int rcvLength() const
+	{ return m_rcvLength - m_rcvOffset; }
+    void newResponse();
+    bool processHead(unsigned int headLen);
+    Message* routeMessage(bool bodyExpected);
+    Message* routeMessage(YHttpRequest* req, bool bodyExpected);
+    bool upgradeHttp2(unsigned int bodyOffs);
+    unsigned char* sendSpace(unsigned int len);
+    bool startJob(int job);
+    bool jobDone();
+    int routeRequest();
+    int routeDirect();
+    void requestBuffer();
+    bool routed(int status);
+    bool readRequestBody();
+    bool readChunkedBody();
+    bool bodyComplete();
+    bool bodyError(int code);
+    int serveRequest();
+    int serveDirect();
+    int deferredResponse();
+    void prepareResponse(const NamedList& params, const String& body,
+	Stream* strm, RefObject* ref, File* file);
+    void keepAliveFlags();
+    bool served(int status);
+    void encodeBody();
+    void byteRanges(YHttpRequest& req, YHttpResponse& rsp);
     bool sendResponse(YHttpResponse& rsp);
+    void buildHead(YHttpResponse& rsp, bool chunked);
+    const char* dateHeader();
     bool sendErrorResponse(int code);
-    bool sendData(unsigned int length, unsigned int offset = 0);
+    bool fillSendBuffer();
+    bool canBatch(unsigned int pending);
+    int sendFile();
+    bool finishRequest();
     void appendMissingErrorResponseBody(YHttpResponse& rsp);
+    int timerKind() const;
+    inline void touch()
+	{ m_active = Time::secNow(); }
 private:
     Socket* m_socket;
+    TLSSocket* m_tls;         // same socket when TLS is done by module
+    int/*State*/ m_state;
     DataBlock m_rcvBuffer;
+    unsigned int m_rcvOffset;
+    unsigned int m_rcvLength;
+    HttpHeadParser m_head;
     DataBlock m_sndBuffer;
+    unsigned int m_sndOffset;
+    unsigned int m_sndLength;
+    unsigned int m_sndLeft;
+    bool m_sndChunked;
+    bool m_sndEof;
+    int m_sndFile;
+    int64_t m_sndFileOffset;
+    bool m_sendFile;
     SocketAddr m_local, m_remote;
     RefPointer<HTTPServerListener> m_listener;
     RefPointer<YHttpRequest> m_req;
     RefPointer<YHttpResponse> m_rsp;
+    // kept from previous request for reuse, freed with connection
+    RefPointer<YHttpRequest> m_spareReq;
+    RefPointer<YHttpResponse> m_spareRsp;
+    RefPointer<BodyBuffer> m_spareBody;
+    Message* m_msg;
+    BodyBuffer* m_reqBodyBuffer;
+    unsigned int m_bodyLeft;
+    unsigned int m_bodyRead;
+    unsigned int m_bodyMax;
+    bool m_bodyUntilEof;
+    int/*Chunk*/ m_chunkState;
+    unsigned int m_chunkLeft;
+    unsigned int m_trailerLen;   // trailer bytes and lines, limited like head
+    unsigned int m_trailerCount;
+    NamedList m_trailers;        // came while handler of streamed body ran
+    bool m_rcvEof;
+    RefPointer<RefObject> m_upgradeRef;
+    Runnable* m_upgradeCode;
+    u_int32_t m_active;       // last time connection made progress
+    u_int32_t m_headStart;    // first byte of request head arrived
+    Connection* m_tmNext;     // timer wheel slot links, changed under it's lock
+    Connection** m_tmPrev;
+    u_int32_t m_tmWhen;       // second of wheel slot, 0 if not in one
+    u_int32_t m_deadline;     // when current phase times out, 0 if never
+    int m_tmKind;
+    int m_timedOut;
+    unsigned int m_events;
+    HTTPDriver* m_driver;
+    void* m_driverData;
+    int/*Job*/ m_job;
+    int m_jobStatus;
+    u_int64_t m_queued;
+    bool m_working;
+    bool m_dropped;
     bool m_keepalive;
     unsigned int m_maxRequests;
     unsigned int m_maxReqBody;
     unsigned int m_maxSendChunkSize;
+    unsigned int m_chunkDigits;
+    unsigned int m_maxRanges;
     unsigned int m_timeout;
+    unsigned int m_headTimeout;
+    unsigned int m_bodyTimeout;
+    unsigned int m_sendTimeout;
+    bool m_sendDate;
+    u_int32_t m_dateTime;
+    char m_date[40];
     int/*ConnToken*/ m_connection;
+    bool m_lazyParams;
+    NamedList m_reqParams;
+    bool m_reqParamsAll;
+    bool m_http2;
+    bool m_h2c;
+    HTTP2Session* m_h2;
+    HTTPMetrics* m_metrics;
+    u_int64_t m_mark;         // start of current phase
+    unsigned int m_served;    // responses sent on this connection
+    RefPointer<DeferredResponse> m_deferred;  // token taken by handler
+    unsigned int m_deferTimeout;
+    RefPointer<StreamedBody> m_reqStream;     // body handler reads while it arrives
+    bool m_serving;                           // streamed body handler not returned yet
+    int m_bodyError;                          // body failed meanwhile, sent once it did
+    unsigned int m_streamWindow;              // handler asked for streamed body
+    unsigned int m_bodyWindow;
+};
+
+// Hierarchical wheel of one second slots holding all connections that have
+// a timeout running. A deadline moved later leaves connection in it's slot,
+// it is put further when that comes due
+class ConnTimers : public Mutex
+{
+public:
+    enum Kind {
+	None = 0,
+	Head,         // request head started but is not complete
+	Body,         // request body stopped coming
+	Idle,         // keepalive connection waits for next request
+	Send,         // peer doesn't take response
+	Drain,        // outlived drain time of reloaded listener
+	Kinds
+    };
+    ConnTimers();
+    void schedule(Connection* conn, u_int32_t when, int kind);
+    void cancel(Connection* conn);
+    void tick(u_int32_t now);
+    void expired(int kind);
+    void status(String& str);
+    static const TokenDict s_kinds[];
+private:
+    void link(Connection* conn, u_int32_t when);
+    void unlink(Connection* conn);
+    void cascade(Connection*& slot);
+    Connection* m_slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    u_int32_t m_now;
+    unsigned int m_armed;
+    unsigned int m_expired[Kinds];
+};
+
+static ConnTimers s_timers;
+
+// One HTTP/2 request/response exchange
+class HTTP2Stream : public RefObject
+{
+public:
+    inline HTTP2Stream(u_int32_t id, int window)
+	: m_id(id), m_job(-1), m_msg(0), m_bodyBuffer(0), m_bodyRead(0), m_bodyMax(0), m_unacked(0),
+	  m_routed(false), m_remoteEnd(false), m_sending(false), m_reset(false),
+	  m_done(false), m_window(window), m_sndLeft(0), m_sendStart(0), m_trailers("")
+	{ }
+    ~HTTP2Stream();
+    u_int32_t m_id;
+    int m_job;               // job waiting for it's turn, -1 if none
+    RefPointer<YHttpRequest> m_req;
+    RefPointer<YHttpResponse> m_rsp;
+    Message* m_msg;
+    BodyBuffer* m_bodyBuffer;
+    DataBlock m_pending;     // body that arrived before request was routed
+    unsigned int m_bodyRead;
+    unsigned int m_bodyMax;
+    unsigned int m_unacked;  // received before routing, window not given back yet
+    bool m_routed;
+    bool m_remoteEnd;        // peer is done sending
+    bool m_sending;          // response head is out, body follows
+    bool m_reset;            // reset by peer while it's handlers were running
+    bool m_done;             // finished, to be removed from session
+    int64_t m_window;        // how much peer lets us send
+    unsigned int m_sndLeft;  // body left to send, UnknownLength if not known
+    u_int64_t m_sendStart;   // when response head was sent
+    RefPointer<DeferredResponse> m_deferred;  // waiting for response
+    RefPointer<StreamedBody> m_streamed;      // handler reads body as it arrives
+    NamedList m_trailers;    // came while it's handlers were running
+};
+
+// HTTP/2 framing of a connection. Handlers of streams take turns in
+// connection's job slot, frames of other streams keep flowing meanwhile
+class HTTP2Session
+{
+public:
+    enum FrameType {
+	Data = 0,
+	Headers = 1,
+	Priority = 2,
+	RstStream = 3,
+	Settings = 4,
+	PushPromise = 5,
+	Ping = 6,
+	Goaway = 7,
+	WindowUpdate = 8,
+	Continuation = 9,
+    };
+    enum Flag {
+	EndStream = 0x01,
+	Ack = 0x01,
+	EndHeaders = 0x04,
+	Padded = 0x08,
+	PriorityFlag = 0x20,
+    };
+    enum Error {
+	NoError = 0,
+	ProtocolError = 1,
+	InternalError = 2,
+	FlowControlError = 3,
+	StreamClosed = 5,
+	FrameSizeError = 6,
+	RefusedStream = 7,
+	CompressionError = 9,
+	EnhanceYourCalm = 11,
+    };
+    HTTP2Session(Connection* conn);
+    ~HTTP2Session();
+    void start();
+    bool upgrade(const String& h2settings, YHttpRequest* req, Message* msg);
+    bool received();
+    bool jobDone();
+    bool poll();
+    bool waiting() const;
+    bool fill();
+    bool wantWrite() const;
+    inline bool finished() const
+	{ return m_failed || (m_goaway && !m_current && !m_streams.skipNull()); }
+    // Mark connection half closed, return true if it already was
+    inline bool halfClose()
+	{ bool was = m_halfClosed; m_halfClosed = true; return was; }
+private:
+    bool frame(int type, int flags, u_int32_t id, const unsigned char* data, unsigned int len);
+    bool dataFrame(u_int32_t id, int flags, const unsigned char* data, unsigned int len);
+    bool headersFrame(u_int32_t id, int flags, const unsigned char* data, unsigned int len);
+    bool headerBlock();
+    bool request(u_int32_t id, bool endStream, const NamedList& hdrs);
+    bool settings(const unsigned char* data, unsigned int len, bool ack);
+    bool runJobs();
+    void queueJob(HTTP2Stream* st, int job);
+    void routed(HTTP2Stream* st);
+    bool bodyData(HTTP2Stream* st, const void* data, unsigned int len);
+    void bodyDone(HTTP2Stream* st);
+    void trailers(HTTP2Stream* st, const NamedList& hdrs);
+    StreamedBody* streamed(HTTP2Stream* st) const;
+    void sendHeaders(HTTP2Stream* st);
+    void sendError(HTTP2Stream* st, int code);
+    int sendData(HTTP2Stream* st);
+    void finish(HTTP2Stream* st);
+    void closeStream(HTTP2Stream* st);
+    void purge();
+    HTTP2Stream* find(u_int32_t id) const;
+    void resetStream(u_int32_t id, int error);
+    bool connError(int error);
+    void goaway(int error);
+    void windowUpdate(u_int32_t id, unsigned int inc);
+    void putFrame(int type, int flags, u_int32_t id, const void* data, unsigned int len);
+    Connection* m_conn;
+    bool m_preface;          // got client connection preface
+    bool m_goaway;           // no new streams, close when current ones are done
+    bool m_failed;           // connection error, just waiting for GOAWAY to go out
+    bool m_halfClosed;       // we are done, input is drained until peer closes
+    ObjList m_streams;
+    ObjList m_jobs;          // streams waiting for connection's job slot
+    HTTP2Stream* m_current;  // stream whose job is running
+    HpackDecoder m_decoder;
+    DataBlock m_block;       // header block gathered from CONTINUATION frames
+    u_int32_t m_blockStream;
+    int m_blockFlags;
+    u_int32_t m_lastStream;
+    int64_t m_window;        // connection level send window
+    unsigned int m_initWindow;
+    unsigned int m_maxFrame;
+    unsigned int m_maxStreams;
+};
+
+inline bool Connection::wantWrite() const
+{
+    return m_state == SendResponse || m_sndOffset < m_sndLength ||
+	(m_h2 && m_state == Http2 && m_h2->wantWrite());
+}
+
+#ifdef HAVE_EPOLL
+// Event loop thread owning a share of the reactor mode connections
+class HTTPReactor : public Thread, public HTTPDriver
+{
+public:
+    HTTPReactor();
+    ~HTTPReactor();
+    virtual void run();
+    virtual void resume(Connection* conn, void* data);
+    virtual void wake(Connection* conn);
+    bool attach(Connection* conn);
+    inline unsigned int count() const
+	{ return m_count; }
+    static unsigned int start(unsigned int threads);
+    static bool assign(Connection* conn);
+private:
+    void process(Connection* conn, unsigned int events);
+    void settle(Connection* conn, bool ok);
+    void resumed();
+    bool update(Connection* conn);
+    void close(Connection* conn);
+    int m_epoll;
+    int m_wake;
+    Mutex m_mutex;
+    ObjList m_conns;
+    ObjList m_resumed;
+    ObjList m_woken;
+    unsigned int m_count;
+};
+
+static HTTPReactor** s_reactors = 0;
+static unsigned int s_reactorCount = 0;
+
+// Accepted TLS connection waiting for it's handshake
+class TLSPending : public GenObject
+{
+public:
+    TLSPending(HTTPServerListener* listener, Socket* sock, const SocketAddr& addr);
+    ~TLSPending();
+    void release();
+    RefPointer<HTTPServerListener> m_listener;
+    Socket* m_sock;
+    TLSSocket* m_tls;
+    SocketAddr m_addr;
+    u_int64_t m_start;
+    u_int32_t m_deadline;
+    unsigned int m_events;
+};
+
+// Thread finishing TLS handshakes of accepted connections, so neither
+// accept threads nor event loops wait for slow clients or do the crypto
+class TLSHandshaker : public Thread
+{
+public:
+    TLSHandshaker();
+    ~TLSHandshaker();
+    virtual void run();
+    inline unsigned int count() const
+	{ return m_count; }
+    static unsigned int start(unsigned int threads);
+    static bool queue(HTTPServerListener* listener, Socket* sock, const SocketAddr& addr);
+    static unsigned int pending();
+private:
+    void incoming();
+    void begin(TLSPending* p);
+    void step(TLSPending* p);
+    void finish(TLSPending* p, bool ok);
+    void expire(u_int32_t now);
+    int m_epoll;
+    int m_wake;
+    Mutex m_mutex;
+    ObjList m_queue;
+    ObjList m_pending;
+    unsigned int m_count;
+};
+
+static TLSHandshaker** s_handshakers = 0;
+static unsigned int s_handshakerCount = 0;
+#endif
+
+#ifdef HAVE_OPENSSL
+// Server TLS settings of an openssl.conf context with session cache and
+// ticket keys. Shared by listeners with same settings and kept across
+// reloads, so clients can resume sessions on any of them
+class TLSContext : public RefObject
+{
+public:
+    TLSContext(const NamedList& params);
+    ~TLSContext();
+    bool init();
+    SSL* create(int fd, bool http2);
+    void rotate(u_int32_t now);
+    inline const NamedList& params() const
+	{ return m_params; }
+    static TLSContext* get(const String& name, const NamedList& cfg);
+    static void rotateAll(u_int32_t now);
+    static void prune();
+private:
+    struct TicketKey {
+	unsigned char name[TLS_KEY_NAME];
+	unsigned char aes[32];
+	unsigned char hmac[32];
+    };
+    bool newKey(TicketKey& key);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static int ticketKey(SSL* ssl, unsigned char* name, unsigned char* iv,
+	EVP_CIPHER_CTX* ectx, EVP_MAC_CTX* hctx, int enc);
+#else
+    static int ticketKey(SSL* ssl, unsigned char* name, unsigned char* iv,
+	EVP_CIPHER_CTX* ectx, HMAC_CTX* hctx, int enc);
+#endif
+    static int selectAlpn(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+	const unsigned char* in, unsigned int inlen, void* arg);
+    NamedList m_params;
+    SSL_CTX* m_ctx;
+    Mutex m_keyMutex;
+    TicketKey m_keys[2];      // current and previous
+    unsigned int m_rotate;
+    u_int32_t m_rotated;
+};
+
+static ObjList s_tlsContexts;
+
+// Socket encrypting through OpenSSL on it's own descriptor
+class TLSSocket : public Socket
+{
+public:
+    TLSSocket(SOCKET handle, SSL* ssl);
+    virtual ~TLSSocket();
+    virtual bool terminate();
+    virtual int writeData(const void* buffer, int length);
+    virtual int readData(void* buffer, int length);
+    // Go on with handshake: 1 done, 0 wait for socket, -1 failed
+    int handshake();
+    inline bool wantWrite() const
+	{ return m_wantWrite; }
+    // decrypted data waits that socket won't signal
+    inline bool pending() const
+	{ return m_ssl && ::SSL_pending(m_ssl) > 0; }
+    inline bool resumed() const
+	{ return m_ssl && ::SSL_session_reused(m_ssl); }
+    // Kernel encrypts what we send, file bodies can go with sendFile()
+    bool ktls() const;
+    // Send from file at offset, moving it. Return bytes sent or -1
+    int sendFile(int fd, int64_t& offset, unsigned int length);
+private:
+    int result(int ret, bool write);
+    SSL* m_ssl;
+    bool m_wantWrite;
+};
+#endif
+
+#ifdef HAVE_LIBURING
+// Connection served by io_uring backend, lives until all it's operations complete
+class UringConn : public GenObject
+{
+public:
+    inline UringConn(Connection* conn)
+	: m_conn(conn), m_fd(conn->socket()->handle()), m_pending(0),
+	  m_recv(false), m_sending(false), m_closing(false), m_paused(false)
+	{ }
+    RefPointer<Connection> m_conn;
+    DataBlock m_out;  // data of send in flight, connection may grow it's buffer meanwhile
+    int m_fd;
+    unsigned int m_pending;
+    bool m_recv;
+    bool m_sending;
+    bool m_closing;
+    bool m_paused;    // receive stopped while request body is stalled
+};
+
+// Accept, receive and send through io_uring for all connections of a listener
+class HTTPUring : public HTTPDriver
+{
+public:
+    enum Op {
+	Accept = 0,
+	Recv = 1,
+	Send = 2,
+	Cancel = 3,
+	Wake = 4,
+    };
+    HTTPUring(HTTPServerListener* listener);
+    ~HTTPUring();
+    bool init(int fd);
+    void run();
+    void stop();
+    virtual void resume(Connection* conn, void* data);
+    virtual void wake(Connection* conn);
+private:
+    bool armWake();
+    void resumed();
+    struct io_uring_sqe* getSqe();
+    void submit(struct io_uring_sqe* sqe, UringConn* c, int op);
+    void complete(struct io_uring_cqe* cqe);
+    bool armAccept();
+    bool armRecv(UringConn* c);
+    void pump(UringConn* c);
+    void flow(UringConn* c);
+    void accepted(int fd);
+    void received(UringConn* c, struct io_uring_cqe* cqe);
+    void sent(UringConn* c, int res);
+    void close(UringConn* c);
+    void release(UringConn* c);
+    HTTPServerListener* m_listener;
+    bool m_accepting;
+    struct io_uring m_ring;
+    struct io_uring_buf_ring* m_bufRing;
+    unsigned char* m_bufs;
+    unsigned int m_bufCount;
+    unsigned int m_bufSize;
+    bool m_ringOk;
+    bool m_multishot;
+    int m_listenFd;
+    int m_wake;
+    uint64_t m_wakeBuf;
+    Mutex m_mutex;
+    ObjList m_conns;
+    ObjList m_resumed;
+    ObjList m_woken;
+};
+#endif
+
+// Fixed set of threads running message handlers for a listener
+class HTTPWorkers : public RefObject
+{
+public:
+    enum Overflow {
+	Queue,        // queue anyway
+	Reject,       // answer 503
+	Drop,         // close connection
+    };
+    HTTPWorkers(const NamedList& cfg);
+    unsigned int start(unsigned int threads);
+    int enqueue(Connection* conn);
+    Connection* dequeue(long maxwait);
+    void done(u_int64_t wait, u_int64_t run);
+    void status(String& str);
+    inline unsigned int threads() const
+	{ return m_threads; }
+    // Listener shards using pool, threads exit after last one is gone
+    void attach();
+    void detach();
+    inline bool stopped() const
+	{ return m_stopped; }
+private:
+    Mutex m_mutex;
+    Semaphore m_sem;
+    ObjList m_queue;
+    unsigned int m_queued;
+    unsigned int m_maxQueue;
+    int/*Overflow*/ m_overflow;
+    unsigned int m_threads;
+    u_int64_t m_jobs;
+    u_int64_t m_overflows;
+    u_int64_t m_waitUsec;
+    u_int64_t m_runUsec;
+    u_int64_t m_maxWait;
+    unsigned int m_users;
+    bool m_stopped;
+};
+
+class HTTPWorker : public Thread
+{
+public:
+    inline HTTPWorker(HTTPWorkers* pool)
+	: Thread("HTTPServer worker"), m_pool(pool)
+	{ }
+    virtual void run();
+private:
+    RefPointer<HTTPWorkers> m_pool;
 };
 
-class HTTPServer : public Plugin
+class HTTPServer : public Module
 {
 public:
+    enum {
+	Register = Private,
+	Complete = (Private << 1),
+    };
     HTTPServer();
     ~HTTPServer();
     virtual void initialize();
     virtual bool isBusy() const;
+    virtual bool received(Message& msg, int id);
+protected:
+    virtual void statusModule(String& str);
+    virtual void statusParams(String& str);
+    virtual void statusDetail(String& str);
+    virtual bool commandExecute(String& retVal, const String& line);
+    virtual bool commandComplete(Message& msg, const String& partLine, const String& partWord);
+    virtual void msgTimer(Message& msg);
 private:
+    void metrics(ObjList& list);
     bool m_first;
 };
 
@@ -323,6 +1501,7 @@ YHttpMessage::YHttpMessage()
     , m_conn(NULL)
     , m_httpVersion("1.0")
     , m_bodyStream(NULL)
+    , m_bodyFile(NULL)
 {
     XDebug(DebugAll,"YHttpMessage[%p]::YHttpMessage()",this);
 }
@@ -332,35 +1511,70 @@ YHttpMessage::~YHttpMessage()
     XDebug(DebugAll,"YHttpMessage[%p]::~YHttpMessage()",this);
 }
 
+// Forget previous message so object can be used again on same connection
+void YHttpMessage::clear()
+{
+    m_headers.clearParams();
+    m_contentLength = UnknownLength;
+    m_httpVersion = "1.0";
+    setBody(0, 0);
+}
+
+// Remove header in whatever case handler gave it's name
+void YHttpMessage::clearHeader(const char* name)
+{
+    ObjList* l = m_headers.paramList()->skipNull();
+    while (l) {
+	if (static_cast<NamedString*>(l->get())->name() &= name) {
+	    l->remove();
+	    l = l->skipNull();
+	}
+	else
+	    l = l->skipNext();
+    }
+}
+
+// Header names match whatever case handlers and listeners gave them in
+bool YHttpMessage::hasHeader(const char* name) const
+{
+    for (const ObjList* l = m_headers.paramList()->skipNull(); l; l = l->skipNext()) {
+	if (static_cast<const NamedString*>(l->get())->name() &= name)
+	    return true;
+    }
+    return false;
+}
+
 void YHttpMessage::connection(Connection* conn)
 {
     m_conn = conn;
     XDebug(DebugAll,"YHttpMessage[%p]::connection(%p)",this,conn);
 }
 
-// XXX from modules/ysipchan.cpp
+// Number of online processors, for one listener shard per core
+static unsigned int cpuCount()
+{
+#ifdef __linux__
+    long n = ::sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0)
+	return (n < 64) ? n : 64;
+#endif
+    return 1;
+}
 
-// Find an empty line in a buffer
-// Return the position past it or buffer length + 1 if not found
-// NOTE: returned value may be buffer length
-static inline unsigned int getEmptyLine(const char* buf, unsigned int len)
+// Same parameters, in any order
+static bool sameParams(const NamedList& a, const NamedList& b)
 {
-    int count = 0;
-    unsigned int i = 0;
-    for (; count < 2 && i < len; i++) {
-	if (buf[i] == '\r') {
-	    i++;
-	    if (i < len && buf[i] == '\n')
-		count++;
-	    else
-		count = 0;
-	}
-	else if (buf[i] == '\n')
-	    count++;
-	else
-	    count = 0;
+    if (a.length() != b.length())
+	return false;
+    for (unsigned int i = 0; i < a.length(); i++) {
+	const NamedString* p = a.getParam(i);
+	if (!p)
+	    continue;
+	const NamedString* q = b.getParam(p->name());
+	if (!q || *q != *p)
+	    return false;
     }
-    return (count == 2) ? i : len + 1;
+    return true;
 }
 
 YHttpRequest::YHttpRequest(Connection* conn /* = NULL*/)
@@ -369,20 +1583,92 @@ YHttpRequest::YHttpRequest(Connection* conn /* = NULL*/)
 	connection(conn);
 }
 
-void YHttpRequest::fill(Message& m)
+void YHttpRequest::clear()
+{
+    YHttpMessage::clear();
+    m_method.clear();
+    m_uri.clear();
+    m_handler = 0;
+}
+
+void YHttpRequest::fill(Message& m, bool headers)
 {
     m.addParam("version", httpVersion());
     m.addParam("method", m_method);
     m.addParam("uri", m_uri);
+    if (headers)
+	fillHeaders(m);
+}
+
+// Add hdr_ parameters, optionally only the ones not already set
+void YHttpRequest::fillHeaders(NamedList& dest, bool missing)
+{
+    const char* buf = (const char*)m_raw.data();
+    for (unsigned int i = 0; i < m_table.count(); i++) {
+	const HttpField& f = m_table.field(i);
+	// repeated headers are reported once, with last value
+	if (m_table.find(m_table.name(i), f.nameLen) != (int)i)
+	    continue;
+	String name("hdr_");
+	name.append(m_table.name(i), f.nameLen);
+	if (missing && dest.getParam(name))
+	    continue;
+	String value;
+	HttpHeadParser::value(value, buf, f.valueOffs, f.valueLen);
+	dest.addParam(name, value);
+    }
     unsigned int n = headers().length();
     for (unsigned int j = 0; j < n; j++) {
 	const NamedString* hdr = headers().getParam(j);
 	if (! hdr)
 	    continue;
-	m.addParam("hdr_" + hdr->name(), *hdr);
+	String name = "hdr_" + hdr->name();
+	if (missing && dest.getParam(name))
+	    continue;
+	dest.addParam(name, *hdr);
     }
 }
 
+String YHttpRequest::getHeader(const char* name) const
+{
+    int i = m_table.find(name);
+    if (i < 0)
+	return YHttpMessage::getHeader(name);
+    const HttpField& f = m_table.field(i);
+    String value;
+    HttpHeadParser::value(value, (const char*)m_raw.data(), f.valueOffs, f.valueLen);
+    return value;
+}
+
+const char* YHttpRequest::header(int id, unsigned int& len) const
+{
+    int i = m_table.find(id);
+    if (i < 0)
+	return 0;
+    len = m_table.field(i).valueLen;
+    return m_table.value(i);
+}
+
+static inline bool httpBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Check if chunked is the final transfer coding of request body
+bool YHttpRequest::bodyChunked() const
+{
+    unsigned int len = 0;
+    const char* te = header(HttpHdrTransferEncoding, len);
+    if (! te)
+	return false;
+    unsigned int start = len;
+    while (start && te[start - 1] != ',')
+	start--;
+    while (start < len && httpBlank(te[start]))
+	start++;
+    return (len - start == 7) && ! ::strncasecmp(te + start, "chunked", 7);
+}
+
 bool YHttpRequest::bodyExpected() const
 {
     if (m_method == YSTRING("TRACE"))
@@ -394,73 +1680,59 @@ bool YHttpRequest::bodyExpected() const
     return false;
 }
 
-bool YHttpRequest::parseFirst(String& line)
+// Build request from what head parser found in buffer
+bool YHttpRequest::parse(const char* buf, const HttpHeadParser& head)
 {
-    XDebug(DebugAll,"YHttpRequest[%p]::parse firstline= '%s'",this,line.c_str());
-    if (line.null())
-	return false;
-    static Regexp r2("^\\([[:alpha:]]\\+\\)[[:space:]]\\+\\([^[:space:]]\\+\\)[[:space:]]\\+[Hh][Tt][Tt][Pp]/\\([0-9]\\.[0-9]\\+\\)$");
-    if (! line.matches(r2)) {
-	Debug(DebugInfo,"Invalid first line '%s'",line.c_str());
-	return false;
-    }
+    DDebug(DebugAll,"YHttpRequest[%p]::parse(%p,%u)",this,buf,head.length());
+    XDebug(DebugAll,"Request to parse: %s", String(buf,head.length()).c_str());
     // Request: <method> <uri> <version>
-    m_method = line.matchString(1).toUpper();
-    m_uri = line.matchString(2);
-    httpVersion(line.matchString(3).toUpper());
+    const HttpField& line = head.requestLine();
+    m_method.assign(buf + line.nameOffs, line.nameLen);
+    m_method.toUpper();
+    m_uri.assign(buf + line.valueOffs, line.valueLen);
+    httpVersion(String(buf + head.versionOffs() + 5, head.versionLen() - 5));
     DDebug(DebugAll,"YHttpRequest[%p] got request method='%s' uri='%s' version='%s'",
 	this, m_method.c_str(), m_uri.c_str(), httpVersion().c_str());
-    return true;
-}
-
-bool YHttpRequest::parse(const char* buf, int len)
-{
-    DDebug(DebugAll,"YHttpRequest[%p]::parse(%p,%d)",this,buf,len);
-    XDebug(DebugAll,"Request to parse: %s", String(buf,len).c_str());
-    String* line = MimeBody::getUnfoldedLine(buf, len);
-    if (line->null())
-	return false;
-    if (!parseFirst(*line)) {
-	line->destruct();
-	return false;
-    }
-    line->destruct();
-    while (len > 0) {
-	line = MimeBody::getUnfoldedLine(buf,len);
-	if (line->null()) {
-	    // Found end of headers
-	    line->destruct();
-	    break;
-	}
-	int col = line->find(':');
-	if (col <= 0) {
-	    line->destruct();
+    // Keep a private copy of head, header fields are views into it
+    if (m_raw.length() < head.length())
+	m_raw.resize(head.length());
+    ::memcpy(m_raw.data(), buf, head.length());
+    m_table.build((const char*)m_raw.data(), head);
+    unsigned int len = 0;
+    const char* cl = header(HttpHdrContentLength, len);
+    if (cl) {
+	// body framing must be unambiguous (RFC 7230 3.3.3): no transfer
+	// coding along with length and repeated lengths must all agree
+	unsigned int tlen = 0;
+	if (header(HttpHdrTransferEncoding, tlen)) {
+	    Debug(DebugNote, "YHttpRequest[%p] has both Content-Length and Transfer-Encoding", this);
 	    return false;
 	}
-	String name = line->substr(0,col);
-	name.trimBlanks();
-	if (name.null()) {
-	    line->destruct();
-	    return false;
+	for (unsigned int i = 0; i < m_table.count(); i++) {
+	    const HttpField& f = m_table.field(i);
+	    if (f.nameLen == 14 && !::strncasecmp(m_table.name(i), "Content-Length", 14) &&
+		    (f.valueLen != len || ::memcmp(m_table.value(i), cl, len))) {
+		Debug(DebugNote, "YHttpRequest[%p] has conflicting Content-Length values", this);
+		return false;
+	    }
 	}
-	*line >> ":";
-	line->trimBlanks();
-	XDebug(DebugAll,"YHttpRequest[%p]::parse header='%s' value='%s'",this,name.c_str(),line->c_str());
-
-#if 0
-	if ((name &= "WWW-Authenticate") ||
-	    (name &= "Proxy-Authenticate") ||
-	    (name &= "Authorization") ||
-	    (name &= "Proxy-Authorization"))
-	    header.append(new MimeAuthLine(name,*line));
-#endif
-	addHeader(name,*line);
-
-	if ((contentLength() == UnknownLength) && (name &= "Content-Length"))
-	    contentLength(line->toLong(-1,10));
-	line->destruct();
+	unsigned int val = 0;
+	for (unsigned int i = 0; i < len; i++) {
+	    unsigned int d = cl[i] - '0';
+	    if (d > 9 || val > (0x7fffffff - d) / 10) {
+		Debug(DebugNote, "YHttpRequest[%p] has invalid Content-Length '%s'",
+		    this, String(cl, len).c_str());
+		return false;
+	    }
+	    val = val * 10 + d;
+	}
+	if (! len)
+	    return false;
+	contentLength(val);
     }
-    if (contentLength() == UnknownLength) { // try to determine boly length
+    if (hasHeader("Transfer-Encoding")) // it overrides Content-Length
+	contentLength(UnknownLength);
+    else if (contentLength() == UnknownLength) { // try to determine boly length
 	if(strcmp(httpVersion(), "1.0") > 0) {
 	    if(! hasHeader("Transfer-Encoding")) // HTTP1.1: no Transfer-Encoding nor Content-Length => no body
 		contentLength(0);
@@ -468,7 +1740,7 @@ bool YHttpRequest::parse(const char* buf, int len)
 	else if(m_method == YSTRING("GET") || m_method == YSTRING("HEAD")) // HTTP1.0
 	    contentLength(0);
     }
-    DDebug(DebugAll,"YHttpRequest[%p]::parse %d header lines, body %u bytes", this, headers().count(), contentLength());
+    DDebug(DebugAll,"YHttpRequest[%p]::parse %u header lines, body %u bytes", this, m_table.count(), contentLength());
     return true;
 }
 
@@ -479,7 +1751,14 @@ YHttpResponse::YHttpResponse(Connection* conn /* = NULL*/)
 	connection(conn);
 }
 
-void YHttpResponse::update(const Message& msg)
+void YHttpResponse::clear()
+{
+    YHttpMessage::clear();
+    m_rc = 0;
+    m_statusText.clear();
+}
+
+void YHttpResponse::update(const NamedList& msg)
 {
     contentLength(UnknownLength);
     status(msg.getIntValue("status", 200));
@@ -500,656 +1779,5951 @@ void YHttpResponse::update(const Message& msg)
     }
 }
 
-bool YHttpResponse::build(DataBlock& buf)
+static void initStatusLines()
 {
-    XDebug(DebugAll,"YHttpResponse[%p]::build: httpVersion=%s status=%d, text='%s'", this, httpVersion().c_str(), status(), m_statusText.c_str());
-    String firstLine("HTTP/");
-    firstLine << httpVersion() << " " << status() << " " << m_statusText << "\r\n";
-    unsigned int n = headers().length();
-    for (unsigned int j = 0; j < n; j++) {
-	const NamedString* hdr = headers().getParam(j);
-	if (! hdr)
+    for (unsigned int i = 0; i < STATUS_CODES && s_httpResponseCodes[i].token; i++) {
+	int code = s_httpResponseCodes[i].value;
+	if (code < 100 || code >= 600)
 	    continue;
-	String tmp;
-	MimeHeaderLine mhl(hdr->name(), *hdr);
-	mhl.buildLine(tmp);
-	tmp << "\r\n";
-	firstLine << tmp;
-    }
-    buf.clear();
-    buf.append(firstLine);
-    buf.append("\r\n");
-    return true;
+	s_statusIndex[code] = i + 1;
+	for (int v = 0; v < 2; v++) {
+	    s_statusLines[v][i] = v ? "HTTP/1.1 " : "HTTP/1.0 ";
+	    s_statusLines[v][i] << code << " " << s_httpResponseCodes[i].token << "\r\n";
+	}
+    }
 }
 
 /**
- * HTTPServerListener
+ * RouteNode
  */
-HTTPServerListener::~HTTPServerListener()
+// Add route below this node, splitting an edge where path leaves it
+void RouteNode::insert(HTTPRoute* route, const char* path, unsigned int len)
 {
-    DDebug("HTTPServer",DebugInfo,"No longer listening '%s' on %s",
-	m_cfg.c_str(),m_address.c_str());
-    s_mutex.lock();
-    s_listeners.remove(this,false);
-    s_mutex.unlock();
+    if (! len) {
+	m_routes.append(route)->setDelete(false);
+	return;
+    }
+    for (ObjList* l = m_children.skipNull(); l; l = l->skipNext()) {
+	RouteNode* child = static_cast<RouteNode*>(l->get());
+	if (child->m_label.at(0) != path[0])
+	    continue;
+	unsigned int common = 1;
+	while (common < len && common < child->m_label.length() && child->m_label.at(common) == path[common])
+	    common++;
+	if (common < child->m_label.length()) {
+	    RouteNode* mid = new RouteNode(path, common);
+	    child->m_label = child->m_label.substr(common);
+	    l->set(mid, false);
+	    mid->m_children.append(child);
+	    child = mid;
+	}
+	child->insert(route, path + common, len - common);
+	return;
+    }
+    RouteNode* child = new RouteNode(path, len);
+    m_children.append(child);
+    child->m_routes.append(route)->setDelete(false);
 }
 
-void HTTPServerListener::init()
+// Best route ending here: exact path before prefix, given method before any
+HTTPRoute* RouteNode::match(const String& method, const String& server, bool exact) const
 {
-    if (initSocket()) {
-	s_mutex.lock();
-	s_listeners.append(this);
-	s_mutex.unlock();
+    HTTPRoute* best = 0;
+    int bestScore = -1;
+    for (ObjList* l = m_routes.skipNull(); l; l = l->skipNext()) {
+	HTTPRoute* r = static_cast<HTTPRoute*>(l->get());
+	if ((r->m_prefix == false && ! exact) || (r->m_server && r->m_server != server))
+	    continue;
+	if (r->m_method && r->m_method != method)
+	    continue;
+	int score = (r->m_prefix ? 0 : 2) + (r->m_method ? 1 : 0);
+	if (score > bestScore) {
+	    best = r;
+	    bestScore = score;
+	}
     }
-    deref();
+    return best;
 }
 
-bool HTTPServerListener::initSocket()
+/**
+ * HTTPRoutes
+ */
+HTTPRoutes::HTTPRoutes()
+    : Mutex(false, "HTTPRoutes"),
+      m_root(new RouteNode("", 0)), m_count(0)
 {
-    // check configuration
-    int port = m_cfg.getIntValue("port",5038);
-    const char* host = c_safe(m_cfg.getValue("addr","127.0.0.1"));
-    if (!(port && *host))
-	return false;
-
-    m_socket.create(AF_INET, SOCK_STREAM);
-    if (!m_socket.valid()) {
-	Alarm("HTTPServer","socket",DebugGoOn,"Unable to create the listening socket: %s",
-	    strerror(m_socket.error()));
-	return false;
-    }
+}
 
-    if (!m_socket.setBlocking(false)) {
-	Alarm("HTTPServer","socket",DebugGoOn, "Failed to set listener to nonblocking mode: %s",
-	    strerror(m_socket.error()));
-	return false;
-    }
+HTTPRoutes::~HTTPRoutes()
+{
+    TelEngine::destruct(m_root);
+}
 
-    SocketAddr sa(AF_INET);
-    sa.host(host);
-    sa.port(port);
-    m_address << sa.host() << ":" << sa.port();
-    m_socket.setReuse();
-    if (!m_socket.bind(sa)) {
-	Alarm("HTTPServer","socket",DebugGoOn,"Failed to bind to %s : %s",
-	    m_address.c_str(),strerror(m_socket.error()));
+// Add or remove direct handler as asked by http.register
+bool HTTPRoutes::received(Message& msg)
+{
+    HttpHandler* handler = static_cast<HttpHandler*>(msg.userObject(YATOM("HttpHandler")));
+    if (! handler)
 	return false;
+    const String& path = msg["path"];
+    if (msg["operation"] == YSTRING("remove")) {
+	unsigned int n = remove(handler, path);
+	msg.retValue() = n;
+	return n != 0;
     }
-    if (!m_socket.listen(2)) {
-	Alarm("HTTPServer","socket",DebugGoOn,"Unable to listen on socket: %s",
-	    strerror(m_socket.error()));
+    if (! path.startsWith("/")) {
+	Debug("HTTPServer",DebugWarn,"Refusing direct handler for path '%s'",path.c_str());
 	return false;
     }
-    Debug("HTTPServer",DebugInfo,"Starting listener '%s' on %s",
-	m_cfg.c_str(),m_address.c_str());
-    HTTPServerThread* t = new HTTPServerThread(this);
-    if (t->startup())
-	return true;
-    delete t;
-    return false;
+    add(handler, path, msg.getBoolValue("prefix"), msg["method"], msg["server"]);
+    return true;
 }
 
-void HTTPServerListener::run()
+// Handler for request, referenced, or NULL to use messages
+HttpHandler* HTTPRoutes::find(const String& method, const String& uri, const String& server)
 {
-    for (;;)
-    {
-	Thread::idle(true);
-	SocketAddr sa;
-	Socket* as = m_socket.accept(sa);
-	if (!as) {
-	    if (!m_socket.canRetry())
-		Debug("HTTPServer",DebugWarn, "Accept error: %s",strerror(m_socket.error()));
-	    continue;
-	} else {
-	    String addr(sa.host());
-	    if (!checkCreate(as,sa))
-		Debug("HTTPServer",DebugWarn,"Connection rejected for %s",sa.addr().c_str());
+    // origin form only, query is not part of path
+    if (uri.at(0) != '/')
+	return 0;
+    const char* path = uri.c_str();
+    const char* query = ::strchr(path, '?');
+    unsigned int len = query ? query - path : uri.length();
+    Lock mylock(this);
+    HTTPRoute* best = 0;
+    const RouteNode* node = m_root;
+    for (;;) {
+	HTTPRoute* r = node->match(method, server, ! len);
+	if (r)
+	    best = r;
+	if (! len)
+	    break;
+	const RouteNode* next = 0;
+	for (ObjList* l = node->m_children.skipNull(); l; l = l->skipNext()) {
+	    const RouteNode* child = static_cast<const RouteNode*>(l->get());
+	    if (child->m_label.at(0) == *path) {
+		if (child->m_label.length() <= len && ! ::memcmp(child->m_label.c_str(), path, child->m_label.length()))
+		    next = child;
+		break;
+	    }
 	}
+	if (! next)
+	    break;
+	path += next->m_label.length();
+	len -= next->m_label.length();
+	node = next;
     }
+    if (! (best && best->m_handler->ref()))
+	return 0;
+    return best->m_handler;
 }
 
-Connection* HTTPServerListener::checkCreate(Socket* sock, const SocketAddr& sa)
+void HTTPRoutes::add(HttpHandler* handler, const String& path, bool prefix,
+    const String& method, const String& server)
 {
-    if (!sock->valid()) {
-	delete sock;
-	return 0;
+    Lock mylock(this);
+    // same handler, path and filters replace previous registration
+    for (ObjList* l = m_routes.skipNull(); l; l = l->skipNext()) {
+	HTTPRoute* r = static_cast<HTTPRoute*>(l->get());
+	if (r->m_handler == handler && r->m_path == path && r->m_prefix == prefix &&
+		r->m_method == method && r->m_server == server)
+	    return;
     }
+    m_routes.append(new HTTPRoute(handler, path, prefix, method, server));
+    Debug("HTTPServer",DebugInfo,"Direct handler %p for %s %s%s%s%s",handler,
+	method ? method.c_str() : "*",path.c_str(),(prefix ? "*" : ""),
+	(server ? " on " : ""),server.safe());
+    rebuild();
+}
 
-    int arg = 1;
-    if (m_cfg.getBoolValue("nodelay",true) &&
-	    !sock->setOption(IPPROTO_TCP, TCP_NODELAY, &arg, sizeof(arg)))
-	Debug("HTTPServer",DebugMild, "Failed to set tcp socket to TCP_NODELAY mode: %s", strerror(sock->error()));
-
-    const NamedString* secure = m_cfg.getParam("sslcontext");
-    if (TelEngine::null(secure))
-	secure = 0;
-    if (secure) {
-	Message m("socket.ssl");
-	m.addParam("server",String::boolText(true));
-	m.addParam("context",*secure);
-	m.copyParam(m_cfg,"verify");
-	SockRef* s = new SockRef(&sock);
-	m.userData(s);
-	TelEngine::destruct(s);
-	if (!(Engine::dispatch(m) && sock)) {
-	    Debug("HTTPServer",DebugWarn, "Failed to switch '%s' to SSL for %s '%s'",
-		cfg().c_str(),secure->name().c_str(),secure->c_str());
-	    delete sock;
-	    return 0;
+// Remove routes of handler to path, to any path if it's empty
+unsigned int HTTPRoutes::remove(HttpHandler* handler, const String& path)
+{
+    Lock mylock(this);
+    unsigned int n = 0;
+    for (ObjList* l = m_routes.skipNull(); l; ) {
+	HTTPRoute* r = static_cast<HTTPRoute*>(l->get());
+	if (r->m_handler == handler && (path.null() || r->m_path == path)) {
+	    l->remove();
+	    n++;
+	    l = l->skipNull();
 	}
+	else
+	    l = l->skipNext();
     }
-    else if (!sock->setBlocking(false)) {
-	Debug("HTTPServer",DebugGoOn, "Failed to set tcp socket to nonblocking mode: %s",
-	    strerror(sock->error()));
-	delete sock;
-	return 0;
+    if (n)
+	rebuild();
+    return n;
+}
+
+// Make trie again from route list, registrations are too rare to bother
+void HTTPRoutes::rebuild()
+{
+    TelEngine::destruct(m_root);
+    m_root = new RouteNode("", 0);
+    m_count = 0;
+    for (ObjList* l = m_routes.skipNull(); l; l = l->skipNext()) {
+	HTTPRoute* r = static_cast<HTTPRoute*>(l->get());
+	m_root->insert(r, r->m_path.c_str(), r->m_path.length());
+	m_count++;
     }
-    // should check IP address here
-    Output("Remote%s connection from %s to %s",
-	(secure ? " secure" : ""),sa.addr().c_str(),m_address.c_str());
-    Connection* conn = new Connection(sock,this);
-    if (conn->error()) {
-	conn->deref();
-	return 0;
+}
+
+// One line per route, for httpserver routes command
+void HTTPRoutes::list(String& str)
+{
+    Lock mylock(this);
+    for (ObjList* l = m_routes.skipNull(); l; l = l->skipNext()) {
+	HTTPRoute* r = static_cast<HTTPRoute*>(l->get());
+	str << (r->m_method ? r->m_method.c_str() : "*") << " " << r->m_path;
+	if (r->m_prefix)
+	    str << "*";
+	if (r->m_server)
+	    str << " on " << r->m_server;
+	str << "\r\n";
     }
-    conn->startup();
-    return conn;
 }
 
 /**
- * Connection
+ * ConnTimers
  */
-TokenDict Connection::s_connTokens[] = {
-    { "keep-alive", KeepAlive },
-    { "close",     Close },
-    { "te",        TE },
-    { "trailers",  Trailers },
-    { "upgrade",  Upgrade },
+const TokenDict ConnTimers::s_kinds[] = {
+    { "head", Head },
+    { "body", Body },
+    { "idle", Idle },
+    { "send", Send },
+    { "drain", Drain },
     { 0, 0 },
 };
 
-Connection::Connection(Socket* sock, HTTPServerListener* listener)
-    : Thread("HTTPServer connection"),
-      m_socket(sock),
-      m_listener(listener),
-      m_keepalive(false),
-      m_maxRequests(0),
-      m_timeout(10)
-{
-    s_mutex.lock();
-    s_connList.append(this);
-    s_mutex.unlock();
-    m_socket->getSockName(m_local);
-    m_socket->getPeerName(m_remote);
-    m_maxRequests = cfg().getIntValue("maxrequests", 0);
-    m_maxReqBody = cfg().getIntValue("maxreqbody", 10 * 1024);
-    m_timeout = cfg().getIntValue("timeout", 10);
-    m_maxSendChunkSize = cfg().getIntValue("maxsendchunk", 8192);
-    if (m_maxSendChunkSize < 10)
-	m_maxSendChunkSize = 10;
-    else if (m_maxSendChunkSize > 65535)
-	m_maxSendChunkSize = 65535; // need to fit into 4 hex digits
-}
-
-Connection::~Connection()
+ConnTimers::ConnTimers()
+    : Mutex(false, "HTTPTimers"),
+      m_now(Time::secNow()),
+      m_armed(0)
 {
-    s_mutex.lock();
-    s_connList.remove(this,false);
-    s_mutex.unlock();
-    Output("Closing connection to %s",m_remote.addr().c_str());
-    delete m_socket;
-    m_socket = 0;
+    ::memset(m_slots, 0, sizeof(m_slots));
+    ::memset(m_expired, 0, sizeof(m_expired));
 }
 
-void* Connection::getObject(const String& name) const
+// Set connection's deadline, called from thread owning it
+void ConnTimers::schedule(Connection* conn, u_int32_t when, int kind)
 {
-    XDebug(DebugAll,"Connection[%p]::getObject('%s')", this, name.c_str());
-    if (name == YATOM("Connection"))
-	return const_cast<Connection*>(this);
-    if (name == YATOM("YHttpRequest"))
-	return m_req;
-    if (name == YATOM("YHttpResponse"))
-	return m_rsp;
-    if (name == YATOM("Socket"))
-	return m_socket;
-    if (name == YATOM("HTTPServerListener"))
-	return m_listener;
-    return GenObject::getObject(name);
+    Lock mylock(this);
+    conn->m_deadline = when;
+    conn->m_tmKind = kind;
+    // a later deadline is looked at again when current slot comes due
+    if (when && !(conn->m_tmWhen && conn->m_tmWhen <= when)) {
+	unlink(conn);
+	link(conn, when);
+    }
 }
 
-void Connection::run()
+void ConnTimers::cancel(Connection* conn)
 {
-    if (!m_socket)
-	return;
-    runConnection();
-    deref();
+    Lock mylock(this);
+    conn->m_deadline = 0;
+    conn->m_tmKind = None;
+    unlink(conn);
 }
 
-void Connection::runConnection()
+// Advance wheel to given second, checking connections in slots passed
+void ConnTimers::tick(u_int32_t now)
 {
-    u_int32_t killtime = Time::secNow() + m_timeout;
-    while (m_socket && m_socket->valid()) {
-	Thread::check();
-	bool readok = false;
-	bool error = false;
-	if (m_socket->select(&readok, 0, &error, 10000)) {
-	    if (error) {
-		Debug("HTTPServer",DebugInfo,"Socket exception condition on %d",m_socket->handle());
-		/* Can happen when client shuts down it's socket's sending part */
-		if(m_keepalive)
-		    return;
-	    }
-	    if (!readok) {
-		if(!m_timeout || Time::secNow() < killtime) {
-		    yield();
-		    continue;
-		}
-		Debug("HTTPServer",DebugAll, "Timeout waiting for socket %d", m_socket->handle());
-		return;
-	    }
-	    DataBlock rbuf(NULL, HDR_BUFFER_SIZE);
-	    int readsize = m_socket->readData(rbuf.data(), rbuf.length());
-	    if (!readsize) {
-		Debug("HTTPServer",DebugInfo,"Socket condition EOF on %d",m_socket->handle());
-		return;
-	    }
-	    else if (readsize > 0) {
-		m_rcvBuffer.append(rbuf.data(), readsize);
-		if (! received(readsize))
-		    return;
-		killtime = Time::secNow() + m_timeout;
-	    }
-	    else if (!m_socket->canRetry()) {
-		Debug("HTTPServer",DebugWarn,"Socket read error %d on %d",errno,m_socket->handle());
-		return;
-	    }
+    Lock mylock(this);
+    while ((int32_t)(now - m_now) > 0) {
+	m_now++;
+	// spread slots of upper levels as their turn comes
+	if (!(m_now & WHEEL_MASK)) {
+	    if (!(m_now & ((1 << (2 * WHEEL_BITS)) - 1)))
+		cascade(m_slots[2][(m_now >> (2 * WHEEL_BITS)) & WHEEL_MASK]);
+	    cascade(m_slots[1][(m_now >> WHEEL_BITS) & WHEEL_MASK]);
 	}
-	else if (!m_socket->canRetry()) {
-	    Debug("HTTPServer",DebugWarn,"socket select error %d on %d",errno,m_socket->handle());
-	    return;
+	Connection*& slot = m_slots[0][m_now & WHEEL_MASK];
+	while (slot) {
+	    Connection* conn = slot;
+	    unlink(conn);
+	    if (conn->m_deadline > m_now)
+		link(conn, conn->m_deadline);
+	    else if (conn->checkTimer(m_now))
+		m_expired[conn->m_tmKind]++;
 	}
     }
 }
 
-bool Connection::received(unsigned long rlen)
+// Count connection closed by something else than wheel
+void ConnTimers::expired(int kind)
 {
-    const char * data = (const char*)m_rcvBuffer.data();
-    unsigned int len = m_rcvBuffer.length();
-    // Find an empty line
-    unsigned int bodyOffs = getEmptyLine(data, len);
-    if (bodyOffs > len)
-	return true; // not enouth data, but still ok
-
-    // Got all headers, start processing request
-    m_req = new YHttpRequest(this);
-    m_req->deref();
+    Lock mylock(this);
+    m_expired[kind]++;
+}
 
-    // Parse the message headers
-    if(! m_req->parse(data, bodyOffs)) {
-	String tmp(data, bodyOffs);
-	Debug("HTTPServer", DebugNote,
-	    "got invalid message [%p]\r\n------\r\n%s\r\n------",
-	    this, tmp.c_str());
-	return false;
-    }
-    if(strcmp(m_req->httpVersion(), "1.0") > 0)
-	m_keepalive = true;
-    connectionHeader(m_req->getHeader("Connection"));
-    Debug("HTTPServer", DebugAll, "Connection flags: %04X", m_connection);
-    if(m_connection & KeepAlive)
-	m_keepalive = true;
-    if(m_connection & Close)
-	m_keepalive = false;
+void ConnTimers::status(String& str)
+{
+    Lock mylock(this);
+    str << ",timers=" << m_armed;
+    for (const TokenDict* k = s_kinds; k->token; k++)
+	str << "," << k->token << "timeouts=" << m_expired[k->value];
+}
 
-    // Remove processed part from input buffer
-    m_rcvBuffer.cut(-bodyOffs); // now m_rcvBuffer holds body's beginning
-    bool bodyExpected = m_req->bodyExpected();
+// Put connection in slot of it's level, wheel must be locked
+void ConnTimers::link(Connection* conn, u_int32_t when)
+{
+    // further than top level reaches, look again at it's last second
+    if ((when >> (3 * WHEEL_BITS)) != (m_now >> (3 * WHEEL_BITS)))
+	when = m_now | ((1 << (3 * WHEEL_BITS)) - 1);
+    if ((int32_t)(when - m_now) <= 0)
+	when = m_now + 1;
+    Connection** slot;
+    if ((when >> WHEEL_BITS) == (m_now >> WHEEL_BITS))
+	slot = &m_slots[0][when & WHEEL_MASK];
+    else if ((when >> (2 * WHEEL_BITS)) == (m_now >> (2 * WHEEL_BITS)))
+	slot = &m_slots[1][(when >> WHEEL_BITS) & WHEEL_MASK];
+    else
+	slot = &m_slots[2][(when >> (2 * WHEEL_BITS)) & WHEEL_MASK];
+    conn->m_tmWhen = when;
+    conn->m_tmNext = *slot;
+    if (*slot)
+	(*slot)->m_tmPrev = &conn->m_tmNext;
+    conn->m_tmPrev = slot;
+    *slot = conn;
+    m_armed++;
+}
 
+void ConnTimers::unlink(Connection* conn)
+{
+    if (!conn->m_tmPrev)
+	return;
+    *conn->m_tmPrev = conn->m_tmNext;
+    if (conn->m_tmNext)
+	conn->m_tmNext->m_tmPrev = conn->m_tmPrev;
+    conn->m_tmNext = 0;
+    conn->m_tmPrev = 0;
+    conn->m_tmWhen = 0;
+    m_armed--;
+}
 
-    Message m("http.route");
-    m.userData(this);
-    m.addParam("server", m_listener->cfg().c_str());
-    m.addParam("address", m_remote.addr());
-    m.addParam("ip_host", m_remote.host());
-    m.addParam("ip_port", String(m_remote.port()));
-    m.addParam("local", m_local.addr());
-    m.addParam("local_host", m_local.host());
-    m.addParam("local_port", String(m_local.port()));
-    m.addParam("keepalive", String::boolText(m_keepalive));
-    m.addParam("reqbody", String::boolText(bodyExpected));
-    m_req->fill(m);
-    if (Engine::dispatch(m)) {
-	TelEngine::String rv = m.retValue();
-	if (rv[0] >= '3' && rv[0] <= '9')
-	    return sendErrorResponse(atoi(rv.c_str())); // XXX TODO add headers from m
-	m.addParam("handler", rv);
-	m.retValue() = TelEngine::String::empty();
+// Move connections of an upper level slot to lower levels
+void ConnTimers::cascade(Connection*& slot)
+{
+    Connection* list = slot;
+    slot = 0;
+    if (list)
+	list->m_tmPrev = &list;
+    while (list) {
+	Connection* conn = list;
+	u_int32_t when = conn->m_tmWhen;
+	unlink(conn);
+	link(conn, when);
     }
+}
 
-    if (m_connection & Upgrade && m_req->hasHeader("Upgrade")) {
-	m = "http.upgrade";
-	if (Engine::dispatch(m)) {
-	    RefPointer<RefObject> ref = static_cast<RefObject*>(m.userObject("RefObject"));
-	    Runnable* code = static_cast<Runnable*>(m.userObject("Runnable"));
-	    XDebug("HTTPServer",DebugAll,"Connection[%p] got http.upgrade Runnable response %p", this, code);
-	    if (code) {
-		m_rsp = new YHttpResponse(this);
-		m_rsp->deref();
-		m_rsp->httpVersion(m_req->httpVersion());
-		m_rsp->update(m);
-		m_rsp->addHeader("Connection", "Upgrade");
-		m_rsp->addHeader("Upgrade", "websocket");
-		m_rsp->status(101);
-		m_rsp->contentLength(0);
-		XDebug("HTTPServer",DebugAll,"Connection[%p]: sending 101 response %p", this, (YHttpResponse*)m_rsp);
-		if(! sendResponse(*m_rsp))
-		    return false;
-		XDebug("HTTPServer",DebugAll,"Connection[%p]: sent 101 response %p", this, (YHttpResponse*)m_rsp);
-		m_req = NULL;
-		m_rsp = NULL;
-		code->run();
-		XDebug("HTTPServer",DebugAll,"Connection[%p]: done with upgraded connection", this);
-	    }
-	    return false;
-	}
-	else {
-	    //m.delHeader("Upgrade");
-	    m_connection &= ~Upgrade;
-	}
-    }
+/**
+ * DeferredResponse
+ */
+static HashList s_deferred(256);
+static Mutex s_deferMutex(false, "HTTPDeferred");
+static unsigned int s_deferSeq = 0;
 
-    // Dispatch http.prereq in case someone wants to read request body
-    m = "http.preserve";
-    if (Engine::dispatch(m)) {
-	TelEngine::Stream* strm = reinterpret_cast<TelEngine::Stream*>(m.userObject(YATOM("Stream")));
-	if(strm) {
-	    TelEngine::RefObject* ref = reinterpret_cast<TelEngine::RefObject*>(m.userObject("RefObject"));
-	    XDebug("HTTPServer",DebugInfo,"Connection[%p] got stream response %p, ref %p", this, strm, ref);
-	    m_req->setBody(strm, ref);
+DeferredResponse::DeferredResponse(Connection* conn, unsigned int timeout)
+    : Mutex(false, "DeferredResponse"),
+      m_params(""), m_stream(0), m_file(0),
+      m_conn(conn), m_driver(0), m_deferred(false),
+      m_parked(false), m_done(false), m_expired(false), m_status(0),
+      m_timeout(timeout), m_deadline(0)
+{
+    Lock mylock(s_deferMutex);
+    m_id << "http/" << ++s_deferSeq;
+    if (ref())
+	s_deferred.append(this);
+}
+
+// Take response given by handler, wake up connection if it waits already
+bool DeferredResponse::complete(Message& msg)
+{
+    Lock mylock(this);
+    if (m_done || ! m_conn)
+	return false;
+    m_params.copyParams(msg);
+    m_body = msg.retValue();
+    if (m_body.null()) {
+	m_stream = static_cast<Stream*>(msg.userObject(YATOM("Stream")));
+	if (m_stream) {
+	    m_ref = static_cast<RefObject*>(msg.userObject(YATOM("RefObject")));
+	    m_file = static_cast<File*>(msg.userObject(YATOM("File")));
 	}
     }
+    return finish(0);
+}
 
-    // if noone wants to read request body, lets prepare our own buffer
-    BodyBuffer* request_body_buffer = NULL;
-    if (! m_req->bodyStream() && m_req->bodyExpected()) {
-	request_body_buffer = new BodyBuffer();
-	m_req->setBody(request_body_buffer, request_body_buffer);
-	request_body_buffer->deref();
-    }
+// Lock must be held
+bool DeferredResponse::finish(int status)
+{
+    m_status = status;
+    m_done = true;
+    // connection can't go away while we hold the lock
+    if (m_parked && m_driver && m_conn->ref())
+	m_driver->wake(m_conn);
+    return true;
+}
 
-    // read request body finally
-    if (bodyExpected && ! readRequestBody(m))
-	return false; // error response is already sent in readRequestBody()
+// Request waits for response from now on, return false if it's there already
+// Without a driver connection's thread polls for it. Timeout starts counting
+// once request has nothing else to do (streamed body is all read)
+bool DeferredResponse::park(HTTPDriver* driver, bool timed)
+{
+    Lock mylock(this);
+    if (m_done)
+	return false;
+    m_driver = driver;
+    m_parked = true;
+    if (timed && !m_deadline)
+	m_deadline = Time::secNow() + m_timeout;
+    return true;
+}
 
-    m_rsp = new YHttpResponse(this);
-    m_rsp->deref();
-    m_rsp->httpVersion(m_req->httpVersion());
+// Request is finished or gone, late responses are refused
+void DeferredResponse::detach()
+{
+    lock();
+    m_conn = 0;
+    m_parked = false;
+    unlock();
+    Lock mylock(s_deferMutex);
+    s_deferred.remove(this, true, true);
+}
+
+// Handler promised a response through complete()
+void DeferredResponse::defer()
+{
+    Lock mylock(this);
+    m_deferred = true;
+}
+
+bool DeferredResponse::deferred()
+{
+    Lock mylock(this);
+    return m_deferred;
+}
+
+// Token registered with given id, referenced
+DeferredResponse* DeferredResponse::find(const String& id)
+{
+    Lock mylock(s_deferMutex);
+    DeferredResponse* resp = static_cast<DeferredResponse*>(s_deferred[id]);
+    return (resp && resp->ref()) ? resp : 0;
+}
+
+// Answer 504 to requests waiting longer than their listener's defertimeout
+void DeferredResponse::expire(u_int32_t now)
+{
+    ObjList late;
+    s_deferMutex.lock();
+    for (unsigned int i = 0; i < s_deferred.length(); i++) {
+	ObjList* l = s_deferred.getList(i);
+	for (l = l ? l->skipNull() : 0; l; l = l->skipNext()) {
+	    DeferredResponse* resp = static_cast<DeferredResponse*>(l->get());
+	    if (resp->m_deadline && now >= resp->m_deadline && ! resp->m_done && resp->ref())
+		late.append(resp);
+	}
+    }
+    s_deferMutex.unlock();
+    for (ObjList* l = late.skipNull(); l; l = l->skipNext()) {
+	DeferredResponse* resp = static_cast<DeferredResponse*>(l->get());
+	Lock mylock(resp);
+	if (resp->m_done || ! resp->m_conn)
+	    continue;
+	Debug("HTTPServer",DebugInfo,"Deferred response %s timed out",resp->m_id.c_str());
+	resp->m_expired = true;
+	resp->finish(504);
+    }
+}
+
+unsigned int DeferredResponse::count()
+{
+    Lock mylock(s_deferMutex);
+    return s_deferred.count();
+}
+
+/**
+ * StreamedBody
+ */
+StreamedBody::StreamedBody(Connection* conn, HTTPDriver* driver, unsigned int window)
+    : Mutex(false, "StreamedBody"),
+      m_sem(1, "StreamedBody", 0),
+      m_offset(0), m_window(window), m_consumed(0),
+      m_conn(conn), m_driver(driver), m_reader(0),
+      m_ended(false), m_failed(false), m_waiting(false), m_woke(false), m_nowait(false)
+{
+}
+
+void* StreamedBody::getObject(const String& name) const
+{
+    if (name == YATOM("StreamedBody"))
+	return const_cast<StreamedBody*>(this);
+    if (name == YATOM("Stream"))
+	return static_cast<Stream*>(const_cast<StreamedBody*>(this));
+    return HttpBody::getObject(name);
+}
+
+int StreamedBody::read(void* buf, unsigned int len, long maxwait)
+{
+    Lock mylock(this);
+    while (m_offset >= m_data.length() && !(m_ended || m_failed || m_nowait) && maxwait) {
+	m_waiting = true;
+	mylock.drop();
+	m_sem.lock(maxwait);
+	mylock.acquire(this);
+	if (maxwait > 0)
+	    maxwait = 0;
+    }
+    unsigned int n = m_data.length() - m_offset;
+    if (!n)
+	return (m_ended && !m_failed) ? 0 : -1;
+    if (n > len)
+	n = len;
+    ::memcpy(buf, m_data.data(m_offset), n);
+    m_offset += n;
+    if (m_offset >= m_data.length()) {
+	m_data.clear();
+	m_offset = 0;
+    }
+    else if (m_offset >= m_window / 2) {
+	m_data.cut(-(int)m_offset);
+	m_offset = 0;
+    }
+    m_consumed += n;
+    // once half a window is read connection takes more from client
+    Connection* conn = 0;
+    if (m_consumed >= m_window / 2 && !m_woke && m_conn && m_driver && m_conn->ref()) {
+	m_woke = true;
+	conn = m_conn;
+    }
+    mylock.drop();
+    if (conn)
+	m_driver->wake(conn);
+    return n;
+}
+
+bool StreamedBody::finished() const
+{
+    Lock mylock(const_cast<StreamedBody*>(this));
+    return m_ended && !m_failed && m_offset >= m_data.length();
+}
+
+// Reader is called at once if something waits already
+void StreamedBody::reader(HttpBodyReader* rd)
+{
+    lock();
+    m_reader = rd;
+    bool ready = m_ended || m_failed || m_offset < m_data.length();
+    unlock();
+    if (rd && ready)
+	rd->bodyReady(*this);
+}
+
+int StreamedBody::writeData(const void* buffer, int length)
+{
+    if (length <= 0)
+	return 0;
+    lock();
+    if (m_failed) {
+	unlock();
+	return -1;
+    }
+    m_data.append(const_cast<void*>(buffer), length);
+    notify();
+    return length;
+}
+
+bool StreamedBody::terminate()
+{
+    lock();
+    m_ended = true;
+    notify();
+    return true;
+}
+
+// Connection is done with it, body is cut short unless it ended
+void StreamedBody::detach()
+{
+    lock();
+    m_conn = 0;
+    if (!m_ended)
+	m_failed = true;
+    notify();
+}
+
+// Handler is called by connection's own thread, a read can't wait for data
+void StreamedBody::nowait(bool on)
+{
+    Lock mylock(this);
+    m_nowait = on;
+}
+
+// How much more connection may write
+unsigned int StreamedBody::room()
+{
+    Lock mylock(this);
+    unsigned int len = m_data.length() - m_offset;
+    return (len < m_window) ? m_window - len : 0;
+}
+
+// Bytes read since last call, connection gives them back to client
+unsigned int StreamedBody::ack()
+{
+    Lock mylock(this);
+    unsigned int n = m_consumed;
+    m_consumed = 0;
+    m_woke = false;
+    return n;
+}
+
+// Lock is held on entry, released before reader is called
+void StreamedBody::notify()
+{
+    bool waiting = m_waiting;
+    m_waiting = false;
+    HttpBodyReader* rd = m_reader;
+    unlock();
+    if (waiting)
+	m_sem.unlock();
+    if (rd)
+	rd->bodyReady(*this);
+}
+
+/**
+ * HTTPMetrics
+ */
+const TokenDict HTTPMetrics::s_phases[] = {
+    { "head", HeadParse },
+    { "route", Route },
+    { "preserve", Preserve },
+    { "body", BodyRead },
+    { "serve", Serve },
+    { "send", Send },
+    { "handshake", Handshake },
+    { 0, 0 },
+};
+
+static unsigned int s_metricSlots = 0;
+static __thread int s_metricSlot = -1;
+
+HTTPMetrics::HTTPMetrics(const String& name)
+    : m_name(name), m_active(0)
+{
+    ::memset(m_slots,0,sizeof(m_slots));
+}
+
+HTTPMetrics::~HTTPMetrics()
+{
+    String st;
+    status(st);
+    Debug("HTTPServer",DebugInfo,"Listener '%s' metrics: %s",m_name.c_str(),st.c_str());
+}
+
+// Slot of calling thread, handed out round robin on first use
+unsigned int HTTPMetrics::slot()
+{
+    if (s_metricSlot < 0)
+	s_metricSlot = __sync_fetch_and_add(&s_metricSlots,1) % METRIC_SLOTS;
+    return s_metricSlot;
+}
+
+// Account phase duration in power of 2 microseconds bucket
+void HTTPMetrics::time(int phase, u_int64_t usec)
+{
+    unsigned int b = usec ? 64 - __builtin_clzll(usec) : 0;
+    if (b >= METRIC_BUCKETS)
+	b = METRIC_BUCKETS - 1;
+    Slot& s = m_slots[slot()];
+    __sync_fetch_and_add(&s.usec[phase],usec);
+    __sync_fetch_and_add(&s.buckets[phase][b],1);
+}
+
+u_int64_t HTTPMetrics::get(int counter) const
+{
+    u_int64_t val = 0;
+    for (unsigned int i = 0; i < METRIC_SLOTS; i++)
+	val += m_slots[i].counters[counter];
+    return val;
+}
+
+// One line summary, in engine.status detail format
+void HTTPMetrics::status(String& str) const
+{
+    str << active() << "|" << get(Accepted) << "|" << get(Requests) << "|" << get(Reused);
+    for (int c = Status1xx; c <= Status5xx; c++)
+	str << "|" << get(c);
+    str << "|" << get(BytesIn) << "|" << get(BytesOut);
+    str << "|" << (get(RejectLimit) + get(RejectPeer) + get(RejectLoad) + get(RejectShed));
+}
+
+// Everything, with latency percentiles estimated from histograms
+void HTTPMetrics::dump(String& str) const
+{
+    u_int64_t req = get(Requests);
+    u_int64_t in = get(CompressIn);
+    str << "Listener '" << m_name << "'\r\n";
+    str << "  connections: active=" << active() << " accepted=" << get(Accepted) <<
+	" closed=" << get(Closed) << "\r\n";
+    str << "  requests: " << req << " reused=" << get(Reused) <<
+	" (" << (unsigned int)(req ? get(Reused) * 100 / req : 0) << "%)" <<
+	" direct=" << get(Direct) << " streamed=" << get(Streamed);
+    for (int c = Status1xx; c <= Status5xx; c++)
+	str << " " << (c - Status1xx + 1) << "xx=" << get(c);
+    str << "\r\n";
+    str << "  bytes: in=" << get(BytesIn) << " out=" << get(BytesOut) << "\r\n";
+    str << "  deferred: " << get(Deferred) << " expired=" << get(DeferExpired) << "\r\n";
+    str << "  tls: full=" << get(TlsFull) << " resumed=" << get(TlsResumed) <<
+	" failed=" << get(TlsFailed) << " kernel=" << get(TlsKernel) << "\r\n";
+    str << "  rejected: limit=" << get(RejectLimit) << " peer=" << get(RejectPeer) <<
+	" load=" << get(RejectLoad) << " shed=" << get(RejectShed) << "\r\n";
+    // output size in tenths of percent of input
+    unsigned int ratio = in ? (unsigned int)(get(CompressOut) * 1000 / in) : 1000;
+    str << "  compressed: " << get(Compressed) << " in=" << in << " out=" << get(CompressOut) <<
+	" ratio=" << ratio / 10 << "." << ratio % 10 << "%" <<
+	" cpu=" << get(CompressUsec) << "us\r\n";
+    for (int p = 0; p < PhaseCount; p++) {
+	u_int64_t buckets[METRIC_BUCKETS];
+	u_int64_t count = 0;
+	u_int64_t usec = 0;
+	for (unsigned int b = 0; b < METRIC_BUCKETS; b++) {
+	    buckets[b] = 0;
+	    for (unsigned int i = 0; i < METRIC_SLOTS; i++)
+		buckets[b] += m_slots[i].buckets[p][b];
+	    count += buckets[b];
+	}
+	for (unsigned int i = 0; i < METRIC_SLOTS; i++)
+	    usec += m_slots[i].usec[p];
+	str << "  " << lookup(p,s_phases) << ": count=" << count <<
+	    " avg=" << (count ? usec / count : 0) << "us";
+	// upper bounds of buckets holding 50th, 90th and 99th percentile
+	static const unsigned int pct[] = { 50, 90, 99 };
+	for (unsigned int i = 0; i < 3; i++) {
+	    u_int64_t want = (count * pct[i] + 99) / 100;
+	    u_int64_t seen = 0;
+	    unsigned int b = 0;
+	    while (b < METRIC_BUCKETS - 1 && seen + buckets[b] < want)
+		seen += buckets[b++];
+	    str << " p" << pct[i] << "<=" << (b ? ((u_int64_t)1 << b) - 1 : 0) << "us";
+	}
+	str << "\r\n";
+    }
+}
+
+// Zero counters and histograms, updates racing with it may be lost
+void HTTPMetrics::reset()
+{
+    ::memset(m_slots,0,sizeof(m_slots));
+}
+
+/**
+ * HTTPServerListener
+ */
+HTTPServerListener::~HTTPServerListener()
+{
+    DDebug("HTTPServer",DebugInfo,"No longer listening '%s' on %s",
+	m_cfg.c_str(),m_address.c_str());
+    if (m_workers) {
+	String st;
+	m_workers->status(st);
+	Debug("HTTPServer",DebugInfo,"Listener '%s' workers: %s",m_cfg.c_str(),st.c_str());
+	m_workers->detach();
+    }
+    TelEngine::destruct(m_compressTypes);
+    s_mutex.lock();
+    s_listeners.remove(this,false);
+    s_mutex.unlock();
+#ifdef HAVE_LIBURING
+    delete m_uring;
+#endif
+}
+
+// Share worker pool between shards of same listener section
+// Listening socket of replaced listener on same address is taken over
+bool HTTPServerListener::init(RefPointer<HTTPWorkers>& workers, HTTPServerListener* prev)
+{
+    m_workers = workers;
+    // render static response headers once
+    for (unsigned int i = 0; i < m_cfg.length(); i++) {
+	const NamedString* ns = m_cfg.getParam(i);
+	if (! ns)
+	    continue;
+	String name = ns->name();
+	if (! name.startSkip("ohdr_", false) || name.null())
+	    continue;
+	m_headers.addParam(name, *ns);
+	m_headersBlock << name << ": " << *ns << "\r\n";
+    }
+    initCompress();
+    m_maxConns = m_cfg.getIntValue("maxconns",0,0);
+    m_maxPerPeer = m_cfg.getIntValue("maxperip",0,0);
+    m_handshakeTimeout = m_cfg.getIntValue("headtimeout",m_cfg.getIntValue("timeout",10,0),0);
+#ifdef HAVE_OPENSSL
+    const String& secure = m_cfg["sslcontext"];
+    if (secure && m_cfg.getBoolValue("sslnative",true)) {
+	m_tls = TLSContext::get(secure,m_cfg);
+	if (!m_tls)
+	    Debug("HTTPServer",DebugMild,"Listener '%s' leaves TLS to socket.ssl handler",m_cfg.c_str());
+    }
+#endif
+    bool ok = initSocket(prev);
+    if (m_workers)
+	m_workers->attach();
+    if (ok) {
+	workers = m_workers;
+	s_mutex.lock();
+	s_listeners.append(this);
+	s_mutex.unlock();
+    }
+    deref();
+    return ok;
+}
+
+bool HTTPServerListener::initSocket(HTTPServerListener* prev)
+{
+    // check configuration
+    int port = m_cfg.getIntValue("port",5038);
+    const char* host = c_safe(m_cfg.getValue("addr","127.0.0.1"));
+    if (!(port && *host))
+	return false;
+
+    SocketAddr sa(AF_INET);
+    sa.host(host);
+    sa.port(port);
+    m_address << sa.host() << ":" << sa.port();
+#ifdef HAVE_EPOLL
+    m_reactor = (m_cfg.getValue("mode","reactor") != YSTRING("thread")) && s_reactorCount;
+#endif
+    // connections queued on replaced listener's socket are accepted here
+    int fd = (prev && prev->m_address == m_address && prev->m_socket.valid()) ?
+	::dup(prev->m_socket.handle()) : -1;
+    if (fd >= 0) {
+	m_socket.attach(fd);
+	Debug("HTTPServer",DebugInfo,"Listener '%s' shard %u took over socket on %s",
+	    m_cfg.c_str(),m_shard + 1,m_address.c_str());
+    }
+    else if (!bindSocket(sa))
+	return false;
+    if (!m_socket.listen(m_cfg.getIntValue("backlog",128,0))) {
+	Alarm("HTTPServer","socket",DebugGoOn,"Unable to listen on socket: %s",
+	    strerror(m_socket.error()));
+	return false;
+    }
+    initBackend();
+    initWorkers();
+    Debug("HTTPServer",DebugInfo,"Starting listener '%s' shard %u/%u on %s in %s mode with %u workers",
+	m_cfg.c_str(),m_shard + 1,m_shards,m_address.c_str(),
+	(m_uring ? "uring" : (m_reactor ? "reactor" : "thread")),
+	m_workers ? m_workers->threads() : 0);
+    HTTPServerThread* t = new HTTPServerThread(this);
+    if (t->startup()) {
+	if (fd >= 0)
+	    prev->m_takenOver = true;
+	return true;
+    }
+    delete t;
+    return false;
+}
+
+bool HTTPServerListener::bindSocket(const SocketAddr& sa)
+{
+    m_socket.create(AF_INET, SOCK_STREAM);
+    if (!m_socket.valid()) {
+	Alarm("HTTPServer","socket",DebugGoOn,"Unable to create the listening socket: %s",
+	    strerror(m_socket.error()));
+	return false;
+    }
+
+    if (!m_socket.setBlocking(false)) {
+	Alarm("HTTPServer","socket",DebugGoOn, "Failed to set listener to nonblocking mode: %s",
+	    strerror(m_socket.error()));
+	return false;
+    }
+
+    m_socket.setReuse();
+#ifdef SO_REUSEPORT
+    // every shard gets it's own socket, kernel spreads connections among them
+    // A single one has it too so shards added on reload can bind next to it
+    int on = 1;
+    if (!m_socket.setOption(SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+	if (m_shards > 1) {
+	    Alarm("HTTPServer","socket",DebugGoOn,"Failed to set SO_REUSEPORT on %s : %s",
+		m_address.c_str(),strerror(m_socket.error()));
+	    return false;
+	}
+	Debug("HTTPServer",DebugMild,"Failed to set SO_REUSEPORT on %s : %s",
+	    m_address.c_str(),strerror(m_socket.error()));
+    }
+#endif
+    if (!m_socket.bind(sa)) {
+	Alarm("HTTPServer","socket",DebugGoOn,"Failed to bind to %s : %s",
+	    m_address.c_str(),strerror(m_socket.error()));
+	return false;
+    }
+    return true;
+}
+
+// Stop accepting, connections are closed after their current request and
+// those left after draintimeout seconds are dropped
+void HTTPServerListener::stop()
+{
+    if (m_stopping)
+	return;
+    m_stopping = true;
+    m_drainUntil = Time::secNow() + m_cfg.getIntValue("draintimeout",30,0);
+    Debug("HTTPServer",DebugInfo,"Listener '%s' shard %u/%u on %s is draining",
+	m_cfg.c_str(),m_shard + 1,m_shards,m_address.c_str());
+    ObjList conns;
+    s_mutex.lock();
+    s_listeners.remove(this,false);
+    if (ref())
+	s_draining.append(this);
+    for (ObjList* l = s_connList.skipNull(); l; l = l->skipNext()) {
+	Connection* conn = static_cast<Connection*>(l->get());
+	if (conn->listener() == this && conn->ref())
+	    conns.append(conn);
+    }
+    s_mutex.unlock();
+    for (ObjList* l = conns.skipNull(); l; l = l->skipNext())
+	static_cast<Connection*>(l->get())->drain();
+#ifdef HAVE_LIBURING
+    if (m_uring)
+	m_uring->stop();
+#endif
+}
+
+// Forget draining listeners whose connections are gone, close connections
+// of those whose drain time is over
+void HTTPServerListener::drain(u_int32_t now)
+{
+    Lock mylock(s_mutex);
+    ObjList* o = s_draining.skipNull();
+    while (o) {
+	HTTPServerListener* lst = static_cast<HTTPServerListener*>(o->get());
+	bool late = now >= lst->m_drainUntil;
+	unsigned int n = 0;
+	unsigned int dropped = 0;
+	for (ObjList* l = s_connList.skipNull(); l; l = l->skipNext()) {
+	    Connection* conn = static_cast<Connection*>(l->get());
+	    if (conn->listener() != lst)
+		continue;
+	    n++;
+	    // upgraded connection's socket belongs to it's handler
+	    if (late && !conn->upgraded()) {
+		conn->expire(ConnTimers::Drain);
+		s_timers.expired(ConnTimers::Drain);
+		dropped++;
+	    }
+	}
+	if (n && !late) {
+	    o = o->skipNext();
+	    continue;
+	}
+	Debug("HTTPServer",DebugInfo,"Listener '%s' shard %u/%u drained, %u connections dropped",
+	    lst->m_cfg.c_str(),lst->m_shard + 1,lst->m_shards,dropped);
+	o->remove();
+	o = o->skipNull();
+    }
+}
+
+// Pick I/O backend for listening socket
+void HTTPServerListener::initBackend()
+{
+    const String& backend = m_cfg["backend"];
+    if (backend != YSTRING("uring"))
+	return;
+#ifdef HAVE_LIBURING
+    if (!TelEngine::null(m_cfg.getParam("sslcontext"))) {
+	Debug("HTTPServer",DebugMild,"Listener '%s' can't use io_uring with sslcontext",m_cfg.c_str());
+	return;
+    }
+    m_uring = new HTTPUring(this);
+    if (m_uring->init(m_socket.handle()))
+	return;
+    delete m_uring;
+    m_uring = 0;
+    Debug("HTTPServer",DebugMild,"Listener '%s' falls back from io_uring backend",m_cfg.c_str());
+#else
+    Debug("HTTPServer",DebugMild,"Listener '%s' wants io_uring but it was not compiled in",m_cfg.c_str());
+#endif
+}
+
+// Event loop modes hand message dispatching to a pool of worker threads
+void HTTPServerListener::initWorkers()
+{
+    if (m_workers || !(m_reactor || m_uring))
+	return;
+    int threads = m_cfg.getIntValue("workers",4,0,256);
+    if (!threads)
+	return;
+    m_workers = new HTTPWorkers(m_cfg);
+    m_workers->deref();
+    if (!m_workers->start(threads)) {
+	Debug("HTTPServer",DebugWarn,"Listener '%s' could not start worker threads",m_cfg.c_str());
+	m_workers = 0;
+    }
+}
+
+// Offered content codings, their level, minimum body size and media types
+void HTTPServerListener::initCompress()
+{
+    ObjList* list = m_cfg["compress"].split(',',false);
+    for (ObjList* l = list->skipNull(); l; l = l->skipNext()) {
+	String* name = static_cast<String*>(l->get());
+	name->trimBlanks();
+	name->toLower();
+	int enc = lookup(*name,BodyEncoder::s_encodings);
+	if (enc & BodyEncoder::available())
+	    m_encodings |= enc;
+	else
+	    Debug("HTTPServer",DebugMild,"Listener '%s' can't compress with '%s'",
+		m_cfg.c_str(),name->c_str());
+    }
+    TelEngine::destruct(list);
+    if (!m_encodings)
+	return;
+    m_compressLevel = m_cfg.getIntValue("compresslevel",6,1,11);
+    m_compressMin = m_cfg.getIntValue("compressmin",1024,0);
+    String types = m_cfg.getValue("compresstypes",
+	"text/*,application/json,application/javascript,application/xml,image/svg+xml");
+    m_compressTypes = types.split(',',false);
+    for (ObjList* l = m_compressTypes->skipNull(); l; l = l->skipNext()) {
+	String* type = static_cast<String*>(l->get());
+	type->trimBlanks();
+	type->toLower();
+	// "text/*" is kept as "text/" and matches any subtype
+	if (type->endsWith("/*"))
+	    *type = type->substr(0,type->length() - 1);
+    }
+}
+
+// Check if media type of Content-Type value is on compression list
+bool HTTPServerListener::compressType(const String& type) const
+{
+    if (!m_compressTypes || type.null())
+	return false;
+    int semi = type.find(';');
+    String media = (semi >= 0) ? type.substr(0,semi) : type;
+    media.trimBlanks();
+    media.toLower();
+    for (ObjList* l = m_compressTypes->skipNull(); l; l = l->skipNext()) {
+	const String* t = static_cast<const String*>(l->get());
+	if (t->endsWith("/") ? media.startsWith(*t) : (media == *t))
+	    return true;
+    }
+    return false;
+}
+
+void HTTPServerListener::run()
+{
+#ifdef HAVE_LIBURING
+    if (m_uring) {
+	m_uring->run();
+	return;
+    }
+#endif
+    // TLS handler wants accepted socket as it comes
+    bool nonblock = TelEngine::null(m_cfg.getParam("sslcontext"));
+    while (!m_stopping)
+    {
+	Thread::check();
+	bool readok = false;
+	if (!m_socket.select(&readok,0,0,(int64_t)REACTOR_WAIT_MS * 1000)) {
+	    if (!m_socket.canRetry()) {
+		Debug("HTTPServer",DebugWarn, "Listener select error: %s",strerror(m_socket.error()));
+		Thread::idle();
+	    }
+	    continue;
+	}
+	if (readok)
+	    acceptPending(nonblock);
+    }
+    // closing socket would reset connections queued in it's backlog, like
+    // those of a shard left out on reload, so they are served here instead
+    if (!m_takenOver)
+	acceptPending(nonblock);
+    // a listener that took over the socket holds it's own descriptor
+    m_socket.terminate();
+}
+
+// Drain everything kernel has queued since last wakeup
+void HTTPServerListener::acceptPending(bool nonblock)
+{
+    for (;;) {
+	SocketAddr sa;
+	Socket* as = accept(sa,nonblock);
+	if (!as)
+	    break;
+	if (!admit(as,sa))
+	    continue;
+#ifdef HAVE_EPOLL
+	// TLS handshake is left to threads of it's own
+	if (!nonblock && TLSHandshaker::queue(this,as,sa))
+	    continue;
+#endif
+	if (!checkCreate(as,sa,nonblock))
+	    Debug("HTTPServer",DebugWarn,"Connection rejected for %s",sa.addr().c_str());
+    }
+}
+
+// Take one pending connection, return NULL when there are no more
+Socket* HTTPServerListener::accept(SocketAddr& sa, bool nonblock)
+{
+#ifdef __linux__
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int fd = ::accept4(m_socket.handle(), (struct sockaddr*)&addr, &len,
+	SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0));
+    if (fd >= 0) {
+	sa.assign((struct sockaddr*)&addr, len);
+	return new Socket(fd);
+    }
+    int err = errno;
+    if (err == EAGAIN || err == EWOULDBLOCK || err == EINTR || err == ECONNABORTED)
+	return 0;
+#else
+    Socket* sock = m_socket.accept(sa);
+    if (sock) {
+	if (nonblock && !sock->setBlocking(false)) {
+	    Debug("HTTPServer",DebugGoOn, "Failed to set tcp socket to nonblocking mode: %s",
+		strerror(sock->error()));
+	    delete sock;
+	    return 0;
+	}
+	return sock;
+    }
+    if (m_socket.canRetry())
+	return 0;
+    int err = m_socket.error();
+#endif
+    // out of descriptors or similar, don't spin on readable socket
+    Debug("HTTPServer",DebugWarn, "Accept error: %s",strerror(err));
+    Thread::idle();
+    return 0;
+}
+
+Connection* HTTPServerListener::checkCreate(Socket* sock, const SocketAddr& sa, bool nonblock, TLSSocket* tls)
+{
+    Connection* conn = create(sock,sa,nonblock,tls);
+    if (!conn)
+	return 0;
+#ifdef HAVE_EPOLL
+    if (m_reactor && (nonblock || conn->socket()->setBlocking(false)) && HTTPReactor::assign(conn))
+	return conn;
+#endif
+    ConnectionThread* t = new ConnectionThread(conn);
+    conn->deref();
+    if (t->startup())
+	return conn;
+    delete t;
+    return 0;
+}
+
+// Engine is short of breath, leave it to signalling
+static bool overloaded()
+{
+    if (s_shedCongestion && Engine::congestion())
+	return true;
+    return s_maxMessages && Engine::self() && Engine::self()->messageCount() > s_maxMessages;
+}
+
+// Live connections counted under key, s_mutex must be held
+static unsigned int connCount(const String& key)
+{
+    const ConnCount* c = static_cast<const ConnCount*>(s_connCounts[key]);
+    return c ? c->m_count : 0;
+}
+
+static void countConn(const String& key, bool add)
+{
+    ConnCount* c = static_cast<ConnCount*>(s_connCounts[key]);
+    if (add) {
+	if (!c) {
+	    c = new ConnCount(key);
+	    s_connCounts.append(c);
+	}
+	c->m_count++;
+    }
+    else if (c && !--c->m_count)
+	s_connCounts.remove(c);
+}
+
+// Count accepted socket against admission limits, s_mutex must be held
+static void countAdmitted(const String& section, const String& host, bool add)
+{
+    if (add)
+	s_connCount++;
+    else
+	s_connCount--;
+    countConn(section,add);
+    countConn(section + "|" + host,add);
+}
+
+// Check connection limits and engine load before building a connection
+// Refused socket gets a canned 503 (unless TLS) and is closed
+bool HTTPServerListener::admit(Socket* sock, const SocketAddr& sa)
+{
+    int reason = -1;
+    if (overloaded())
+	reason = HTTPMetrics::RejectLoad;
+    else {
+	Lock mylock(s_mutex);
+	if ((s_maxConns && s_connCount >= s_maxConns) ||
+		(m_maxConns && connCount(m_cfg) >= m_maxConns))
+	    reason = HTTPMetrics::RejectLimit;
+	else if (m_maxPerPeer && connCount(m_cfg + "|" + sa.host()) >= m_maxPerPeer)
+	    reason = HTTPMetrics::RejectPeer;
+    }
+    if (reason < 0)
+	return true;
+    m_metrics->add(reason);
+    DDebug("HTTPServer",DebugInfo,"Listener '%s' refused %s, reason %d",
+	m_cfg.c_str(),sa.addr().c_str(),reason);
+    if (TelEngine::null(m_cfg.getParam("sslcontext")) && sock->setBlocking(false)) {
+	s_mutex.lock();
+	String busy = s_busyResponse;
+	s_mutex.unlock();
+	sock->writeData(busy.c_str(),busy.length());
+	sock->shutdown(false,true);
+	// unread request would turn close into reset and lose the answer
+	char buf[512];
+	for (int i = 0; i < 8 && sock->readData(buf,sizeof(buf)) > 0; i++)
+	    ;
+    }
+    delete sock;
+    return false;
+}
+
+// Prepare accepted socket and build a connection around it
+// A TLS socket of module's own comes with it's handshake done
+Connection* HTTPServerListener::create(Socket* sock, const SocketAddr& sa, bool nonblock, TLSSocket* tls)
+{
+    if (!sock->valid()) {
+	delete sock;
+	return 0;
+    }
+
+    int arg = 1;
+    if (m_cfg.getBoolValue("nodelay",true) &&
+	    !sock->setOption(IPPROTO_TCP, TCP_NODELAY, &arg, sizeof(arg)))
+	Debug("HTTPServer",DebugMild, "Failed to set tcp socket to TCP_NODELAY mode: %s", strerror(sock->error()));
+
+    const NamedString* secure = m_cfg.getParam("sslcontext");
+    if (TelEngine::null(secure))
+	secure = 0;
+    if (secure && !tls) {
+	Message m("socket.ssl");
+	m.addParam("server",String::boolText(true));
+	m.addParam("context",*secure);
+	m.copyParam(m_cfg,"verify");
+	if (m_cfg.getBoolValue("http2", true))
+	    m.addParam("alpn", "h2,http/1.1");
+	SockRef* s = new SockRef(&sock);
+	m.userData(s);
+	TelEngine::destruct(s);
+	if (!(Engine::dispatch(m) && sock)) {
+	    Debug("HTTPServer",DebugWarn, "Failed to switch '%s' to SSL for %s '%s'",
+		cfg().c_str(),secure->name().c_str(),secure->c_str());
+	    delete sock;
+	    return 0;
+	}
+    }
+    else if (!(nonblock || sock->setBlocking(false))) {
+	Debug("HTTPServer",DebugGoOn, "Failed to set tcp socket to nonblocking mode: %s",
+	    strerror(sock->error()));
+	delete sock;
+	return 0;
+    }
+    // should check IP address here
+    Output("Remote%s connection from %s to %s",
+	(secure ? " secure" : ""),sa.addr().c_str(),m_address.c_str());
+    return new Connection(sock,this,tls);
+}
+
+/**
+ * Connection
+ */
+TokenDict Connection::s_connTokens[] = {
+    { "keep-alive", KeepAlive },
+    { "close",     Close },
+    { "te",        TE },
+    { "trailers",  Trailers },
+    { "upgrade",  Upgrade },
+    { 0, 0 },
+};
+
+Connection::Connection(Socket* sock, HTTPServerListener* listener, TLSSocket* tls)
+    : m_socket(sock),
+      m_tls(tls),
+      m_state(ReadHead),
+      m_rcvOffset(0),
+      m_rcvLength(0),
+      m_sndOffset(0),
+      m_sndLength(0),
+      m_sndLeft(0),
+      m_sndChunked(false),
+      m_sndEof(true),
+      m_sndFile(-1),
+      m_sndFileOffset(0),
+      m_sendFile(false),
+      m_listener(listener),
+      m_msg(0),
+      m_reqBodyBuffer(0),
+      m_bodyLeft(0),
+      m_bodyRead(0),
+      m_bodyMax(0),
+      m_bodyUntilEof(false),
+      m_chunkState(ChunkNone),
+      m_chunkLeft(0),
+      m_trailerLen(0),
+      m_trailerCount(0),
+      m_trailers(""),
+      m_rcvEof(false),
+      m_upgradeCode(0),
+      m_active(0),
+      m_headStart(0),
+      m_tmNext(0),
+      m_tmPrev(0),
+      m_tmWhen(0),
+      m_deadline(0),
+      m_tmKind(ConnTimers::None),
+      m_timedOut(ConnTimers::None),
+      m_events(0),
+      m_driver(0),
+      m_driverData(0),
+      m_job(JobRoute),
+      m_jobStatus(0),
+      m_queued(0),
+      m_working(false),
+      m_dropped(false),
+      m_keepalive(false),
+      m_maxRequests(0),
+      m_chunkDigits(4),
+      m_maxRanges(0),
+      m_timeout(10),
+      m_headTimeout(10),
+      m_bodyTimeout(10),
+      m_sendTimeout(10),
+      m_sendDate(true),
+      m_dateTime(0),
+      m_connection(0),
+      m_lazyParams(false),
+      m_reqParams(""),
+      m_reqParamsAll(false),
+      m_http2(true),
+      m_h2c(false),
+      m_h2(0),
+      m_metrics(listener->metrics()),
+      m_mark(0),
+      m_served(0),
+      m_deferTimeout(60),
+      m_serving(false),
+      m_bodyError(0),
+      m_streamWindow(0),
+      m_bodyWindow(65536)
+{
+    m_socket->getSockName(m_local);
+    m_socket->getPeerName(m_remote);
+    s_mutex.lock();
+    s_connList.append(this);
+    counted(true);
+    s_mutex.unlock();
+    m_metrics->add(HTTPMetrics::Accepted);
+    m_metrics->active(1);
+    m_maxRequests = cfg().getIntValue("maxrequests", 0);
+    m_maxReqBody = cfg().getIntValue("maxreqbody", 10 * 1024);
+    m_head.maxHead(cfg().getIntValue("maxreqhead", 8192, 256));
+    m_timeout = cfg().getIntValue("timeout", 10, 0);
+    m_headTimeout = cfg().getIntValue("headtimeout", m_timeout, 0);
+    m_bodyTimeout = cfg().getIntValue("bodytimeout", m_timeout, 0);
+    m_sendTimeout = cfg().getIntValue("sendtimeout", m_timeout, 0);
+    m_lazyParams = cfg().getBoolValue("lazyparams", false);
+    m_deferTimeout = cfg().getIntValue("defertimeout", 60, 1);
+    m_bodyWindow = cfg().getIntValue("bodywindow", 65536, 1024);
+    m_sendDate = cfg().getBoolValue("date", true);
+    m_http2 = cfg().getBoolValue("http2", true);
+    // h2c upgrade is for cleartext, TLS clients pick h2 through ALPN
+    m_h2c = m_http2 && TelEngine::null(cfg().getParam("sslcontext"));
+    m_date[0] = '\0';
+    m_maxSendChunkSize = cfg().getIntValue("maxsendchunk", 8192);
+    if (m_maxSendChunkSize < 10)
+	m_maxSendChunkSize = 10;
+    else if (m_maxSendChunkSize > 0x1000000)
+	m_maxSendChunkSize = 0x1000000;
+    for (m_chunkDigits = 1; (m_maxSendChunkSize >> (4 * m_chunkDigits)); m_chunkDigits++)
+	;
+    m_maxRanges = cfg().getIntValue("maxranges", 32, 0, 1000);
+#ifdef HAVE_SENDFILE
+    // TLS records of file bodies can be made only by kernel
+    m_sendFile = cfg().getBoolValue("sendfile", true) &&
+	TelEngine::null(cfg().getParam("sslcontext"));
+#ifdef HAVE_OPENSSL
+    if (m_tls && m_tls->ktls())
+	m_sendFile = cfg().getBoolValue("sendfile", true);
+#endif
+#endif
+    touch();
+    m_headStart = m_active;
+}
+
+Connection::~Connection()
+{
+    s_timers.cancel(this);
+    s_mutex.lock();
+    s_connList.remove(this,false);
+    counted(false);
+    s_mutex.unlock();
+    m_metrics->add(HTTPMetrics::Closed);
+    m_metrics->active(-1);
+    Output("Closing connection to %s",m_remote.addr().c_str());
+    delete m_h2;
+    TelEngine::destruct(m_msg);
+    if (m_deferred)
+	m_deferred->detach();
+    if (m_reqStream)
+	m_reqStream->detach();
+    delete m_socket;
+    m_socket = 0;
+}
+
+// Keep admission counts, s_mutex must be held
+void Connection::counted(bool add)
+{
+    countAdmitted(cfg(),m_remote.host(),add);
+}
+
+void* Connection::getObject(const String& name) const
+{
+    XDebug(DebugAll,"Connection[%p]::getObject('%s')", this, name.c_str());
+    if (name == YATOM("Connection"))
+	return const_cast<Connection*>(this);
+    if (name == YATOM("YHttpRequest"))
+	return m_req;
+    if (name == YATOM("YHttpResponse"))
+	return m_rsp;
+    if (name == YATOM("Socket"))
+	return m_socket;
+    if (name == YATOM("HTTPServerListener"))
+	return m_listener;
+    if (name == YATOM("HttpDeferred")) {
+	// handing out the token defers nothing, handler has to call defer()
+	if (m_job != JobServe || ! m_req)
+	    return 0;
+	return const_cast<Connection*>(this)->token();
+    }
+    if (name == YATOM("HttpBody"))
+	return (m_job == JobServe && m_reqStream) ? static_cast<HttpBody*>(m_reqStream) : 0;
+    if (m_lazyParams && m_req) {
+	Connection* self = const_cast<Connection*>(this);
+	if (name == YATOM("NamedList"))
+	    return self->requestParams();
+	const NamedString* param = self->requestParam(name);
+	if (param)
+	    return const_cast<NamedString*>(param);
+    }
+    return GenObject::getObject(name);
+}
+
+// All request parameters kept out of http.* messages in lazy mode
+NamedList* Connection::requestParams()
+{
+    if (! m_reqParamsAll) {
+	static const char* const names[] = { "address", "ip_host", "ip_port",
+	    "local", "local_host", "local_port", 0 };
+	for (const char* const* n = names; *n; n++)
+	    requestParam(*n);
+	m_req->fillHeaders(m_reqParams, true);
+	m_reqParamsAll = true;
+    }
+    return &m_reqParams;
+}
+
+// Produce one request parameter the first time a handler asks for it
+const NamedString* Connection::requestParam(const String& name)
+{
+    const NamedString* param = m_reqParams.getParam(name);
+    if (param || m_reqParamsAll)
+	return param;
+    if (name.startsWith("hdr_")) {
+	if (! m_req->hasHeader(name.c_str() + 4))
+	    return 0;
+	m_reqParams.addParam(name, m_req->getHeader(name.c_str() + 4));
+    }
+    else if (name == YSTRING("address"))
+	m_reqParams.addParam(name, m_remote.addr());
+    else if (name == YSTRING("ip_host"))
+	m_reqParams.addParam(name, m_remote.host());
+    else if (name == YSTRING("ip_port"))
+	m_reqParams.addParam(name, String(m_remote.port()));
+    else if (name == YSTRING("local"))
+	m_reqParams.addParam(name, m_local.addr());
+    else if (name == YSTRING("local_host"))
+	m_reqParams.addParam(name, m_local.host());
+    else if (name == YSTRING("local_port"))
+	m_reqParams.addParam(name, String(m_local.port()));
+    else
+	return 0;
+    return m_reqParams.getParam(name);
+}
+
+// Drop everything related to current request
+// Breaks the reference loop made by a pending message holding us as userData
+void Connection::reset()
+{
+    delete m_h2;
+    m_h2 = 0;
+    TelEngine::destruct(m_msg);
+    if (m_deferred) {
+	m_deferred->detach();
+	m_deferred = 0;
+    }
+    if (m_reqStream) {
+	m_reqStream->detach();
+	m_reqStream = 0;
+    }
+    m_serving = false;
+    m_bodyError = 0;
+    m_trailers.clearParams();
+    m_streamWindow = 0;
+    // keep request and response for next one unless a handler still holds them
+    if (m_req && m_req->refcount() == 1) {
+	m_req->clear();
+	m_spareReq = m_req;
+    }
+    if (m_rsp && m_rsp->refcount() == 1) {
+	m_rsp->clear();
+	m_spareRsp = m_rsp;
+    }
+    m_req = NULL;
+    m_rsp = NULL;
+    m_reqBodyBuffer = NULL;
+    m_upgradeRef = NULL;
+    m_upgradeCode = NULL;
+    m_reqParams.clearParams();
+    m_reqParamsAll = false;
+    // send buffer may still hold responses to pipelined requests
+    m_sndFile = -1;
+}
+
+// Threaded mode: wait for socket events and feed them to the state machine
+void Connection::runConnection()
+{
+    while (m_socket && m_socket->valid()) {
+	Thread::check();
+	timer();
+	// nothing wakes us for deferred responses and body reads, look for them
+	if (dispatching() || stalled()) {
+	    Thread::idle();
+	    if (! woken())
+		return;
+	    continue;
+	}
+	if (m_h2 && ! m_h2->poll())
+	    return;
+	bool readok = false;
+	bool writeok = false;
+	bool error = false;
+	bool wr = wantWrite();
+	bool rd = !wr || duplex();
+	if (m_socket->select(rd ? &readok : 0, wr ? &writeok : 0, &error, 10000)) {
+	    if (error) {
+		Debug("HTTPServer",DebugInfo,"Socket exception condition on %d",m_socket->handle());
+		/* Can happen when client shuts down it's socket's sending part */
+		if(m_keepalive)
+		    return;
+	    }
+	    // timer wheel shuts socket down if it times out
+	    if (!(readok || writeok)) {
+		Thread::yield();
+		continue;
+	    }
+	    if (readok && !readable(false))
+		return;
+	    if (wantWrite() && !writable())
+		return;
+	    if (upgraded()) {
+		runUpgrade();
+		return;
+	    }
+	}
+	else if (!m_socket->canRetry()) {
+	    Debug("HTTPServer",DebugWarn,"socket select error %d on %d",errno,m_socket->handle());
+	    return;
+	}
+    }
+}
+
+// Run the http.upgrade handler, it owns the socket until it returns
+void Connection::runUpgrade()
+{
+    s_timers.cancel(this);
+    RefPointer<RefObject> ref = m_upgradeRef;
+    Runnable* code = m_upgradeCode;
+    reset();
+    if (code)
+	code->run();
+    XDebug("HTTPServer",DebugAll,"Connection[%p]: done with upgraded connection", this);
+}
+
+// Socket is readable, pull what it has (everything if drain is set)
+// Return false if connection must be closed
+bool Connection::readable(bool drain)
+{
+    unsigned char buf[BODY_BUF_SIZE];
+    while (wantRead()) {
+	unsigned int len = (m_state == ReadHead) ? HDR_BUFFER_SIZE : BODY_BUF_SIZE;
+	int readsize = m_socket->readData(buf, len);
+	if (readsize < 0) {
+	    if (m_socket->canRetry())
+		return true;
+	    Debug("HTTPServer",DebugWarn,"Socket read error %d on %d",m_socket->error(),m_socket->handle());
+	    return false;
+	}
+	if (! input(buf, readsize))
+	    return false;
+	if (!readsize || !drain || (unsigned int)readsize < len)
+	    break;
+    }
+#ifdef HAVE_OPENSSL
+    // TLS may hold decrypted data socket won't signal again, take it now
+    while (m_tls && m_tls->pending()) {
+	int readsize = m_socket->readData(buf, sizeof(buf));
+	if (readsize <= 0)
+	    break;
+	if (! input(buf, readsize))
+	    return false;
+    }
+#endif
+    return true;
+}
+
+// Feed data received from socket, zero length means EOF
+// Return false if connection must be closed
+bool Connection::input(const void* data, int len)
+{
+    if (len > 0) {
+	// head timeout counts from it's first byte
+	if (m_state == ReadHead && !rcvLength())
+	    m_headStart = Time::secNow();
+	if (m_rcvOffset >= m_rcvLength)
+	    m_rcvOffset = m_rcvLength = 0;
+	else if (m_rcvOffset && m_rcvLength + len > m_rcvBuffer.length()) {
+	    // move unprocessed data to buffer start before growing it
+	    m_rcvLength -= m_rcvOffset;
+	    ::memmove(m_rcvBuffer.data(), m_rcvBuffer.data(m_rcvOffset), m_rcvLength);
+	    m_rcvOffset = 0;
+	}
+	if (m_rcvBuffer.length() < m_rcvLength + len)
+	    m_rcvBuffer.resize(m_rcvLength + len < HDR_BUFFER_SIZE ? HDR_BUFFER_SIZE : m_rcvLength + len);
+	::memcpy(m_rcvBuffer.data(m_rcvLength), data, len);
+	m_rcvLength += len;
+	m_metrics->add(HTTPMetrics::BytesIn, len);
+	touch();
+	return received();
+    }
+    // socket was shut down by timer wheel
+    if (m_timedOut)
+	return false;
+    if (m_state == ReadBody && m_bodyUntilEof) {
+	m_bodyLeft = 0;
+	return readRequestBody();
+    }
+    if (! wantRead() || m_sndOffset < m_sndLength) {
+	// peer is done sending, let responses go out first
+	m_rcvEof = true;
+	return true;
+    }
+    Debug("HTTPServer",DebugInfo,"Socket condition EOF on %d",m_socket->handle());
+    return false;
+}
+
+// Drop processed data from receive buffer, keeping its memory for next reads
+void Connection::consume(unsigned int len)
+{
+    m_rcvOffset += len;
+    if (m_rcvOffset >= m_rcvLength)
+	m_rcvOffset = m_rcvLength = 0;
+}
+
+// Process buffered input according to current state
+bool Connection::received()
+{
+    for (;;) {
+	switch (m_state) {
+	    case ReadHead:
+		// HTTP/2 with prior knowledge (or ALPN) starts with client preface
+		if (m_http2 && ! m_head.length() && rcvLength() && rcvData()[0] == 'P') {
+		    unsigned int n = min(rcvLength(), (unsigned int)H2_PREFACE_LEN);
+		    if (! ::memcmp(rcvData(), H2_PREFACE, n)) {
+			if (n < H2_PREFACE_LEN)
+			    return true;
+			m_h2 = new HTTP2Session(this);
+			m_h2->start();
+			m_state = Http2;
+			break;
+		    }
+		}
+		if (! m_mark)
+		    m_mark = Time::now();
+		// parser goes on from where previous data ended
+		switch (m_head.parse(rcvData(), rcvLength())) {
+		    case HttpHeadParser::Incomplete:
+			return true; // not enouth data, but still ok
+		    case HttpHeadParser::TooLarge:
+			Debug("HTTPServer", DebugNote, "Request head too large on socket %d", m_socket->handle());
+			return sendErrorResponse(431);
+		    case HttpHeadParser::Invalid:
+			{
+			    String tmp(rcvData(), m_head.length());
+			    Debug("HTTPServer", DebugNote,
+				"got invalid message [%p]\r\n------\r\n%s\r\n------",
+				this, tmp.c_str());
+			}
+			return sendErrorResponse(400);
+		}
+		m_metrics->time(HTTPMetrics::HeadParse, Time::now() - m_mark);
+		if (! processHead(m_head.length()))
+		    return false;
+		break;
+	    case ReadBody:
+		if (! readRequestBody())
+		    return false;
+		if (m_state == ReadBody)
+		    return true;
+		break;
+	    case Http2:
+		return m_h2->received();
+	    default:
+		return true;
+	}
+    }
+}
+
+// Got all headers, start processing request
+bool Connection::processHead(unsigned int bodyOffs)
+{
+    const char * data = rcvData();
+    if (m_spareReq) {
+	m_req = m_spareReq;
+	m_spareReq = NULL;
+    }
+    else {
+	m_req = new YHttpRequest(this);
+	m_req->deref();
+    }
+
+    // Build the request from parsed head
+    bool ok = m_req->parse(data, m_head);
+    m_head.reset();
+    if (! ok)
+	return sendErrorResponse(400);
+    if(strcmp(m_req->httpVersion(), "1.0") > 0)
+	m_keepalive = true;
+    unsigned int len = 0;
+    const char* conn = m_req->header(HttpHdrConnection, len);
+    connectionHeader(conn, len);
+    Debug("HTTPServer", DebugAll, "Connection flags: %04X", m_connection);
+    if(m_connection & KeepAlive)
+	m_keepalive = true;
+    if(m_connection & Close)
+	m_keepalive = false;
+
+    if (m_h2c && (m_connection & Upgrade) && ! m_req->bodyExpected()) {
+	const char* upg = m_req->header(HttpHdrUpgrade, len);
+	if (upg && len == 3 && ! ::strncasecmp(upg, "h2c", 3) && m_req->hasHeader("HTTP2-Settings"))
+	    return upgradeHttp2(bodyOffs);
+    }
+
+    // Remove processed part from input buffer
+    consume(bodyOffs); // now receive buffer holds body's beginning
+    TelEngine::destruct(m_msg);
+    m_msg = routeMessage(m_req->bodyExpected());
+    return startJob(JobRoute);
+}
+
+// Build http.route message for current request
+// Return NULL if a direct handler takes it, upgrades are left to messages
+Message* Connection::routeMessage(bool bodyExpected)
+{
+    return routeMessage(m_req, bodyExpected);
+}
+
+// HTTP/2 streams build theirs while handlers of another may be running,
+// only request's own objects and connection settings are used
+Message* Connection::routeMessage(YHttpRequest* req, bool bodyExpected)
+{
+    bool upgrade = ! m_h2 && (m_connection & Upgrade) && req->hasHeader("Upgrade");
+    if (s_routes.count() && ! upgrade) {
+	req->m_handler = s_routes.find(req->m_method, req->m_uri, cfg());
+	if (req->m_handler) {
+	    req->m_handler->deref();
+	    return 0;
+	}
+    }
+    Message* msg = new Message("http.route");
+    Message& m = *msg;
+    m.userData(this);
+    m.addParam("server", m_listener->cfg().c_str());
+    // in lazy mode handlers get addresses and headers through userObject()
+    if (! m_lazyParams) {
+	m.addParam("address", m_remote.addr());
+	m.addParam("ip_host", m_remote.host());
+	m.addParam("ip_port", String(m_remote.port()));
+	m.addParam("local", m_local.addr());
+	m.addParam("local_host", m_local.host());
+	m.addParam("local_port", String(m_local.port()));
+    }
+    m.addParam("keepalive", String::boolText(m_h2 || m_keepalive));
+    m.addParam("reqbody", String::boolText(bodyExpected));
+    req->fill(m, ! m_lazyParams);
+    return msg;
+}
+
+// Switch to HTTP/2 after h2c Upgrade, request becomes stream 1
+bool Connection::upgradeHttp2(unsigned int bodyOffs)
+{
+    static const char s_switch[] =
+	"HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    consume(bodyOffs);
+    Debug("HTTPServer",DebugAll,"Connection[%p]: upgrading to h2c",this);
+    ::memcpy(sendSpace(sizeof(s_switch) - 1), s_switch, sizeof(s_switch) - 1);
+    m_sndLength += sizeof(s_switch) - 1;
+    m_keepalive = true;
+    m_h2 = new HTTP2Session(this);
+    m_state = Http2;
+    // upgrade is done, request goes on as a plain one
+    m_connection &= ~Upgrade;
+    Message* msg = routeMessage(false);
+    RefPointer<YHttpRequest> req = m_req;
+    m_req = NULL;
+    return m_h2->upgrade(req->getHeader("HTTP2-Settings"), req, msg);
+}
+
+// Make room for len bytes after pending output, return where they go
+unsigned char* Connection::sendSpace(unsigned int len)
+{
+    if (m_sndOffset >= m_sndLength)
+	m_sndOffset = m_sndLength = 0;
+    if (m_sndBuffer.length() < m_sndLength + len)
+	m_sndBuffer.resize(m_sndLength + len);
+    return m_sndBuffer.data(m_sndLength);
+}
+
+// Run message handlers, in a worker thread if listener has them
+bool Connection::startJob(int job)
+{
+    m_job = job;
+    if (job == JobServe && m_state == ReadBody && ! m_reqStream)
+	m_metrics->time(HTTPMetrics::BodyRead, Time::now() - m_mark);
+    // new requests give way to signalling while engine is congested
+    if (job == JobRoute && overloaded()) {
+	m_metrics->add(HTTPMetrics::RejectShed);
+	if (m_h2) {
+	    m_jobStatus = 503;
+	    return jobDone();
+	}
+	return sendErrorResponse(503);
+    }
+    HTTPWorkers* workers = m_listener->workers();
+    // deferred response only needs to be put in place
+    if (!(workers && m_driver) || job == JobDeferred) {
+	// handler runs on our thread, body it reads can't grow meanwhile
+	StreamedBody* body = (job == JobServe) ? (StreamedBody*)m_reqStream : 0;
+	if (body)
+	    body->nowait(true);
+	runJob();
+	if (body)
+	    body->nowait(false);
+	return jobDone();
+    }
+    // HTTP/2 frames and streamed request body keep flowing while handlers run
+    if (! (m_h2 || m_serving))
+	m_state = Dispatching;
+    m_queued = Time::now();
+    switch (workers->enqueue(this)) {
+	case HTTPWorkers::Queue:
+	    m_working = true;
+	    return true;
+	case HTTPWorkers::Reject:
+	    if (m_h2) {
+		m_jobStatus = 503;
+		return jobDone();
+	    }
+	    return sendErrorResponse(503);
+    }
+    if (m_h2) {
+	m_jobStatus = -1;
+	return jobDone();
+    }
+    m_state = ReadHead;
+    return false;
+}
+
+// Called in worker thread (or inline), must not touch socket and buffers
+void Connection::runJob()
+{
+    if (m_job == JobRoute)
+	m_jobStatus = routeRequest();
+    else if (m_job == JobDeferred)
+	m_jobStatus = deferredResponse();
+    else
+	m_jobStatus = serveRequest();
+}
+
+// Worker is done, back in connection's event loop
+bool Connection::resume()
+{
+    m_working = false;
+    if (m_dropped)
+	return false;
+    if (! (jobDone() && received()))
+	return false;
+    if (m_rcvEof && wantRead())
+	return input(0, 0);
+    return true;
+}
+
+bool Connection::jobDone()
+{
+    if (m_h2)
+	return m_h2->jobDone();
+    if (m_job == JobRoute)
+	return routed(m_jobStatus);
+    return served(m_jobStatus);
+}
+
+// Dispatch http.route, http.upgrade and http.preserve
+// Return 0 to go on, HTTP error status to send or -1 to close connection
+int Connection::routeRequest()
+{
+    if (m_req->m_handler)
+	return routeDirect();
+    Message& m = *m_msg;
+    u_int64_t start = Time::now();
+    bool ok = Engine::dispatch(m);
+    u_int64_t stop = Time::now();
+    m_metrics->time(HTTPMetrics::Route, stop - start);
+    if (ok) {
+	TelEngine::String rv = m.retValue();
+	if (rv[0] >= '3' && rv[0] <= '9')
+	    return atoi(rv.c_str()); // XXX TODO add headers from m
+	m.addParam("handler", rv);
+	m.retValue() = TelEngine::String::empty();
+    }
+
+    if (m_connection & Upgrade && m_req->hasHeader("Upgrade")) {
+	m = "http.upgrade";
+	ok = Engine::dispatch(m);
+	m_metrics->time(HTTPMetrics::Route, Time::now() - stop);
+	if (ok) {
+	    m_upgradeRef = static_cast<RefObject*>(m.userObject("RefObject"));
+	    m_upgradeCode = static_cast<Runnable*>(m.userObject("Runnable"));
+	    XDebug("HTTPServer",DebugAll,"Connection[%p] got http.upgrade Runnable response %p", this, m_upgradeCode);
+	    if (!m_upgradeCode)
+		return -1;
+	    newResponse();
+	    m_rsp->httpVersion(m_req->httpVersion());
+	    m_rsp->update(m);
+	    m_rsp->addHeader("Connection", "Upgrade");
+	    m_rsp->addHeader("Upgrade", "websocket");
+	    m_rsp->status(101);
+	    m_rsp->contentLength(0);
+	    TelEngine::destruct(m_msg);
+	    return 0;
+	}
+	else {
+	    //m.delHeader("Upgrade");
+	    m_connection &= ~Upgrade;
+	}
+    }
+
+    // Dispatch http.prereq in case someone wants to read request body
+    m = "http.preserve";
+    start = Time::now();
+    ok = Engine::dispatch(m);
+    m_metrics->time(HTTPMetrics::Preserve, Time::now() - start);
+    if (ok) {
+	TelEngine::Stream* strm = reinterpret_cast<TelEngine::Stream*>(m.userObject(YATOM("Stream")));
+	if(strm) {
+	    TelEngine::RefObject* ref = reinterpret_cast<TelEngine::RefObject*>(m.userObject("RefObject"));
+	    XDebug("HTTPServer",DebugInfo,"Connection[%p] got stream response %p, ref %p", this, strm, ref);
+	    m_req->setBody(strm, ref);
+	}
+	else if (m.getBoolValue("streambody"))
+	    m_streamWindow = m.getIntValue("bodywindow", m_bodyWindow, 1024);
+    }
+    // streamed body is not held in memory, no limit unless handler sets one
+    m_bodyMax = m.getIntValue("maxreqbody", m_streamWindow ? INT_MAX : m_maxReqBody);
+    requestBuffer();
+    return 0;
+}
+
+// Give request to handler from route table instead of messages
+int Connection::routeDirect()
+{
+    m_bodyMax = m_maxReqBody;
+    u_int64_t start = Time::now();
+    int status = m_req->m_handler->preserve(*this);
+    m_metrics->time(HTTPMetrics::Preserve, Time::now() - start);
+    if (status)
+	return status;
+    requestBuffer();
+    return 0;
+}
+
+// Direct handler's preserve() wants body while it arrives
+void Connection::streamBody(unsigned int window)
+{
+    m_streamWindow = window ? window : m_bodyWindow;
+    m_bodyMax = INT_MAX;
+}
+
+// If noone wants to read request body, lets prepare our own buffer
+void Connection::requestBuffer()
+{
+    if (m_streamWindow && ! m_req->bodyStream() && m_req->bodyExpected()) {
+	// HTTP/2 peer may send a whole stream window before it hears from us
+	m_reqStream = new StreamedBody(this, m_driver, m_h2 ? H2_WINDOW : m_streamWindow);
+	m_reqStream->deref();
+	m_req->setBody(m_reqStream, m_reqStream);
+	m_metrics->add(HTTPMetrics::Streamed);
+	return;
+    }
+    if (! m_req->bodyStream() && m_req->bodyExpected()) {
+	if (m_spareBody && m_spareBody->refcount() == 1)
+	    m_spareBody->reset();
+	else {
+	    m_spareBody = new BodyBuffer();
+	    m_spareBody->deref();
+	}
+	m_reqBodyBuffer = m_spareBody;
+	m_req->setBody(m_reqBodyBuffer, m_reqBodyBuffer);
+    }
+}
+
+// Request is routed, send upgrade response or go for request body
+bool Connection::routed(int status)
+{
+    if (status < 0)
+	return false;
+    if (status > 0)
+	return sendErrorResponse(status);
+    if (m_upgradeCode) {
+	XDebug("HTTPServer",DebugAll,"Connection[%p]: sending 101 response %p", this, (YHttpResponse*)m_rsp);
+	return sendResponse(*m_rsp);
+    }
+    if (! m_req->bodyExpected())
+	return startJob(JobServe);
+
+    // read request body finally
+    m_bodyLeft = m_req->contentLength();
+    m_chunkState = ChunkNone;
+    if (m_req->hasHeader("Transfer-Encoding")) {
+	// we can't tell where other codings end
+	if (! m_req->bodyChunked())
+	    return sendErrorResponse(501);
+	m_chunkState = ChunkSize;
+	m_chunkLeft = 0;
+	m_trailerLen = 0;
+	m_trailerCount = 0;
+    }
+    m_bodyUntilEof = !m_keepalive && !m_chunkState && m_bodyLeft == YHttpMessage::UnknownLength; // HTTP 0.x request
+    m_bodyRead = 0;
+    if(m_bodyLeft != YHttpMessage::UnknownLength && m_bodyLeft > m_bodyMax) // request body is too long
+	return sendErrorResponse(413);
+    if (! m_req->bodyStream()) {
+	Debug("HTTPServer",DebugWarn,"Connection[%p]: no request body buffer (socket %d)",this,m_socket->handle());
+	return sendErrorResponse(500);
+    }
+    m_mark = Time::now();
+    m_state = ReadBody;
+    if (! m_reqStream)
+	return true;
+    // handler is called first with what came along the head, rest of body
+    //  is read while it runs
+    m_serving = true;
+    if (! readRequestBody())
+	return false;
+    if (m_bodyError)
+	return served(0);
+    return startJob(JobServe);
+}
+
+// Feed buffered body bytes to request body stream
+bool Connection::readRequestBody()
+{
+    if (m_chunkState)
+	return readChunkedBody();
+    unsigned int len = rcvLength();
+    if (m_bodyLeft != YHttpMessage::UnknownLength && len > m_bodyLeft)
+	len = m_bodyLeft;
+    // streamed body takes no more than it's reader made room for
+    if (m_reqStream && len) {
+	unsigned int room = m_reqStream->room();
+	if (len > room)
+	    len = room;
+    }
+    if (len) {
+	XDebug("HTTPServer", DebugAll, "Connection[%p]: readRequestBody: got %u bytes, left %u, untilEof=%s, maxBodyBuf=%u", this, len, m_bodyLeft, String::boolText(m_bodyUntilEof), m_bodyMax);
+	if(m_bodyRead + len > m_bodyMax)
+	    return bodyError(413);
+	m_req->bodyStream()->writeData(rcvData(), len);
+	consume(len);
+	m_bodyRead += len;
+	if(m_bodyLeft != YHttpMessage::UnknownLength)
+	    m_bodyLeft -= len;
+    }
+    if (m_bodyLeft)
+	return true; // wait for more
+    return bodyComplete();
+}
+
+// Request body is all in it's stream, serve request. If it was served
+// while body was streamed wait for deferred response
+bool Connection::bodyComplete()
+{
+    m_req->bodyStream()->terminate();
+    if (! m_reqStream)
+	return startJob(JobServe);
+    m_metrics->time(HTTPMetrics::BodyRead, Time::now() - m_mark);
+    // handler still runs, it's return decides what comes next
+    if (m_serving) {
+	m_state = Dispatching;
+	return true;
+    }
+    if (!(m_deferred && m_deferred->park(m_driver)))
+	return startJob(JobDeferred);
+    m_state = Dispatching;
+    return true;
+}
+
+// Request body is bad, while it's handler runs the error waits for it
+bool Connection::bodyError(int code)
+{
+    if (! m_serving)
+	return sendErrorResponse(code);
+    m_bodyError = code;
+    m_reqStream->detach();
+    m_state = Dispatching;
+    return true;
+}
+
+// Fields a sender must not put in a trailer (RFC 7230 4.1.2): framing,
+// routing, request modifiers, authentication and payload processing
+static const char* s_badTrailers[] = {
+    "Transfer-Encoding", "Content-Length", "Host", "Cache-Control",
+    "Max-Forwards", "TE", "Expect", "Range", "If-Match", "If-None-Match",
+    "If-Modified-Since", "If-Unmodified-Since", "If-Range", "Authorization",
+    "Proxy-Authorization", "Cookie", "Content-Encoding", "Content-Type",
+    "Content-Range", "Trailer", "Connection", "Upgrade", 0
+};
+
+static bool badTrailer(const String& name)
+{
+    for (const char** t = s_badTrailers; *t; t++)
+	if (name &= *t)
+	    return true;
+    return false;
+}
+
+// Decode chunked request body, only payload goes to body stream
+bool Connection::readChunkedBody()
+{
+    for (;;) {
+	const char* data = rcvData();
+	unsigned int len = rcvLength();
+	if (! len)
+	    return true; // wait for more
+	switch (m_chunkState) {
+	    case ChunkData:
+		{
+		    if (len > m_chunkLeft)
+			len = m_chunkLeft;
+		    if (m_reqStream) {
+			unsigned int room = m_reqStream->room();
+			if (! room)
+			    return true;
+			if (len > room)
+			    len = room;
+		    }
+		    m_req->bodyStream()->writeData(data, len);
+		    consume(len);
+		    m_bodyRead += len;
+		    m_chunkLeft -= len;
+		    if (! m_chunkLeft)
+			m_chunkState = ChunkEnd;
+		}
+		break;
+	    case ChunkEnd:
+		if (len < 2)
+		    return true;
+		if (data[0] != '\r' || data[1] != '\n')
+		    return bodyError(400);
+		consume(2);
+		m_chunkState = ChunkSize;
+		break;
+	    default:
+		{
+		    // chunk size and trailers come in lines
+		    const char* eol = (const char*)::memchr(data, '\n', len);
+		    if (m_chunkState == ChunkTrailer) {
+			// trailers together are held to the request head size limit
+			unsigned int tlen = m_trailerLen + (eol ? (eol - data + 1) : len);
+			if (tlen > m_head.maxHead())
+			    return bodyError(431);
+			if (eol)
+			    m_trailerLen = tlen;
+		    }
+		    if (! eol) {
+			if (len > HDR_BUFFER_SIZE && m_chunkState == ChunkSize)
+			    return bodyError(400);
+			return true;
+		    }
+		    unsigned int eolen = eol - data;
+		    String line(data, (eolen && eol[-1] == '\r') ? eolen - 1 : eolen);
+		    consume(eolen + 1);
+		    if (m_chunkState == ChunkSize) {
+			// drop chunk extensions
+			int semi = line.find(';');
+			if (semi >= 0)
+			    line = line.substr(0, semi);
+			line.trimBlanks();
+			int size = line.toInteger(-1, 16);
+			if (line.null() || size < 0 || line.find('x') >= 0 || line.find('X') >= 0)
+			    return bodyError(400);
+			if (m_bodyRead + size > m_bodyMax) // decoded body is too long
+			    return bodyError(413);
+			m_chunkLeft = size;
+			m_chunkState = size ? ChunkData : ChunkTrailer;
+			XDebug("HTTPServer", DebugAll, "Connection[%p]: readChunkedBody: chunk of %d bytes, read %u", this, size, m_bodyRead);
+			break;
+		    }
+		    if (line.null()) {
+			// last chunk and trailers are done
+			m_chunkState = ChunkNone;
+			return bodyComplete();
+		    }
+		    if (++m_trailerCount > HTTP_MAX_HEADERS)
+			return bodyError(431);
+		    int col = line.find(':');
+		    if (col <= 0)
+			return bodyError(400);
+		    String name = line.substr(0, col);
+		    name.trimBlanks();
+		    line = line.substr(col + 1);
+		    line.trimBlanks();
+		    if (badTrailer(name)) {
+			DDebug("HTTPServer", DebugInfo, "Connection[%p]: dropping trailer field '%s'", this, name.c_str());
+			break;
+		    }
+		    // request and message are handler's until it returns
+		    if (m_serving)
+			m_trailers.addParam(name, line);
+		    else {
+			m_req->addHeader(name, line);
+			if (m_msg)
+			    m_msg->addParam("hdr_" + name, line);
+		    }
+		}
+		break;
+	}
+    }
+}
+
+// Take response object left by previous request or make a new one
+void Connection::newResponse()
+{
+    if (m_spareRsp) {
+	m_rsp = m_spareRsp;
+	m_spareRsp = NULL;
+	return;
+    }
+    m_rsp = new YHttpResponse(this);
+    m_rsp->deref();
+}
+
+// Handled http.serve carries a response of it's own
+static bool syncResponse(const Message& msg)
+{
+    return ! msg.retValue().null() || msg.getParam(YSTRING("status")) ||
+	msg.userObject(YATOM("Stream"));
+}
+
+// Request is complete, ask handlers for response
+// Return 0 if response is ready or HTTP error status to send
+int Connection::serveRequest()
+{
+    if (m_req->m_handler)
+	return serveDirect();
+    Message& m = *m_msg;
+    newResponse();
+    m_rsp->httpVersion(m_req->httpVersion());
 
     // Dispatch http.request
     m = "http.serve";
     m.retValue().clear();
-    if (request_body_buffer)
-	m.setParam("content", String(reinterpret_cast<char*>(request_body_buffer->data().data()), request_body_buffer->data().length()));
-    if (! Engine::dispatch(m)) {
-	return sendErrorResponse(404);
+    if (m_reqBodyBuffer)
+	m.setParam("content", String(reinterpret_cast<char*>(m_reqBodyBuffer->data().data()), m_reqBodyBuffer->data().length()));
+    u_int64_t start = Time::now();
+    bool ok = Engine::dispatch(m);
+    m_metrics->time(HTTPMetrics::Serve, Time::now() - start);
+    if (! ok) {
+	if (m_deferred) {
+	    m_deferred->detach();
+	    m_deferred = 0;
+	}
+	return 404;
+    }
+
+    // Keepalive
+    m_keepalive = m.getBoolValue("keepalive", m_keepalive);
+
+    // response comes through token only if handler deferred it and left
+    // no answer in message, a token just looked at is dropped
+    if (m_deferred) {
+	if (m_deferred->deferred() && ! syncResponse(m)) {
+	    TelEngine::destruct(m_msg);
+	    return 0;
+	}
+	m_deferred->detach();
+	m_deferred = 0;
+    }
+
+    // Prepare response
+    TelEngine::Stream* strm = 0;
+    TelEngine::RefObject* ref = 0;
+    TelEngine::File* file = 0;
+    if (m.retValue().null()) {
+	strm = reinterpret_cast<TelEngine::Stream*>(m.userObject(YATOM("Stream")));
+	if (strm) {
+	    ref = reinterpret_cast<TelEngine::RefObject*>(m.userObject("RefObject"));
+	    file = reinterpret_cast<TelEngine::File*>(m.userObject(YATOM("File")));
+	}
+    }
+    prepareResponse(m, m.retValue(), strm, ref, file);
+    TelEngine::destruct(m_msg);
+    return 0;
+}
+
+// Timeout that applies in current state. Requests waiting for deferred
+// responses or for handler to read their body have none
+int Connection::timerKind() const
+{
+    if (m_state == Dispatching || m_state == Upgraded || stalled())
+	return ConnTimers::None;
+    if (m_state == Http2) {
+	if (m_h2->waiting())
+	    return ConnTimers::None;
+	return wantWrite() ? ConnTimers::Send : ConnTimers::Idle;
+    }
+    if (wantWrite())
+	return ConnTimers::Send;
+    if (m_state == ReadBody)
+	return ConnTimers::Body;
+    return rcvLength() ? ConnTimers::Head : ConnTimers::Idle;
+}
+
+void Connection::timer()
+{
+    if (m_timedOut)
+	return;
+    int kind = timerKind();
+    u_int32_t when = 0;
+    switch (kind) {
+	case ConnTimers::Head:
+	    when = m_headTimeout ? m_headStart + m_headTimeout : 0;
+	    break;
+	case ConnTimers::Body:
+	    when = m_bodyTimeout ? m_active + m_bodyTimeout : 0;
+	    break;
+	case ConnTimers::Idle:
+	    when = m_timeout ? m_active + m_timeout : 0;
+	    break;
+	case ConnTimers::Send:
+	    when = m_sendTimeout ? m_active + m_sendTimeout : 0;
+	    break;
+    }
+    // wheel lock is taken at most once a second while connection is busy
+    if (when != m_deadline || kind != m_tmKind)
+	s_timers.schedule(this, when, kind);
+}
+
+// Called with timer wheel locked from module's timer, socket is shut down
+// so whatever thread owns connection finds it closed and drops it
+bool Connection::checkTimer(u_int32_t now)
+{
+    if (m_timedOut || !m_deadline || now < m_deadline)
+	return false;
+    expire(m_tmKind);
+    return true;
+}
+
+void Connection::expire(int kind)
+{
+    m_timedOut = kind;
+    Debug("HTTPServer",DebugAll,"Connection[%p] %s timeout on socket %d",
+	this,lookup(kind,ConnTimers::s_kinds),m_socket->handle());
+    m_socket->shutdown(true, true);
+}
+
+// Build response from parameters and body of handled http.serve or of a
+// deferred response given in it's place
+void Connection::prepareResponse(const NamedList& params, const String& body,
+    Stream* strm, RefObject* ref, File* file)
+{
+    keepAliveFlags();
+    m_rsp->setHeader("Connection", connectionHeader());
+    m_rsp->update(params);
+    if (body.null()) {
+	if(strm) {
+	    XDebug("HTTPServer",DebugInfo,"Connection[%p] got stream response %p, ref %p, file %p", this, strm, ref, file);
+	    m_rsp->setBody(strm, ref, (file && static_cast<TelEngine::Stream*>(file) == strm) ? file : 0);
+	}
+	else {
+	    m_rsp->contentLength(0);
+	    appendMissingErrorResponseBody(*m_rsp);
+	}
+    }
+    else {
+	XDebug("HTTPServer",DebugInfo,"Connection[%p] got simple response <<%s>>", this, body.c_str());
+	m_rsp->setBody(body);
+    }
+    encodeBody();
+}
+
+// Deferred response arrived, take it from token
+int Connection::deferredResponse()
+{
+    RefPointer<DeferredResponse> resp = m_deferred;
+    m_deferred = 0;
+    if (! resp)
+	return 500;
+    resp->detach();
+    if (resp->expired())
+	m_metrics->add(HTTPMetrics::DeferExpired);
+    if (resp->status())
+	return resp->status();
+    m_keepalive = resp->m_params.getBoolValue("keepalive", m_keepalive);
+    prepareResponse(resp->m_params, resp->m_body, resp->m_stream, resp->m_ref, resp->m_file);
+    return 0;
+}
+
+// Token for handler of current request, made when first asked for
+DeferredResponse* Connection::token()
+{
+    if (! m_deferred) {
+	m_deferred = new DeferredResponse(this, m_deferTimeout);
+	m_deferred->deref();
+    }
+    return m_deferred;
+}
+
+// Direct handler answers later
+HttpDeferred* Connection::defer()
+{
+    DeferredResponse* tok = token();
+    tok->defer();
+    return tok;
+}
+
+// Back in connection's event loop after another thread woke us up, or
+// polled by connection thread: look for deferred response and body room
+bool Connection::woken()
+{
+    if (m_dropped)
+	return false;
+    if (m_h2)
+	return m_h2->poll();
+    if (m_state == ReadBody && m_reqStream) {
+	// response given before body ended, rest of it won't be read
+	if (! m_serving && m_deferred && m_deferred->done())
+	    return startJob(JobDeferred);
+	m_reqStream->ack();
+	return received();
+    }
+    if (m_state == Dispatching && ! m_serving && m_deferred && m_deferred->done())
+	return startJob(JobDeferred);
+    return true;
+}
+
+// Let handler from route table fill in response
+int Connection::serveDirect()
+{
+    newResponse();
+    m_rsp->httpVersion(m_req->httpVersion());
+    m_rsp->status(200);
+    m_rsp->contentLength(0);
+    u_int64_t start = Time::now();
+    int status = m_req->m_handler->serve(*this);
+    m_metrics->time(HTTPMetrics::Serve, Time::now() - start);
+    if (status) {
+	if (m_deferred) {
+	    m_deferred->detach();
+	    m_deferred = 0;
+	}
+	return status;
+    }
+    m_metrics->add(HTTPMetrics::Direct);
+    if (m_deferred)
+	return 0;
+    keepAliveFlags();
+    if (! m_rsp->hasHeader("Connection"))
+	m_rsp->setHeader("Connection", connectionHeader());
+    if (! m_rsp->bodyStream())
+	appendMissingErrorResponseBody(*m_rsp);
+    encodeBody();
+    return 0;
+}
+
+// Connection header flags after handler's keep-alive choice
+void Connection::keepAliveFlags()
+{
+    if(! --m_maxRequests)
+	m_keepalive = false;
+    // rest of streamed body would have to be read first
+    if (m_reqStream && ! m_reqStream->ended() && ! m_h2)
+	m_keepalive = false;
+    // listener was reloaded, client should connect to the new one
+    if (m_listener->draining())
+	m_keepalive = false;
+    if(m_keepalive) {
+	m_connection &= ~Close;
+	m_connection |= KeepAlive;
+    } else {
+	m_connection &= ~KeepAlive;
+	m_connection |= Close;
+    }
+}
+
+const String& Connection::param(const String& name)
+{
+    const NamedString* p = requestParam(name);
+    return p ? *static_cast<const String*>(p) : String::empty();
+}
+
+void Connection::setBody(Stream* strm, RefObject* ref, unsigned int length, File* file)
+{
+    m_rsp->setBody(strm, ref, (file && static_cast<Stream*>(file) == strm) ? file : 0);
+    m_rsp->contentLength(length);
+}
+
+// Compress response body if listener, client and content type allow it
+void Connection::encodeBody()
+{
+    YHttpResponse& rsp = *m_rsp;
+    unsigned int len = rsp.contentLength();
+    if (! (m_listener->encodings() && rsp.bodyStream() && len))
+	return;
+    // HTTP/1.0 clients can't take chunked body
+    if (m_req->m_method == YSTRING("HEAD") || m_req->httpVersion() == YSTRING("1.0"))
+	return;
+    int rc = rsp.status();
+    if (rc < 200 || rc == 204 || rc == 206 || rc == 304)
+	return;
+    // already compressed bodies, parts of them and other types go as they are
+    if (rsp.hasHeader("Content-Encoding") || rsp.hasHeader("Content-Range") ||
+	    ! m_listener->compressType(rsp.getHeader("Content-Type")))
+	return;
+    if (len != YHttpMessage::UnknownLength && len < m_listener->compressMin())
+	return;
+    // caches must keep coded and plain variants apart
+    String vary = rsp.getHeader("Vary");
+    String tmp = vary;
+    tmp.toLower();
+    if (vary.null())
+	rsp.setHeader("Vary", "Accept-Encoding");
+    else if (tmp != YSTRING("*") && tmp.find("accept-encoding") < 0)
+	rsp.setHeader("Vary", vary + ", Accept-Encoding");
+    // part of body asked for is sent as it is, compressed length is unknown
+    if (m_maxRanges && m_req->m_method == YSTRING("GET") && m_req->hasHeader("Range") &&
+	    rsp.bodyStream()->seek(Stream::SeekCurrent, 0) >= 0)
+	return;
+    int enc = BodyEncoder::negotiate(m_req->getHeader("Accept-Encoding"), m_listener->encodings());
+    if (! enc)
+	return;
+    BodyEncoder* body = new BodyEncoder(m_metrics, enc, rsp.bodyStream(), rsp.bodyRef(), len);
+    if (body->init(m_listener->compressLevel())) {
+	// no file behind it, so no sendfile() either
+	rsp.setBody(body, body);
+	rsp.contentLength(YHttpMessage::UnknownLength);
+	rsp.setHeader("Content-Encoding", body->name());
+	// coded body is not byte for byte same as the tagged one
+	String etag = rsp.getHeader("ETag");
+	if (etag.startsWith("\""))
+	    rsp.setHeader("ETag", "W/" + etag);
+    }
+    else
+	Debug("HTTPServer",DebugWarn,"Connection[%p] failed to start %s encoder",this,body->name());
+    body->deref();
+}
+
+// If-Range names body client has a part of by entity tag or date
+static bool ifRangeMatch(const String& cond, const YHttpResponse& rsp)
+{
+    // only strong validators may join parts, weak tags never match
+    if (cond.startsWith("W/"))
+	return false;
+    String val = rsp.getHeader(cond.startsWith("\"") ? "ETag" : "Last-Modified");
+    return val && (val == cond);
+}
+
+// Parse one range spec of total bytes, length is 0 if outside of body
+// Return false if spec is malformed
+static bool rangeSpec(const String& spec, unsigned int total,
+    unsigned int& start, unsigned int& length)
+{
+    int dash = spec.find('-');
+    if (dash < 0)
+	return false;
+    String first = spec.substr(0, dash);
+    String last = spec.substr(dash + 1);
+    first.trimBlanks();
+    last.trimBlanks();
+    int64_t end = last ? last.toInt64(-1, 10) : (int64_t)total - 1;
+    if (end < 0)
+	return false;
+    length = 0;
+    if (first.null()) {
+	// last bytes of body
+	if (last.null())
+	    return false;
+	if (end > total)
+	    end = total;
+	start = total - end;
+	length = end;
+	return true;
+    }
+    int64_t begin = first.toInt64(-1, 10);
+    if (begin < 0 || (last && begin > end))
+	return false;
+    if (begin >= total)
+	return true;
+    if (end >= total)
+	end = total - 1;
+    start = begin;
+    length = end - begin + 1;
+    return true;
+}
+
+// Answer Range of a GET with parts of a seekable body of known length,
+// with 416 if none of them exists. Malformed or excessive ranges and
+// failed If-Range leave whole body to be sent
+void Connection::byteRanges(YHttpRequest& req, YHttpResponse& rsp)
+{
+    bool get = (req.m_method == YSTRING("GET"));
+    if (! m_maxRanges || rsp.status() != 200 || ! (get || req.m_method == YSTRING("HEAD")))
+	return;
+    unsigned int total = rsp.contentLength();
+    Stream* strm = rsp.bodyStream();
+    if (! strm || ! total || total == YHttpMessage::UnknownLength || rsp.hasHeader("Content-Range"))
+	return;
+    // tell clients that downloads and media from files can be resumed
+    if (rsp.bodyFile() && ! rsp.hasHeader("Accept-Ranges"))
+	rsp.setHeader("Accept-Ranges", "bytes");
+    if (! get)
+	return;
+    String range = req.getHeader("Range");
+    if (range.null() || ! range.startSkip("bytes=", false, true))
+	return;
+    String cond = req.getHeader("If-Range");
+    cond.trimBlanks();
+    if (cond && ! ifRangeMatch(cond, rsp))
+	return;
+    int64_t base = strm->seek(Stream::SeekCurrent, 0);
+    if (base < 0)
+	return;
+    ObjList parts;
+    ObjList* last = &parts;
+    unsigned int count = 0;
+    u_int64_t sum = 0;
+    ObjList* specs = range.split(',', false);
+    bool ok = true;
+    for (ObjList* l = specs->skipNull(); ok && l; l = l->skipNext()) {
+	unsigned int start = 0;
+	unsigned int length = 0;
+	ok = rangeSpec(*static_cast<String*>(l->get()), total, start, length);
+	if (! (ok && length))
+	    continue;
+	last = last->append(new RangePart(start, length));
+	sum += length;
+	count++;
+    }
+    TelEngine::destruct(specs);
+    // many or overlapping ranges just make us read body over and over
+    if (! ok || count > m_maxRanges || sum > total) {
+	Debug("HTTPServer",DebugInfo,"Connection[%p] ignoring Range '%s' of %u bytes body",
+	    this,range.c_str(),total);
+	return;
+    }
+    String whole("/");
+    whole << total;
+    if (! count) {
+	rsp.status(416);
+	rsp.setHeader("Content-Range", "bytes *" + whole);
+	appendMissingErrorResponseBody(rsp);
+	return;
+    }
+    if (count == 1) {
+	RangePart* p = static_cast<RangePart*>(parts.get());
+	if (strm->seek(Stream::SeekBegin, base + p->m_start) < 0)
+	    return;
+	String cr("bytes ");
+	cr << p->m_start << "-" << (p->m_start + p->m_length - 1) << whole;
+	rsp.status(206);
+	rsp.setHeader("Content-Range", cr);
+	rsp.contentLength(p->m_length);
+	return;
+    }
+    char boundary[24];
+    ::snprintf(boundary, sizeof(boundary), "%08x%08x",
+	(unsigned int)Time::now(), (unsigned int)Random::random());
+    RangeBody* body = new RangeBody(strm, rsp.bodyRef(), base, parts,
+	boundary, rsp.getHeader("Content-Type"), total);
+    rsp.status(206);
+    rsp.setHeader("Content-Type", String("multipart/byteranges; boundary=") + boundary);
+    rsp.setBody(body, body);
+    rsp.contentLength(body->length());
+    body->deref();
+}
+
+bool Connection::served(int status)
+{
+    m_serving = false;
+    for (unsigned int i = 0; i < m_trailers.length(); i++) {
+	const NamedString* ns = m_trailers.getParam(i);
+	if (! ns)
+	    continue;
+	m_req->addHeader(ns->name(), *ns);
+	if (m_msg)
+	    m_msg->addParam("hdr_" + ns->name(), *ns);
+    }
+    m_trailers.clearParams();
+    // response of handler is dropped for body error
+    if (m_bodyError) {
+	status = m_bodyError;
+	m_bodyError = 0;
+    }
+    if (m_deferred && ! status) {
+	// wait for response without a thread, like a job that runs long
+	m_metrics->add(HTTPMetrics::Deferred);
+	// handler reads streamed body meanwhile
+	bool body = m_reqStream && ! m_reqStream->ended();
+	if (! m_deferred->park(m_driver, ! body))
+	    return startJob(JobDeferred);
+	m_state = body ? ReadBody : Dispatching;
+	return true;
+    }
+    if (status)
+	return sendErrorResponse(status);
+    // Send response
+    return sendResponse(*m_rsp);
+}
+
+// Response is completely sent
+bool Connection::finishRequest()
+{
+    m_metrics->time(HTTPMetrics::Send, Time::now() - m_mark);
+    m_mark = 0;
+    if (m_upgradeCode) {
+	XDebug("HTTPServer",DebugAll,"Connection[%p]: sent 101 response %p", this, (YHttpResponse*)m_rsp);
+	m_state = Upgraded;
+	return true;
+    }
+    if(! m_keepalive) {
+	DDebug("HTTPServer",DebugInfo,"Closing non-keepalive Connection[%p], socket %d",this,m_socket->handle());
+	m_socket->shutdown(true, true);
+	return false;
+    }
+
+    // Request complete
+    XDebug(DebugAll, "RequestComplete, refcounts: req: %d, rsp: %d", m_req ? m_req->refcount() : 0, m_rsp ? m_rsp->refcount() : 0);
+    reset();
+    m_state = ReadHead;
+    touch();
+    m_headStart = m_active;
+    // next request may be already buffered
+    if (! received())
+	return false;
+    if (m_rcvEof && wantRead())
+	return input(0, 0);
+    return true;
+}
+
+static inline unsigned char* putData(unsigned char* ptr, const char* data, unsigned int len)
+{
+    ::memcpy(ptr, data, len);
+    return ptr + len;
+}
+
+static inline unsigned char* putHeader(unsigned char* ptr, const NamedString& hdr)
+{
+    ptr = putData(ptr, hdr.name().c_str(), hdr.name().length());
+    ptr = putData(ptr, ": ", 2);
+    ptr = putData(ptr, hdr.safe(), hdr.length());
+    return putData(ptr, "\r\n", 2);
+}
+
+// Serialize response head straight into send buffer, after pending output
+void Connection::buildHead(YHttpResponse& rsp, bool chunked)
+{
+    XDebug(DebugAll,"Connection[%p]::buildHead: httpVersion=%s status=%d, text='%s'", this, rsp.httpVersion().c_str(), rsp.status(), rsp.statusText().c_str());
+    const String* line = 0;
+    int rc = rsp.status();
+    if (rc >= 100 && rc < 600 && s_statusIndex[rc]) {
+	unsigned int idx = s_statusIndex[rc] - 1;
+	const String& ver = rsp.httpVersion();
+	int v = (ver == YSTRING("1.1")) ? 1 : ((ver == YSTRING("1.0")) ? 0 : -1);
+	if (v >= 0 && rsp.statusText() == s_httpResponseCodes[idx].token)
+	    line = &s_statusLines[v][idx];
+    }
+    char code[16];
+    unsigned int codeLen = ::snprintf(code, sizeof(code), " %d ", rc);
+    char length[32];
+    unsigned int lengthLen = chunked ? 0 :
+	::snprintf(length, sizeof(length), "Content-Length: %u\r\n", rsp.contentLength());
+    const char* date = m_sendDate ? dateHeader() : 0;
+    // static headers are left out when handlers set them too
+    const NamedList& statics = m_listener->headers();
+    bool allStatics = true;
+    for (unsigned int i = 0; allStatics && i < statics.length(); i++) {
+	const NamedString* ns = statics.getParam(i);
+	if (ns && rsp.hasHeader(ns->name()))
+	    allStatics = false;
+    }
+
+    // compute size first so the buffer is resized at most once
+    unsigned int len = line ? line->length() :
+	(5 + rsp.httpVersion().length() + codeLen + rsp.statusText().length() + 2);
+    len += chunked ? 28 : lengthLen;
+    if (date)
+	len += ::strlen(date);
+    if (allStatics)
+	len += m_listener->headersBlock().length();
+    else {
+	for (unsigned int i = 0; i < statics.length(); i++) {
+	    const NamedString* ns = statics.getParam(i);
+	    if (ns && ! rsp.hasHeader(ns->name()))
+		len += ns->name().length() + ns->length() + 4;
+	}
+    }
+    const NamedList& hdrs = rsp.headers();
+    for (unsigned int i = 0; i < hdrs.length(); i++) {
+	const NamedString* ns = hdrs.getParam(i);
+	if (ns)
+	    len += ns->name().length() + ns->length() + 4;
+    }
+    len += 2;
+
+    unsigned int pos = m_sndLength;
+    if (m_sndBuffer.length() < pos + len)
+	m_sndBuffer.resize(pos + len);
+    unsigned char* ptr = m_sndBuffer.data(pos);
+    if (line)
+	ptr = putData(ptr, line->c_str(), line->length());
+    else {
+	ptr = putData(ptr, "HTTP/", 5);
+	ptr = putData(ptr, rsp.httpVersion().safe(), rsp.httpVersion().length());
+	ptr = putData(ptr, code, codeLen);
+	ptr = putData(ptr, rsp.statusText().safe(), rsp.statusText().length());
+	ptr = putData(ptr, "\r\n", 2);
+    }
+    if (date)
+	ptr = putData(ptr, date, ::strlen(date));
+    if (allStatics)
+	ptr = putData(ptr, m_listener->headersBlock().c_str(), m_listener->headersBlock().length());
+    else {
+	for (unsigned int i = 0; i < statics.length(); i++) {
+	    const NamedString* ns = statics.getParam(i);
+	    if (ns && ! rsp.hasHeader(ns->name()))
+		ptr = putHeader(ptr, *ns);
+	}
+    }
+    for (unsigned int i = 0; i < hdrs.length(); i++) {
+	const NamedString* ns = hdrs.getParam(i);
+	if (ns)
+	    ptr = putHeader(ptr, *ns);
+    }
+    if (chunked)
+	ptr = putData(ptr, "Transfer-Encoding: chunked\r\n", 28);
+    else
+	ptr = putData(ptr, length, lengthLen);
+    ptr = putData(ptr, "\r\n", 2);
+    m_sndLength = pos + len;
+}
+
+// Date header for current second, rendered at most once a second
+const char* Connection::dateHeader()
+{
+    static const char* const days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char* const months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    u_int32_t now = Time::secNow();
+    if (now != m_dateTime) {
+	time_t t = now;
+	struct tm tm;
+	::gmtime_r(&t, &tm);
+	::snprintf(m_date, sizeof(m_date), "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n",
+	    days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900,
+	    tm.tm_hour, tm.tm_min, tm.tm_sec);
+	m_dateTime = now;
+    }
+    return m_date;
+}
+
+bool Connection::sendResponse(YHttpResponse& rsp)
+{
+    if (m_req)
+	byteRanges(*m_req, rsp);
+    unsigned int to_send = rsp.contentLength();
+    bool chunked = to_send == YHttpMessage::UnknownLength;
+
+    // queue after responses to earlier pipelined requests
+    if (m_sndOffset >= m_sndLength)
+	m_sndOffset = m_sndLength = 0;
+    buildHead(rsp, chunked);
+    XDebug("HTTPServer",DebugInfo,"Connection[%p]::sendResponse(): chunked: %s, to_send: %u, stream: %p", this, String::boolText(chunked), to_send, rsp.bodyStream());
+
+    m_sndChunked = chunked;
+    m_sndLeft = to_send;
+    m_sndEof = !rsp.bodyStream() || (!chunked && !to_send);
+    m_sndFile = -1;
+    File* file = rsp.bodyFile();
+    if (m_sendFile && !m_sndEof && !chunked && file && file->valid()) {
+	// send from current file position, sendfile() won't move it
+	m_sndFileOffset = file->seek(Stream::SeekCurrent, 0);
+	if (m_sndFileOffset >= 0)
+	    m_sndFile = file->handle();
+    }
+    m_state = SendResponse;
+    m_metrics->add(HTTPMetrics::Requests);
+    if (m_served++)
+	m_metrics->add(HTTPMetrics::Reused);
+    if (rsp.status() >= 100 && rsp.status() < 600)
+	m_metrics->add(HTTPMetrics::Status1xx + rsp.status() / 100 - 1);
+    m_mark = Time::now();
+    // first piece of body goes out in the same write as head
+    if (! (m_sndEof || m_sndFile >= 0))
+	return fillSendBuffer();
+    return true;
+}
+
+// Load next piece of response body into send buffer
+bool Connection::fillSendBuffer()
+{
+    // append after data not sent yet, response head in first call
+    if (m_sndOffset >= m_sndLength)
+	m_sndOffset = m_sndLength = 0;
+    unsigned int pos = m_sndLength;
+    unsigned int prefix = m_sndChunked ? m_chunkDigits + 2 : 0; // hex digits + crlf
+    unsigned int to_read = m_maxSendChunkSize;
+    if (! m_sndChunked && m_sndLeft < m_maxSendChunkSize)
+	to_read = m_sndLeft;
+    // data + crlf + terminating chunk
+    if (m_sndBuffer.length() < pos + prefix + to_read + 7)
+	m_sndBuffer.resize(pos + prefix + to_read + 7);
+    unsigned char * read_ptr = m_sndBuffer.data(pos + prefix);
+    Stream* strm = m_rsp->bodyStream();
+    int rd = strm->readData(read_ptr, to_read);
+    XDebug("HTTPServer",DebugInfo,"Connection[%p]::fillSendBuffer(): got %d from rsp.bodyStream()->readData(%p, %d)", this, rd, read_ptr, to_read);
+    if (rd < 0) {
+	Debug("HTTPServer",DebugInfo,"Connection[%p]::fillSendBuffer: Socket %d: response body read error",this,m_socket->handle());
+	return false;
+    }
+    if (! m_sndChunked) {
+	if (! rd) {
+	    Debug("HTTPServer",DebugInfo,"Connection[%p]::fillSendBuffer: Socket %d: got EOF, while %u bytes more expected",this,m_socket->handle(),m_sndLeft);
+	    return false;
+	}
+	m_sndLength = pos + rd;
+	m_sndLeft -= rd;
+	if (! m_sndLeft)
+	    m_sndEof = true;
+	return true;
+    }
+    // short read, look for EOF now so terminating chunk goes out with the data
+    bool eof = !rd;
+    if (rd && (unsigned int)rd < to_read) {
+	int more = strm->readData(read_ptr + rd, to_read - rd);
+	if (more > 0)
+	    rd += more;
+	else if (! more)
+	    eof = true;
+    }
+    unsigned char* ptr = m_sndBuffer.data(pos);
+    if (rd) {
+	// zero padded hex keeps the prefix size known before reading
+	char hex[16];
+	::snprintf(hex, sizeof(hex), "%0*x", (int)m_chunkDigits, rd);
+	::memcpy(ptr, hex, m_chunkDigits);
+	ptr[m_chunkDigits] = '\r';
+	ptr[m_chunkDigits + 1] = '\n';
+	ptr = read_ptr + rd;
+	*ptr++ = '\r';
+	*ptr++ = '\n';
+    }
+    if (eof) {
+	XDebug("HTTPServer",DebugInfo,"Connection[%p]::fillSendBuffer(): sending empty chunk and empty trailer", this);
+	::memcpy(ptr, "0\r\n\r\n", 5);
+	ptr += 5;
+	m_sndEof = true;
+    }
+    m_sndLength = ptr - m_sndBuffer.data(0);
+    return true;
+}
+
+// Copy file backed response body straight from page cache to socket
+// Return bytes sent, 0 if socket is full or -1 on fatal error
+int Connection::sendFile()
+{
+#ifdef HAVE_SENDFILE
+#ifdef HAVE_OPENSSL
+    if (m_tls) {
+	int64_t offs = m_sndFileOffset;
+	int n = m_tls->sendFile(m_sndFile, offs, m_sndLeft);
+	if (n > 0) {
+	    m_sndFileOffset = offs;
+	    m_sndLeft -= n;
+	    m_metrics->add(HTTPMetrics::BytesOut, n);
+	    if (! m_sndLeft)
+		m_sndEof = true;
+	    touch();
+	    return n;
+	}
+	if (m_tls->canRetry())
+	    return 0;
+	Debug("HTTPServer",DebugInfo,"Socket TLS sendfile error %d on %d",m_tls->error(),m_socket->handle());
+	return -1;
+    }
+#endif
+    off_t offs = m_sndFileOffset;
+    ssize_t n = ::sendfile(m_socket->handle(), m_sndFile, &offs, m_sndLeft);
+    if (n > 0) {
+	m_sndFileOffset = offs;
+	m_sndLeft -= n;
+	m_metrics->add(HTTPMetrics::BytesOut, n);
+	if (! m_sndLeft)
+	    m_sndEof = true;
+	touch();
+	return n;
+    }
+    if (! n) {
+	Debug("HTTPServer",DebugInfo,"Connection[%p]::sendFile: Socket %d: got EOF, while %u bytes more expected",this,m_socket->handle(),m_sndLeft);
+	return -1;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	return 0;
+    if (errno != EINVAL && errno != ENOSYS) {
+	Debug("HTTPServer",DebugInfo,"Socket sendfile error %d on %d",errno,m_socket->handle());
+	return -1;
+    }
+    // file system can't do it, go on copying through buffer
+    DDebug("HTTPServer",DebugInfo,"Connection[%p]: sendfile not supported, copying response body",this);
+    if (m_rsp->bodyFile()->seek(Stream::SeekBegin, m_sndFileOffset) < 0)
+	return -1;
+#endif
+    m_sndFile = -1;
+    return 1;
+}
+
+// Get next piece of response to transmit, empty if there is nothing to send
+// Return false if connection must be closed
+bool Connection::output(const void*& data, unsigned int& len)
+{
+    len = 0;
+    for (;;) {
+	unsigned int pending = m_sndLength - m_sndOffset;
+	if (m_state == SendResponse) {
+	    if (m_sndEof) {
+		// response is all buffered, pipelined ones may join it
+		if (! pending || canBatch(pending)) {
+		    if (! finishRequest())
+			return false;
+		    continue;
+		}
+	    }
+	    else if (! pending) {
+		if (! fillSendBuffer())
+		    return false;
+		continue;
+	    }
+	}
+	if (pending) {
+	    data = m_sndBuffer.data(m_sndOffset);
+	    len = pending;
+	    return true;
+	}
+	if (m_h2 && m_state == Http2) {
+	    if (m_h2->fill())
+		continue;
+	    if (m_h2->finished()) {
+		// frames peer sends meanwhile would make our close reset the
+		// connection, so half close and read until peer closes too
+		if (m_rcvEof)
+		    return false;
+		if (! m_h2->halfClose())
+		    m_socket->shutdown(false, true);
+		return true;
+	    }
+	}
+	// peer closed while we were still answering it's pipelined requests
+	if (m_rcvEof && wantRead()) {
+	    if (! input(0, 0))
+		return false;
+	    continue;
+	}
+	return true;
+    }
+}
+
+// Check if next pipelined request may be served before flushing output
+bool Connection::canBatch(unsigned int pending)
+{
+    // can't wait for a worker with responses sitting in our buffer
+    return m_keepalive && !m_upgradeCode && rcvLength() &&
+	pending < PIPELINE_BATCH && !(m_driver && m_listener->workers());
+}
+
+// Some output was accepted by socket
+void Connection::sent(unsigned int len)
+{
+    m_sndOffset += len;
+    m_metrics->add(HTTPMetrics::BytesOut, len);
+    touch();
+}
+
+// Socket is writable, push out as much of response as it takes
+// Return false if connection must be closed
+bool Connection::writable()
+{
+    if (m_timedOut)
+	return false;
+    for (;;) {
+	if (m_sndFile >= 0 && m_sndOffset >= m_sndLength && !m_sndEof) {
+	    int res = sendFile();
+	    if (res < 0)
+		return false;
+	    if (!res)
+		return true;
+	    continue;
+	}
+	const void* data = 0;
+	unsigned int len = 0;
+	if (! output(data, len))
+	    return false;
+	if (! len)
+	    return true;
+#ifdef HAVE_SENDFILE
+	// response head is followed by sendfile(), let kernel merge them
+	// unless it must go through TLS
+	int written = (m_sndFile >= 0 && !m_tls) ? m_socket->send(data, len, MSG_MORE) :
+	    m_socket->writeData(data, len);
+#else
+	int written = m_socket->writeData(data, len);
+#endif
+	if (written <= 0) {
+	    if (!written || m_socket->canRetry())
+		return true;
+	    Debug("HTTPServer",DebugWarn,"Socket write error %d on %d",m_socket->error(),m_socket->handle());
+	    return false;
+	}
+	sent(written);
+    }
+}
+
+bool Connection::sendErrorResponse(int code)
+{
+    m_keepalive = false;
+    m_upgradeCode = NULL;
+    m_upgradeRef = NULL;
+    TelEngine::destruct(m_msg);
+    newResponse();
+    m_rsp->setHeader("Connection", "close");
+    if (code == 503)
+	m_rsp->setHeader("Retry-After", String(s_retryAfter));
+    m_rsp->status(code);
+    appendMissingErrorResponseBody(*m_rsp);
+    return sendResponse(*m_rsp);
+}
+
+// Collect Connection header tokens straight from request buffer
+void Connection::connectionHeader(const char* hdr, unsigned int len)
+{
+    m_connection = 0;
+    if (! hdr)
+	return;
+    unsigned int pos = 0;
+    while (pos < len) {
+	while (pos < len && (httpBlank(hdr[pos]) || hdr[pos] == ','))
+	    pos++;
+	unsigned int tok = pos;
+	while (pos < len && hdr[pos] != ',')
+	    pos++;
+	unsigned int end = pos;
+	while (end > tok && httpBlank(hdr[end - 1]))
+	    end--;
+	for (const TokenDict* t = s_connTokens; t->token; t++) {
+	    if (::strlen(t->token) == end - tok && ! ::strncasecmp(t->token, hdr + tok, end - tok)) {
+		m_connection |= t->value;
+		break;
+	    }
+	}
+    }
+}
+
+String Connection::connectionHeader()
+{
+    String r;
+    int flags = m_connection;
+    for(int fl = 1; flags; fl <<= 1) {
+	if(flags & fl) {
+	    if(r.length())
+		r << ",";
+	    r << lookup(fl, s_connTokens);
+	}
+	flags &= ~fl;
+    }
+    return r;
+}
+
+void Connection::appendMissingErrorResponseBody(YHttpResponse& rsp)
+{
+    int status = rsp.status();
+    if (status < 200 || status >= 600)
+	return;
+    String b(status);
+    b << " " << rsp.statusText() << "\r\n";
+    rsp.setBody(b);
+    // headers of body we replace, like those of a file refused with 416
+    rsp.clearHeader("Content-Type");
+    rsp.clearHeader("Content-Encoding");
+    rsp.setHeader("Content-Type", "text/plain");
+}
+
+/**
+ * BodyEncoder
+ */
+const TokenDict BodyEncoder::s_encodings[] = {
+    { "gzip", Gzip },
+    { "x-gzip", Gzip },
+    { "deflate", Deflate },
+    { "br", Brotli },
+    { 0, 0 },
+};
+
+// CPU time used by calling thread, in nanoseconds
+static inline u_int64_t threadCpuTime()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    if (! ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    return 0;
+}
+
+BodyEncoder::BodyEncoder(HTTPMetrics* metrics, int encoding, Stream* body, RefObject* ref, unsigned int length)
+    : m_metrics(metrics), m_encoding(encoding), m_body(body), m_bodyRef(ref), m_bodyLeft(length),
+      m_inPos(0), m_inLen(0), m_inEof(false), m_done(false),
+      m_bytesIn(0), m_bytesOut(0), m_cpuNsec(0)
+#ifdef HAVE_ZLIB
+      , m_zlibInit(false)
+#endif
+#ifdef HAVE_BROTLI
+      , m_brotli(0)
+#endif
+{
+}
+
+BodyEncoder::~BodyEncoder()
+{
+#ifdef HAVE_ZLIB
+    if (m_zlibInit)
+	::deflateEnd(&m_zlib);
+#endif
+#ifdef HAVE_BROTLI
+    if (m_brotli)
+	::BrotliEncoderDestroyInstance(m_brotli);
+#endif
+    if (! m_bytesIn)
+	return;
+    DDebug("HTTPServer",DebugAll,"BodyEncoder[%p] %s " FMT64U " to " FMT64U " bytes in " FMT64U " usec%s",
+	this,name(),m_bytesIn,m_bytesOut,m_cpuNsec / 1000,(m_done ? "" : ", unfinished"));
+    m_metrics->add(HTTPMetrics::Compressed);
+    m_metrics->add(HTTPMetrics::CompressIn,m_bytesIn);
+    m_metrics->add(HTTPMetrics::CompressOut,m_bytesOut);
+    m_metrics->add(HTTPMetrics::CompressUsec,m_cpuNsec / 1000);
+}
+
+// Content codings compiled in
+int BodyEncoder::available()
+{
+    int enc = Identity;
+#ifdef HAVE_ZLIB
+    enc |= Gzip | Deflate;
+#endif
+#ifdef HAVE_BROTLI
+    enc |= Brotli;
+#endif
+    return enc;
+}
+
+// Pick coding with highest q value in Accept-Encoding, ours in order of
+// preference on a tie. Return Identity if none is acceptable
+int BodyEncoder::negotiate(const String& accept, int offered)
+{
+    static const int prefer[] = { Brotli, Gzip, Deflate };
+    int q[3] = { -1, -1, -1 };
+    int any = -1;
+    if (accept.null())
+	return Identity;
+    ObjList* list = accept.split(',',false);
+    for (ObjList* l = list->skipNull(); l; l = l->skipNext()) {
+	String* item = static_cast<String*>(l->get());
+	int semi = item->find(';');
+	String name = (semi >= 0) ? item->substr(0,semi) : *item;
+	name.trimBlanks();
+	name.toLower();
+	int qval = 1000;
+	if (semi >= 0) {
+	    int pos = item->find("q=",semi);
+	    if (pos > 0)
+		qval = (int)(::atof(item->c_str() + pos + 2) * 1000);
+	}
+	if (name == YSTRING("*")) {
+	    any = qval;
+	    continue;
+	}
+	int enc = lookup(name,s_encodings);
+	for (unsigned int i = 0; i < 3; i++)
+	    if (enc == prefer[i])
+		q[i] = qval;
+    }
+    TelEngine::destruct(list);
+    int best = Identity;
+    int bestQ = 0;
+    for (unsigned int i = 0; i < 3; i++) {
+	if (! (offered & prefer[i]))
+	    continue;
+	int qval = (q[i] >= 0) ? q[i] : any;
+	if (qval > bestQ) {
+	    best = prefer[i];
+	    bestQ = qval;
+	}
+    }
+    return best;
+}
+
+bool BodyEncoder::init(int level)
+{
+    m_in.assign(0,ENCODER_BUF_SIZE);
+#ifdef HAVE_ZLIB
+    if (m_encoding == Gzip || m_encoding == Deflate) {
+	::memset(&m_zlib,0,sizeof(m_zlib));
+	// 16 over window bits asks zlib for gzip header and trailer
+	m_zlibInit = Z_OK == ::deflateInit2(&m_zlib,(level > 9 ? 9 : level),Z_DEFLATED,
+	    (m_encoding == Gzip) ? 31 : 15,8,Z_DEFAULT_STRATEGY);
+	return m_zlibInit;
+    }
+#endif
+#ifdef HAVE_BROTLI
+    if (m_encoding == Brotli) {
+	m_brotli = ::BrotliEncoderCreateInstance(0,0,0);
+	if (! m_brotli)
+	    return false;
+	::BrotliEncoderSetParameter(m_brotli,BROTLI_PARAM_QUALITY,level);
+	// default 4 MiB window is a lot to keep per response
+	::BrotliEncoderSetParameter(m_brotli,BROTLI_PARAM_LGWIN,18);
+	if (m_bodyLeft != YHttpMessage::UnknownLength)
+	    ::BrotliEncoderSetParameter(m_brotli,BROTLI_PARAM_SIZE_HINT,m_bodyLeft);
+	return true;
+    }
+#endif
+    return false;
+}
+
+// Run compressor over buffered input, finishing it at end of body
+// Return number of bytes produced or -1 on error
+int BodyEncoder::encode(unsigned char* out, unsigned int len)
+{
+#if defined(HAVE_ZLIB) || defined(HAVE_BROTLI)
+    unsigned int inLen = m_inLen - m_inPos;
+    const unsigned char* in = (const unsigned char*)m_in.data() + m_inPos;
+#endif
+#ifdef HAVE_ZLIB
+    if (m_zlibInit) {
+	m_zlib.next_in = const_cast<Bytef*>(in);
+	m_zlib.avail_in = inLen;
+	m_zlib.next_out = out;
+	m_zlib.avail_out = len;
+	int rc = ::deflate(&m_zlib,m_inEof ? Z_FINISH : Z_NO_FLUSH);
+	if (rc == Z_STREAM_END)
+	    m_done = true;
+	else if (rc != Z_OK && rc != Z_BUF_ERROR)
+	    return -1;
+	m_inPos += inLen - m_zlib.avail_in;
+	return len - m_zlib.avail_out;
+    }
+#endif
+#ifdef HAVE_BROTLI
+    if (m_brotli) {
+	size_t availIn = inLen;
+	size_t availOut = len;
+	uint8_t* next = out;
+	if (! ::BrotliEncoderCompressStream(m_brotli,
+		m_inEof ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+		&availIn,&in,&availOut,&next,0))
+	    return -1;
+	if (::BrotliEncoderIsFinished(m_brotli))
+	    m_done = true;
+	m_inPos += inLen - availIn;
+	return len - availOut;
+    }
+#endif
+    return -1;
+}
+
+// Compress as much as fits, reading body only when encoder needs more input
+// Return 0 after coded stream is complete
+int BodyEncoder::readData(void* buffer, int length)
+{
+    if (m_done || length <= 0)
+	return 0;
+    unsigned char* out = (unsigned char*)buffer;
+    int len = 0;
+    while (! m_done && len < length) {
+	if (m_inPos >= m_inLen && ! m_inEof) {
+	    // send what we have before waiting for more body
+	    if (len)
+		break;
+	    unsigned int want = m_in.length();
+	    if (m_bodyLeft < want)
+		want = m_bodyLeft;
+	    int rd = want ? m_body->readData(m_in.data(),want) : 0;
+	    if (rd < 0)
+		return -1;
+	    m_inPos = 0;
+	    m_inLen = rd;
+	    m_inEof = ! rd;
+	    m_bytesIn += rd;
+	    if (m_bodyLeft != YHttpMessage::UnknownLength)
+		m_bodyLeft -= rd;
+	}
+	u_int64_t start = threadCpuTime();
+	int n = encode(out + len,length - len);
+	m_cpuNsec += threadCpuTime() - start;
+	if (n < 0) {
+	    Debug("HTTPServer",DebugWarn,"BodyEncoder[%p] %s compression failed",this,name());
+	    return -1;
+	}
+	len += n;
+    }
+    m_bytesOut += len;
+    return len;
+}
+
+/**
+ * RangeBody
+ */
+RangeBody::RangeBody(Stream* body, RefObject* ref, int64_t base, ObjList& parts,
+    const String& boundary, const String& type, unsigned int total)
+    : m_body(body), m_bodyRef(ref), m_base(base), m_part(0), m_pos(0), m_length(0)
+{
+    ObjList* last = &m_parts;
+    while (GenObject* o = parts.remove(false)) {
+	RangePart* p = static_cast<RangePart*>(o);
+	*p << "\r\n--" << boundary << "\r\n";
+	if (type)
+	    *p << "Content-Type: " << type << "\r\n";
+	*p << "Content-Range: bytes " << p->m_start << "-" << (p->m_start + p->m_length - 1) <<
+	    "/" << total << "\r\n\r\n";
+	m_length += p->length() + p->m_length;
+	last = last->append(p);
+    }
+    RangePart* end = new RangePart(0, 0);
+    *end << "\r\n--" << boundary << "--\r\n";
+    m_length += end->length();
+    last->append(end);
+    m_part = m_parts.skipNull();
+}
+
+int RangeBody::readData(void* buffer, int length)
+{
+    unsigned char* out = (unsigned char*)buffer;
+    int len = 0;
+    while (m_part && len < length) {
+	RangePart* p = static_cast<RangePart*>(m_part->get());
+	unsigned int head = p->length();
+	if (m_pos < head) {
+	    unsigned int n = min(head - m_pos, (unsigned int)(length - len));
+	    ::memcpy(out + len, p->c_str() + m_pos, n);
+	    m_pos += n;
+	    len += n;
+	    // parts may come in any order, body is positioned for each
+	    if (m_pos == head && p->m_length &&
+		    m_body->seek(Stream::SeekBegin, m_base + p->m_start) < 0)
+		return -1;
+	    continue;
+	}
+	unsigned int left = head + p->m_length - m_pos;
+	if (! left) {
+	    m_part = m_part->skipNext();
+	    m_pos = 0;
+	    continue;
+	}
+	int rd = m_body->readData(out + len, min(left, (unsigned int)(length - len)));
+	if (rd <= 0)
+	    return len ? len : -1;
+	m_pos += rd;
+	len += rd;
+    }
+    return len;
+}
+
+/**
+ * HTTP2Session
+ */
+static inline u_int32_t getUInt32(const unsigned char* p)
+{
+    return ((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16) | ((u_int32_t)p[2] << 8) | p[3];
+}
+
+static inline unsigned char* putUInt32(unsigned char* p, u_int32_t val)
+{
+    p[0] = (unsigned char)(val >> 24);
+    p[1] = (unsigned char)(val >> 16);
+    p[2] = (unsigned char)(val >> 8);
+    p[3] = (unsigned char)val;
+    return p + 4;
+}
+
+static inline void putFrameHead(unsigned char* p, unsigned int len, int type, int flags, u_int32_t id)
+{
+    p[0] = (unsigned char)(len >> 16);
+    p[1] = (unsigned char)(len >> 8);
+    p[2] = (unsigned char)len;
+    p[3] = (unsigned char)type;
+    p[4] = (unsigned char)flags;
+    putUInt32(p + 5, id & 0x7fffffff);
+}
+
+// Headers that only make sense for a HTTP/1.x connection
+static bool h2Hop(const String& name)
+{
+    return name == YSTRING("connection") || name == YSTRING("keep-alive") ||
+	name == YSTRING("proxy-connection") || name == YSTRING("transfer-encoding") ||
+	name == YSTRING("upgrade");
+}
+
+HTTP2Session::HTTP2Session(Connection* conn)
+    : m_conn(conn),
+      m_preface(false),
+      m_goaway(false),
+      m_failed(false),
+      m_halfClosed(false),
+      m_current(0),
+      m_blockStream(0),
+      m_blockFlags(0),
+      m_lastStream(0),
+      m_window(H2_WINDOW),
+      m_initWindow(H2_WINDOW),
+      m_maxFrame(H2_FRAME_SIZE),
+      m_maxStreams(100)
+{
+    m_maxStreams = conn->cfg().getIntValue("h2streams", 100, 1, 1000);
+    m_decoder.maxList(conn->m_head.maxHead());
+    // streams end, connection stays until GOAWAY
+    conn->m_keepalive = true;
+    XDebug("HTTPServer",DebugAll,"HTTP2Session[%p] created for Connection[%p]",this,conn);
+}
+
+HTTP2Stream::~HTTP2Stream()
+{
+    TelEngine::destruct(m_msg);
+    if (m_deferred)
+	m_deferred->detach();
+    if (m_streamed)
+	m_streamed->detach();
+}
+
+HTTP2Session::~HTTP2Session()
+{
+    m_jobs.clear();
+    m_streams.clear();
+}
+
+// Our side of connection preface: SETTINGS must be first frame we send
+void HTTP2Session::start()
+{
+    unsigned char buf[12];
+    buf[0] = 0;
+    buf[1] = 3; // SETTINGS_MAX_CONCURRENT_STREAMS
+    putUInt32(buf + 2, m_maxStreams);
+    buf[6] = 0;
+    buf[7] = 6; // SETTINGS_MAX_HEADER_LIST_SIZE, same limit as HTTP/1 head
+    putUInt32(buf + 8, m_decoder.maxList());
+    putFrame(Settings, 0, 0, buf, sizeof(buf));
+}
+
+// Request that came with h2c Upgrade becomes half closed stream 1
+bool HTTP2Session::upgrade(const String& h2settings, YHttpRequest* req, Message* msg)
+{
+    start();
+    // HTTP2-Settings is base64url of a SETTINGS payload
+    String tmp(h2settings);
+    while (tmp.length() % 4)
+	tmp << "=";
+    Base64 b64(const_cast<char*>(tmp.safe()), tmp.length());
+    unsigned char* p = (unsigned char*)b64.data();
+    for (unsigned int i = 0; i < b64.length(); i++) {
+	if (p[i] == '-')
+	    p[i] = '+';
+	else if (p[i] == '_')
+	    p[i] = '/';
+    }
+    DataBlock data;
+    if (! (b64.decode(data) && ! (data.length() % 6) &&
+	    settings((const unsigned char*)data.data(), data.length(), false))) {
+	TelEngine::destruct(msg);
+	return connError(ProtocolError);
+    }
+    HTTP2Stream* st = new HTTP2Stream(1, m_initWindow);
+    m_streams.append(st);
+    st->m_req = req;
+    st->m_msg = msg;
+    st->m_remoteEnd = true;
+    m_lastStream = 1;
+    queueJob(st, Connection::JobRoute);
+    return true;
+}
+
+// Process complete frames from receive buffer, then let streams run
+bool HTTP2Session::received()
+{
+    for (;;) {
+	if (m_failed || m_halfClosed) {
+	    m_conn->consume(m_conn->rcvLength());
+	    return true;
+	}
+	const unsigned char* data = (const unsigned char*)m_conn->rcvData();
+	unsigned int len = m_conn->rcvLength();
+	if (! m_preface) {
+	    unsigned int n = min(len, (unsigned int)H2_PREFACE_LEN);
+	    if (::memcmp(data, H2_PREFACE, n))
+		return connError(ProtocolError);
+	    if (n < H2_PREFACE_LEN)
+		break;
+	    m_conn->consume(H2_PREFACE_LEN);
+	    m_preface = true;
+	    continue;
+	}
+	if (len < 9)
+	    break;
+	unsigned int flen = (data[0] << 16) | (data[1] << 8) | data[2];
+	if (flen > H2_FRAME_SIZE)
+	    return connError(FrameSizeError);
+	if (len < 9 + flen)
+	    break;
+	bool ok = frame(data[3], data[4], getUInt32(data + 5) & 0x7fffffff, data + 9, flen);
+	m_conn->consume(9 + flen);
+	if (! ok)
+	    return false;
+    }
+    return runJobs();
+}
+
+bool HTTP2Session::frame(int type, int flags, u_int32_t id, const unsigned char* data, unsigned int len)
+{
+    XDebug("HTTPServer",DebugAll,"HTTP2Session[%p] got frame type=%d flags=0x%02x stream=%u len=%u",
+	this,type,flags,id,len);
+    // header block must not be interleaved with other frames
+    if (m_blockStream && type != Continuation)
+	return connError(ProtocolError);
+    switch (type) {
+	case Data:
+	    return dataFrame(id, flags, data, len);
+	case Headers:
+	    return headersFrame(id, flags, data, len);
+	case Priority:
+	    if (! id)
+		return connError(ProtocolError);
+	    if (len != 5)
+		resetStream(id, FrameSizeError);
+	    return true;
+	case RstStream:
+	    {
+		if (! id)
+		    return connError(ProtocolError);
+		if (len != 4)
+		    return connError(FrameSizeError);
+		HTTP2Stream* st = find(id);
+		if (st)
+		    closeStream(st);
+		else if (id > m_lastStream)
+		    return connError(ProtocolError);
+	    }
+	    return true;
+	case Settings:
+	    if (id)
+		return connError(ProtocolError);
+	    if (flags & Ack) {
+		if (len)
+		    return connError(FrameSizeError);
+		return true;
+	    }
+	    if (len % 6)
+		return connError(FrameSizeError);
+	    return settings(data, len, true);
+	case PushPromise:
+	    // clients can't push
+	    return connError(ProtocolError);
+	case Ping:
+	    if (id)
+		return connError(ProtocolError);
+	    if (len != 8)
+		return connError(FrameSizeError);
+	    if (! (flags & Ack))
+		putFrame(Ping, Ack, 0, data, len);
+	    return true;
+	case Goaway:
+	    if (id)
+		return connError(ProtocolError);
+	    Debug("HTTPServer",DebugAll,"HTTP2Session[%p] got GOAWAY",this);
+	    m_goaway = true;
+	    return true;
+	case WindowUpdate:
+	    {
+		if (len != 4)
+		    return connError(FrameSizeError);
+		u_int32_t inc = getUInt32(data) & 0x7fffffff;
+		if (! id) {
+		    if (! inc)
+			return connError(ProtocolError);
+		    m_window += inc;
+		    if (m_window > 0x7fffffff)
+			return connError(FlowControlError);
+		    return true;
+		}
+		HTTP2Stream* st = find(id);
+		if (! st)
+		    return true;
+		st->m_window += inc;
+		if (! inc || st->m_window > 0x7fffffff) {
+		    resetStream(id, inc ? FlowControlError : ProtocolError);
+		    closeStream(st);
+		}
+	    }
+	    return true;
+	case Continuation:
+	    if (! m_blockStream || id != m_blockStream)
+		return connError(ProtocolError);
+	    if (m_block.length() + len > H2_MAX_BLOCK)
+		return connError(ProtocolError);
+	    m_block.append(const_cast<unsigned char*>(data), len);
+	    if (flags & EndHeaders)
+		return headerBlock();
+	    return true;
+    }
+    // unknown frame types must be ignored
+    return true;
+}
+
+bool HTTP2Session::dataFrame(u_int32_t id, int flags, const unsigned char* data, unsigned int len)
+{
+    if (! id)
+	return connError(ProtocolError);
+    // we don't hold back receive window, whole frame is given back at once
+    unsigned int flen = len;
+    if (flen)
+	windowUpdate(0, flen);
+    if (flags & Padded) {
+	if (! len || data[0] >= len)
+	    return connError(ProtocolError);
+	len -= data[0] + 1;
+	data++;
+    }
+    HTTP2Stream* st = find(id);
+    if (! st) {
+	if (id > m_lastStream)
+	    return connError(ProtocolError);
+	return true;
+    }
+    if (st->m_remoteEnd) {
+	resetStream(id, StreamClosed);
+	closeStream(st);
+	return true;
+    }
+    if (flags & EndStream)
+	st->m_remoteEnd = true;
+    else if (streamed(st)) {
+	// stream window comes back as handler reads body, padding right away
+	if (flen > len)
+	    windowUpdate(id, flen - len);
+    }
+    else if (! st->m_routed)
+	st->m_unacked += flen;
+    else if (flen)
+	windowUpdate(id, flen);
+    // response is already going out, body is of no use
+    if (st->m_sending)
+	return true;
+    if (len && ! bodyData(st, data, len))
+	return true;
+    if (st->m_remoteEnd && st->m_routed)
+	bodyDone(st);
+    return true;
+}
+
+bool HTTP2Session::headersFrame(u_int32_t id, int flags, const unsigned char* data, unsigned int len)
+{
+    if (! (id & 1))
+	return connError(ProtocolError);
+    unsigned int pad = 0;
+    if (flags & Padded) {
+	if (! len)
+	    return connError(ProtocolError);
+	pad = *data++;
+	len--;
+    }
+    if (flags & PriorityFlag) {
+	// priorities are advisory, we serve streams in order
+	if (len < 5)
+	    return connError(ProtocolError);
+	data += 5;
+	len -= 5;
+    }
+    if (pad > len)
+	return connError(ProtocolError);
+    m_block.clear();
+    m_block.append(const_cast<unsigned char*>(data), len - pad);
+    m_blockStream = id;
+    m_blockFlags = flags;
+    if (flags & EndHeaders)
+	return headerBlock();
+    return true;
+}
+
+// Header block is complete: a new request or trailers of one
+bool HTTP2Session::headerBlock()
+{
+    u_int32_t id = m_blockStream;
+    bool endStream = 0 != (m_blockFlags & EndStream);
+    m_blockStream = 0;
+    NamedList hdrs("");
+    bool ok = m_decoder.decode((const unsigned char*)m_block.data(), m_block.length(), hdrs);
+    m_block.clear();
+    // decoder state is shared by all streams, it can't recover
+    if (! ok) {
+	if (m_decoder.maxList() && m_decoder.listSize() > m_decoder.maxList()) {
+	    Debug("HTTPServer",DebugNote,"HTTP2Session[%p] header list over %u bytes",this,m_decoder.maxList());
+	    return connError(EnhanceYourCalm);
+	}
+	return connError(CompressionError);
+    }
+    HTTP2Stream* st = find(id);
+    if (st) {
+	if (st->m_remoteEnd || ! endStream) {
+	    resetStream(id, ProtocolError);
+	    closeStream(st);
+	    return true;
+	}
+	// running handlers may be looking at request, it gets them later
+	if (st == m_current)
+	    st->m_trailers.copyParams(hdrs);
+	else
+	    trailers(st, hdrs);
+	st->m_remoteEnd = true;
+	if (st->m_routed && ! st->m_sending)
+	    bodyDone(st);
+	return true;
+    }
+    // late frames of a stream we already closed
+    if (id <= m_lastStream)
+	return true;
+    m_lastStream = id;
+    if (m_goaway)
+	return true;
+    if (m_streams.count() >= m_maxStreams) {
+	resetStream(id, RefusedStream);
+	return true;
+    }
+    return request(id, endStream, hdrs);
+}
+
+// Turn decoded fields into a HTTP/1.1 style head and build request from it
+bool HTTP2Session::request(u_int32_t id, bool endStream, const NamedList& hdrs)
+{
+    const NamedString* method = 0;
+    const NamedString* path = 0;
+    const NamedString* authority = 0;
+    bool malformed = false;
+    bool regular = false;
+    String fields;
+    String cookies;
+    for (unsigned int i = 0; ! malformed && i < hdrs.length(); i++) {
+	const NamedString* ns = hdrs.getParam(i);
+	if (! ns)
+	    continue;
+	const String& name = ns->name();
+	if (ns->find('\r') >= 0 || ns->find('\n') >= 0) {
+	    malformed = true;
+	    break;
+	}
+	if (name[0] == ':') {
+	    // pseudo headers come first
+	    if (regular)
+		malformed = true;
+	    else if (name == YSTRING(":method"))
+		method = ns;
+	    else if (name == YSTRING(":path"))
+		path = ns;
+	    else if (name == YSTRING(":authority"))
+		authority = ns;
+	    else if (name != YSTRING(":scheme"))
+		malformed = true;
+	    continue;
+	}
+	regular = true;
+	if (h2Hop(name) || (name == YSTRING("te") && *ns != YSTRING("trailers"))) {
+	    malformed = true;
+	    break;
+	}
+	// cookie may be split in several fields
+	if (name == YSTRING("cookie")) {
+	    if (cookies)
+		cookies << "; ";
+	    cookies << *ns;
+	    continue;
+	}
+	fields << name << ": " << *ns << "\r\n";
+    }
+    if (malformed || TelEngine::null(method) || TelEngine::null(path)) {
+	Debug("HTTPServer",DebugNote,"HTTP2Session[%p] malformed request on stream %u",this,id);
+	resetStream(id, ProtocolError);
+	return true;
+    }
+    String head;
+    head << *method << " " << *path << " HTTP/2.0\r\n";
+    if (! TelEngine::null(authority))
+	head << "host: " << *authority << "\r\n";
+    head << fields;
+    if (cookies)
+	head << "cookie: " << cookies << "\r\n";
+    head << "\r\n";
+
+    HTTP2Stream* st = new HTTP2Stream(id, m_initWindow);
+    m_streams.append(st);
+    st->m_remoteEnd = endStream;
+    HttpHeadParser& parser = m_conn->m_head;
+    parser.reset();
+    int res = parser.parse(head.c_str(), head.length());
+    if (res != HttpHeadParser::Complete) {
+	parser.reset();
+	if (res == HttpHeadParser::TooLarge)
+	    sendError(st, 431);
+	else {
+	    Debug("HTTPServer",DebugNote,"HTTP2Session[%p] invalid request on stream %u",this,id);
+	    resetStream(id, ProtocolError);
+	    closeStream(st);
+	}
+	return true;
+    }
+    st->m_req = new YHttpRequest(m_conn);
+    st->m_req->deref();
+    bool ok = st->m_req->parse(head.c_str(), parser);
+    parser.reset();
+    if (! ok) {
+	st->m_req = NULL;
+	sendError(st, 400);
+	return true;
+    }
+    st->m_msg = m_conn->routeMessage(st->m_req, ! endStream);
+    queueJob(st, Connection::JobRoute);
+    return true;
+}
+
+bool HTTP2Session::settings(const unsigned char* data, unsigned int len, bool ack)
+{
+    for (unsigned int i = 0; i + 6 <= len; i += 6) {
+	unsigned int key = (data[i] << 8) | data[i + 1];
+	u_int32_t val = getUInt32(data + i + 2);
+	switch (key) {
+	    case 2: // SETTINGS_ENABLE_PUSH, we never push anyway
+		if (val > 1)
+		    return connError(ProtocolError);
+		break;
+	    case 4: // SETTINGS_INITIAL_WINDOW_SIZE
+		{
+		    if (val > 0x7fffffff)
+			return connError(FlowControlError);
+		    int64_t delta = (int64_t)val - m_initWindow;
+		    for (ObjList* l = m_streams.skipNull(); l; l = l->skipNext())
+			static_cast<HTTP2Stream*>(l->get())->m_window += delta;
+		    m_initWindow = val;
+		}
+		break;
+	    case 5: // SETTINGS_MAX_FRAME_SIZE
+		if (val < 16384 || val > 16777215)
+		    return connError(ProtocolError);
+		m_maxFrame = val;
+		break;
+	}
+    }
+    if (ack)
+	putFrame(Settings, Ack, 0, 0, 0);
+    return true;
+}
+
+// Give connection's job slot to queued streams, one at a time
+bool HTTP2Session::runJobs()
+{
+    while (! (m_current || m_failed)) {
+	HTTP2Stream* st = static_cast<HTTP2Stream*>(m_jobs.remove(false));
+	if (! st)
+	    break;
+	Connection& c = *m_conn;
+	m_current = st;
+	c.m_req = st->m_req;
+	c.m_rsp = st->m_rsp;
+	c.m_msg = st->m_msg;
+	st->m_msg = 0;
+	c.m_reqBodyBuffer = st->m_bodyBuffer;
+	c.m_connection = 0;
+	c.m_keepalive = true;
+	c.m_reqParams.clearParams();
+	c.m_reqParamsAll = false;
+	c.m_deferred = st->m_deferred;
+	st->m_deferred = 0;
+	c.m_reqStream = st->m_streamed;
+	st->m_streamed = 0;
+	c.m_streamWindow = 0;
+	int job = st->m_job;
+	st->m_job = -1;
+	if (! c.startJob(job))
+	    return false;
+    }
+    return true;
+}
+
+void HTTP2Session::queueJob(HTTP2Stream* st, int job)
+{
+    st->m_job = job;
+    m_jobs.append(st)->setDelete(false);
+}
+
+// Job of current stream is done, take it's objects back from connection
+bool HTTP2Session::jobDone()
+{
+    Connection& c = *m_conn;
+    HTTP2Stream* st = m_current;
+    m_current = 0;
+    c.m_state = Connection::Http2;
+    st->m_msg = c.m_msg;
+    c.m_msg = 0;
+    st->m_rsp = c.m_rsp;
+    c.m_rsp = NULL;
+    st->m_bodyBuffer = c.m_reqBodyBuffer;
+    c.m_reqBodyBuffer = 0;
+    st->m_deferred = c.m_deferred;
+    c.m_deferred = 0;
+    st->m_streamed = c.m_reqStream;
+    c.m_reqStream = 0;
+    c.m_req = NULL;
+    c.m_reqParams.clearParams();
+    c.m_reqParamsAll = false;
+    int status = c.m_jobStatus;
+    if (c.m_job == Connection::JobRoute)
+	st->m_bodyMax = c.m_bodyMax;
+    if (st->m_trailers.count()) {
+	trailers(st, st->m_trailers);
+	st->m_trailers.clearParams();
+    }
+    if (st->m_reset || m_failed)
+	closeStream(st);
+    else if (status < 0) {
+	resetStream(st->m_id, InternalError);
+	closeStream(st);
+    }
+    else if (status > 0)
+	sendError(st, status);
+    else if (c.m_job == Connection::JobRoute)
+	routed(st);
+    else if (st->m_deferred) {
+	// stream waits for it's response, others go on meanwhile
+	c.m_metrics->add(HTTPMetrics::Deferred);
+	bool body = st->m_streamed && ! st->m_streamed->ended();
+	if (! st->m_deferred->park(c.m_driver, ! body))
+	    queueJob(st, Connection::JobDeferred);
+    }
+    else {
+	// handler asked to close, let other streams finish first
+	if (! c.m_keepalive)
+	    goaway(NoError);
+	sendHeaders(st);
+    }
+    return true;
+}
+
+// See what other threads did to streams: give back window of streamed
+// bodies that were read, queue streams whose deferred response arrived
+bool HTTP2Session::poll()
+{
+    // listener was reloaded, no new streams on this connection
+    if (m_conn->m_listener->draining())
+	goaway(NoError);
+    bool found = false;
+    for (ObjList* l = m_streams.skipNull(); l; l = l->skipNext()) {
+	HTTP2Stream* st = static_cast<HTTP2Stream*>(l->get());
+	StreamedBody* body = streamed(st);
+	if (body) {
+	    unsigned int n = body->ack();
+	    if (n && ! st->m_remoteEnd)
+		windowUpdate(st->m_id, n);
+	}
+	if (st->m_deferred && st->m_deferred->done() && st->m_job < 0 && st != m_current) {
+	    queueJob(st, Connection::JobDeferred);
+	    found = true;
+	}
+    }
+    return !found || runJobs();
+}
+
+// Some stream's handlers are running or it waits for a deferred response
+bool HTTP2Session::waiting() const
+{
+    if (m_current)
+	return true;
+    for (ObjList* l = m_streams.skipNull(); l; l = l->skipNext()) {
+	if (static_cast<HTTP2Stream*>(l->get())->m_deferred)
+	    return true;
+    }
+    return false;
+}
+
+// Request is routed, hand it the body received so far
+void HTTP2Session::routed(HTTP2Stream* st)
+{
+    st->m_routed = true;
+    // handler of streamed body is called before body is read
+    if (st->m_streamed)
+	queueJob(st, Connection::JobServe);
+    unsigned int pending = st->m_pending.length();
+    if (pending) {
+	bool ok = bodyData(st, st->m_pending.data(), pending);
+	st->m_pending.clear();
+	if (! ok)
+	    return;
+    }
+    // streamed body gives back only padding, data when it's read
+    unsigned int ack = st->m_unacked;
+    if (st->m_streamed)
+	ack = (ack > pending) ? ack - pending : 0;
+    st->m_unacked = 0;
+    if (ack && ! st->m_remoteEnd)
+	windowUpdate(st->m_id, ack);
+    if (st->m_remoteEnd)
+	bodyDone(st);
+}
+
+// Return false if stream got an error response instead
+bool HTTP2Session::bodyData(HTTP2Stream* st, const void* data, unsigned int len)
+{
+    if (! st->m_routed) {
+	// limit is known after routing, keep no more than default meanwhile
+	// (or a stream window, that's what peer may send before routing)
+	unsigned int max = m_conn->m_maxReqBody;
+	if (max < H2_WINDOW)
+	    max = H2_WINDOW;
+	if (st->m_pending.length() + len > max) {
+	    sendError(st, 413);
+	    return false;
+	}
+	st->m_pending.append(const_cast<void*>(data), len);
+	return true;
+    }
+    Stream* body = st->m_req->bodyStream();
+    if (! body)
+	return true;
+    if (st->m_bodyRead + len > st->m_bodyMax) {
+	sendError(st, 413);
+	return false;
+    }
+    body->writeData(data, len);
+    st->m_bodyRead += len;
+    return true;
+}
+
+void HTTP2Session::bodyDone(HTTP2Stream* st)
+{
+    if (st->m_req->bodyStream())
+	st->m_req->bodyStream()->terminate();
+    // handler of streamed body was called already, may wait for response
+    if (! streamed(st))
+	queueJob(st, Connection::JobServe);
+    else if (st->m_deferred && st->m_job < 0 && ! st->m_deferred->park(m_conn->m_driver))
+	queueJob(st, Connection::JobDeferred);
+}
+
+// Add trailer fields to request and to message that will serve it
+void HTTP2Session::trailers(HTTP2Stream* st, const NamedList& hdrs)
+{
+    for (unsigned int i = 0; i < hdrs.length(); i++) {
+	const NamedString* ns = hdrs.getParam(i);
+	if (! ns || ns->name()[0] == ':')
+	    continue;
+	st->m_req->addHeader(ns->name(), *ns);
+	if (st->m_msg)
+	    st->m_msg->addParam("hdr_" + ns->name(), *ns);
+    }
+}
+
+// Body handler reads, connection holds it while stream's serve job runs
+StreamedBody* HTTP2Session::streamed(HTTP2Stream* st) const
+{
+    if (st == m_current && st->m_routed)
+	return m_conn->m_reqStream;
+    return st->m_streamed;
+}
+
+// Encode response head as HEADERS and CONTINUATION frames
+void HTTP2Session::sendHeaders(HTTP2Stream* st)
+{
+    YHttpResponse& rsp = *st->m_rsp;
+    if (st->m_req)
+	m_conn->byteRanges(*st->m_req, rsp);
+    HTTPMetrics* metrics = m_conn->m_metrics;
+    metrics->add(HTTPMetrics::Requests);
+    if (m_conn->m_served++)
+	metrics->add(HTTPMetrics::Reused);
+    if (rsp.status() >= 100 && rsp.status() < 600)
+	metrics->add(HTTPMetrics::Status1xx + rsp.status() / 100 - 1);
+    st->m_sendStart = Time::now();
+    DataBlock block;
+    HpackEncoder::status(block, rsp.status());
+    const NamedList& hdrs = rsp.headers();
+    String name;
+    for (unsigned int i = 0; i < hdrs.length(); i++) {
+	const NamedString* ns = hdrs.getParam(i);
+	if (! ns)
+	    continue;
+	name = ns->name();
+	name.toLower();
+	if (h2Hop(name) || name == YSTRING("content-length"))
+	    continue;
+	HpackEncoder::header(block, name.c_str(), name.length(), ns->safe(), ns->length());
+    }
+    const NamedList& statics = m_conn->m_listener->headers();
+    for (unsigned int i = 0; i < statics.length(); i++) {
+	const NamedString* ns = statics.getParam(i);
+	if (! ns || rsp.hasHeader(ns->name()))
+	    continue;
+	name = ns->name();
+	name.toLower();
+	HpackEncoder::header(block, name.c_str(), name.length(), ns->safe(), ns->length());
+    }
+    if (m_conn->m_sendDate) {
+	// skip "Date: " and CRLF of HTTP/1.1 header line
+	const char* date = m_conn->dateHeader();
+	HpackEncoder::header(block, "date", 4, date + 6, ::strlen(date) - 8);
+    }
+    bool body = rsp.bodyStream() && rsp.contentLength();
+    if (rsp.contentLength() != YHttpMessage::UnknownLength) {
+	char tmp[16];
+	unsigned int n = ::snprintf(tmp, sizeof(tmp), "%u", rsp.contentLength());
+	HpackEncoder::header(block, "content-length", 14, tmp, n);
+    }
+    unsigned int len = block.length();
+    const unsigned char* ptr = (const unsigned char*)block.data();
+    int type = Headers;
+    int flags = body ? 0 : EndStream;
+    do {
+	unsigned int n = min(len, m_maxFrame);
+	len -= n;
+	putFrame(type, flags | (len ? 0 : EndHeaders), st->m_id, ptr, n);
+	ptr += n;
+	type = Continuation;
+	flags = 0;
+    } while (len);
+    if (body) {
+	st->m_sending = true;
+	st->m_sndLeft = rsp.contentLength();
+    }
+    else
+	finish(st);
+}
+
+// Send error response on a stream, connection goes on
+void HTTP2Session::sendError(HTTP2Stream* st, int code)
+{
+    Debug("HTTPServer",DebugInfo,"HTTP2Session[%p] stream %u error %d",this,st->m_id,code);
+    m_jobs.remove(st, false);
+    st->m_job = -1;
+    TelEngine::destruct(st->m_msg);
+    st->m_rsp = new YHttpResponse(m_conn);
+    st->m_rsp->deref();
+    st->m_rsp->status(code);
+    if (code == 503)
+	st->m_rsp->setHeader("Retry-After", String(s_retryAfter));
+    m_conn->appendMissingErrorResponseBody(*st->m_rsp);
+    sendHeaders(st);
+}
+
+// Put next DATA frame of a stream in send buffer
+// Return 1 if something was sent, 0 if stream can't send for now
+int HTTP2Session::sendData(HTTP2Stream* st)
+{
+    if (! st->m_sending || st->m_done || st->m_window <= 0 || m_window <= 0)
+	return 0;
+    unsigned int n = min(m_maxFrame, m_conn->m_maxSendChunkSize);
+    if (n > st->m_window)
+	n = st->m_window;
+    if (n > m_window)
+	n = m_window;
+    if (st->m_sndLeft != YHttpMessage::UnknownLength && n > st->m_sndLeft)
+	n = st->m_sndLeft;
+    unsigned char* ptr = m_conn->sendSpace(9 + n);
+    int rd = st->m_rsp->bodyStream()->readData(ptr + 9, n);
+    if (rd < 0 || (! rd && st->m_sndLeft != YHttpMessage::UnknownLength)) {
+	Debug("HTTPServer",DebugInfo,"HTTP2Session[%p] stream %u: response body read error",this,st->m_id);
+	resetStream(st->m_id, InternalError);
+	st->m_sending = false;
+	finish(st);
+	return 1;
+    }
+    bool end = ! rd;
+    if (st->m_sndLeft != YHttpMessage::UnknownLength) {
+	st->m_sndLeft -= rd;
+	end = ! st->m_sndLeft;
+    }
+    putFrameHead(ptr, rd, Data, end ? EndStream : 0, st->m_id);
+    m_conn->m_sndLength += 9 + rd;
+    st->m_window -= rd;
+    m_window -= rd;
+    if (end) {
+	st->m_sending = false;
+	finish(st);
+    }
+    return 1;
+}
+
+// Load DATA frames of responses, taking turns, as much as flow control allows
+// Return true if anything was added to send buffer
+bool HTTP2Session::fill()
+{
+    bool added = false;
+    bool more = true;
+    while (more && m_window > 0 && m_conn->m_sndLength - m_conn->m_sndOffset < PIPELINE_BATCH) {
+	more = false;
+	for (ObjList* l = m_streams.skipNull(); l; l = l->skipNext()) {
+	    if (sendData(static_cast<HTTP2Stream*>(l->get()))) {
+		added = true;
+		more = true;
+	    }
+	}
+    }
+    purge();
+    return added;
+}
+
+bool HTTP2Session::wantWrite() const
+{
+    if (m_window <= 0)
+	return false;
+    for (ObjList* l = m_streams.skipNull(); l; l = l->skipNext()) {
+	const HTTP2Stream* st = static_cast<const HTTP2Stream*>(l->get());
+	if (st->m_sending && st->m_window > 0)
+	    return true;
+    }
+    return false;
+}
+
+// Response is complete, stream goes away with next purge
+void HTTP2Session::finish(HTTP2Stream* st)
+{
+    // peer may still be sending a body nobody will read
+    if (! st->m_remoteEnd)
+	resetStream(st->m_id, NoError);
+    st->m_done = true;
+    if (st->m_sendStart)
+	m_conn->m_metrics->time(HTTPMetrics::Send, Time::now() - st->m_sendStart);
+}
+
+void HTTP2Session::closeStream(HTTP2Stream* st)
+{
+    if (st == m_current) {
+	// handlers are running, drop it when they are done
+	st->m_reset = true;
+	return;
+    }
+    m_jobs.remove(st, false);
+    m_streams.remove(st);
+}
+
+// Remove finished streams
+void HTTP2Session::purge()
+{
+    for (ObjList* l = m_streams.skipNull(); l; ) {
+	HTTP2Stream* st = static_cast<HTTP2Stream*>(l->get());
+	if (st->m_done && st != m_current) {
+	    m_jobs.remove(st, false);
+	    l->remove();
+	    l = l->skipNull();
+	}
+	else
+	    l = l->skipNext();
+    }
+}
+
+HTTP2Stream* HTTP2Session::find(u_int32_t id) const
+{
+    for (ObjList* l = m_streams.skipNull(); l; l = l->skipNext()) {
+	HTTP2Stream* st = static_cast<HTTP2Stream*>(l->get());
+	if (st->m_id == id)
+	    return st->m_done ? 0 : st;
+    }
+    return 0;
+}
+
+void HTTP2Session::resetStream(u_int32_t id, int error)
+{
+    unsigned char buf[4];
+    putUInt32(buf, error);
+    putFrame(RstStream, 0, id, buf, sizeof(buf));
+}
+
+// Connection error: tell peer why and stop, close when GOAWAY is sent
+bool HTTP2Session::connError(int error)
+{
+    Debug("HTTPServer",DebugNote,"HTTP2Session[%p] connection error %d",this,error);
+    goaway(error);
+    m_failed = true;
+    m_blockStream = 0;
+    m_jobs.clear();
+    // running handlers still use current stream's objects
+    for (ObjList* l = m_streams.skipNull(); l; l = l->skipNext())
+	static_cast<HTTP2Stream*>(l->get())->m_done = true;
+    purge();
+    return true;
+}
+
+void HTTP2Session::goaway(int error)
+{
+    if (m_goaway && (m_failed || ! error))
+	return;
+    unsigned char buf[8];
+    putUInt32(buf, m_lastStream);
+    putUInt32(buf + 4, error);
+    putFrame(Goaway, 0, 0, buf, sizeof(buf));
+    m_goaway = true;
+}
+
+void HTTP2Session::windowUpdate(u_int32_t id, unsigned int inc)
+{
+    unsigned char buf[4];
+    putUInt32(buf, inc);
+    putFrame(WindowUpdate, 0, id, buf, sizeof(buf));
+}
+
+void HTTP2Session::putFrame(int type, int flags, u_int32_t id, const void* data, unsigned int len)
+{
+    unsigned char* ptr = m_conn->sendSpace(9 + len);
+    putFrameHead(ptr, len, type, flags, id);
+    if (len)
+	::memcpy(ptr + 9, data, len);
+    m_conn->m_sndLength += 9 + len;
+}
+
+/**
+ * ConnectionThread
+ */
+void ConnectionThread::run()
+{
+    if (m_conn->upgraded())
+	m_conn->runUpgrade();
+    else
+	m_conn->runConnection();
+    m_conn->reset();
+    m_conn = NULL;
+}
+
+#ifdef HAVE_EPOLL
+/**
+ * HTTPReactor
+ */
+HTTPReactor::HTTPReactor()
+    : Thread("HTTPServer reactor"),
+      m_epoll(-1),
+      m_wake(-1),
+      m_mutex(false, "HTTPReactor"),
+      m_count(0)
+{
+    m_epoll = ::epoll_create(REACTOR_EVENTS);
+    if (m_epoll < 0) {
+	Alarm("HTTPServer","system",DebugGoOn,"Unable to create epoll instance: %s",strerror(errno));
+	return;
+    }
+    // workers poke this one when they give a connection back
+    m_wake = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev;
+    ::memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0;
+    if (m_wake < 0 || ::epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &ev)) {
+	Alarm("HTTPServer","system",DebugGoOn,"Unable to create reactor wakeup event: %s",strerror(errno));
+	::close(m_epoll);
+	m_epoll = -1;
+    }
+}
+
+HTTPReactor::~HTTPReactor()
+{
+    m_conns.clear();
+    if (m_wake >= 0)
+	::close(m_wake);
+    if (m_epoll >= 0)
+	::close(m_epoll);
+}
+
+// Start reactor threads, return how many are running
+unsigned int HTTPReactor::start(unsigned int threads)
+{
+    if (s_reactors || !threads)
+	return s_reactorCount;
+    s_reactors = new HTTPReactor*[threads];
+    for (unsigned int i = 0; i < threads; i++) {
+	HTTPReactor* r = new HTTPReactor;
+	if (r->m_epoll < 0 || !r->startup()) {
+	    delete r;
+	    break;
+	}
+	s_reactors[s_reactorCount++] = r;
+    }
+    Debug("HTTPServer",DebugInfo,"Started %u reactor threads",s_reactorCount);
+    return s_reactorCount;
+}
+
+// Hand a new connection over to the least loaded reactor
+bool HTTPReactor::assign(Connection* conn)
+{
+    HTTPReactor* best = 0;
+    for (unsigned int i = 0; i < s_reactorCount; i++)
+	if (!best || s_reactors[i]->count() < best->count())
+	    best = s_reactors[i];
+    return best && best->attach(conn);
+}
+
+// Take ownership of connection's reference
+bool HTTPReactor::attach(Connection* conn)
+{
+    struct epoll_event ev;
+    ::memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    Lock mylock(m_mutex);
+    conn->m_events = ev.events;
+    conn->driver(this);
+    if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, conn->socket()->handle(), &ev)) {
+	Debug("HTTPServer",DebugWarn,"Failed to add socket %d to reactor: %s",
+	    conn->socket()->handle(),strerror(errno));
+	return false;
+    }
+    m_conns.append(conn);
+    m_count++;
+    conn->timer();
+    return true;
+}
+
+void HTTPReactor::run()
+{
+    struct epoll_event events[REACTOR_EVENTS];
+    for (;;) {
+	Thread::check();
+	int n = ::epoll_wait(m_epoll, events, REACTOR_EVENTS, REACTOR_WAIT_MS);
+	if (n < 0 && errno != EINTR) {
+	    Debug("HTTPServer",DebugWarn,"Reactor wait error: %s",strerror(errno));
+	    Thread::idle();
+	}
+	for (int i = 0; i < n; i++) {
+	    Connection* conn = static_cast<Connection*>(events[i].data.ptr);
+	    if (conn)
+		process(conn, events[i].events);
+	    else
+		resumed();
+	}
+    }
+}
+
+// Feed socket events to connection's state machine
+void HTTPReactor::process(Connection* conn, unsigned int events)
+{
+    // a worker owns it for now, events will show up again once it's back
+    if (conn->dispatching())
+	return;
+    bool ok = !(events & EPOLLERR);
+    if (ok && (events & (EPOLLIN | EPOLLHUP)) && conn->wantRead())
+	ok = conn->readable();
+    settle(conn, ok);
+}
+
+// Push out what is ready, then set connection's fate
+void HTTPReactor::settle(Connection* conn, bool ok)
+{
+    // try writing even without EPOLLOUT, input may have produced a response
+    if (ok && conn->wantWrite())
+	ok = conn->writable();
+    if (ok)
+	conn->timer();
+    if (ok && conn->upgraded()) {
+	// handler needs a thread of its own to run in
+	::epoll_ctl(m_epoll, EPOLL_CTL_DEL, conn->socket()->handle(), 0);
+	ConnectionThread* t = new ConnectionThread(conn);
+	if (!t->startup())
+	    delete t;
+	Lock mylock(m_mutex);
+	if (m_conns.remove(conn, false)) {
+	    m_count--;
+	    conn->deref();
+	}
+	return;
+    }
+    if (!(ok && update(conn)))
+	close(conn);
+}
+
+// Set epoll interest to what connection's state needs
+bool HTTPReactor::update(Connection* conn)
+{
+    // edge triggered while dispatching so pending input doesn't spin us
+    unsigned int want = (conn->dispatching() || conn->stalled()) ? EPOLLET :
+	(conn->wantWrite() ? (conn->duplex() ? EPOLLOUT | EPOLLIN : EPOLLOUT) : EPOLLIN);
+    if (want == conn->m_events)
+	return true;
+    struct epoll_event ev;
+    ::memset(&ev, 0, sizeof(ev));
+    ev.events = want;
+    ev.data.ptr = conn;
+    if (::epoll_ctl(m_epoll, EPOLL_CTL_MOD, conn->socket()->handle(), &ev)) {
+	Debug("HTTPServer",DebugWarn,"Failed to update reactor socket %d: %s",
+	    conn->socket()->handle(),strerror(errno));
+	return false;
+    }
+    conn->m_events = want;
+    return true;
+}
+
+// Called from worker thread, connection stays referenced by m_conns
+void HTTPReactor::resume(Connection* conn, void* data)
+{
+    m_mutex.lock();
+    m_resumed.append(conn)->setDelete(false);
+    m_mutex.unlock();
+    uint64_t one = 1;
+    if (::write(m_wake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	Debug("HTTPServer",DebugWarn,"Failed to wake up reactor: %s",strerror(errno));
+}
+
+// Continue connections whose handlers have finished
+void HTTPReactor::resumed()
+{
+    uint64_t count;
+    while (::read(m_wake, &count, sizeof(count)) > 0)
+	;
+    for (;;) {
+	m_mutex.lock();
+	Connection* conn = static_cast<Connection*>(m_resumed.remove(false));
+	m_mutex.unlock();
+	if (!conn)
+	    break;
+	settle(conn, conn->resume());
+    }
+    for (;;) {
+	m_mutex.lock();
+	Connection* conn = static_cast<Connection*>(m_woken.remove(false));
+	// connection may have closed meanwhile
+	bool mine = conn && m_conns.find(conn);
+	m_mutex.unlock();
+	if (!conn)
+	    break;
+	if (mine)
+	    settle(conn, conn->woken());
+	conn->deref();
+    }
+}
+
+// Called from any thread with a referenced connection
+void HTTPReactor::wake(Connection* conn)
+{
+    m_mutex.lock();
+    m_woken.append(conn)->setDelete(false);
+    m_mutex.unlock();
+    uint64_t one = 1;
+    if (::write(m_wake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	Debug("HTTPServer",DebugWarn,"Failed to wake up reactor: %s",strerror(errno));
+}
+
+void HTTPReactor::close(Connection* conn)
+{
+    ::epoll_ctl(m_epoll, EPOLL_CTL_DEL, conn->socket()->handle(), 0);
+    // handlers still use it, we close it once they're done
+    if (conn->working()) {
+	conn->drop();
+	return;
+    }
+    conn->reset();
+    Lock mylock(m_mutex);
+    if (m_conns.remove(conn, false)) {
+	m_count--;
+	conn->deref();
     }
+}
+#endif
 
-    // Keepalive
-    m_keepalive = m.getBoolValue("keepalive", m_keepalive);
-    if(! --m_maxRequests)
-	m_keepalive = false;
-    if(m_keepalive) {
-	m_connection &= ~Close;
-	m_connection |= KeepAlive;
-    } else {
-	m_connection &= ~KeepAlive;
-	m_connection |= Close;
+#ifdef HAVE_LIBURING
+/**
+ * HTTPUring
+ */
+HTTPUring::HTTPUring(HTTPServerListener* listener)
+    : m_listener(listener),
+      m_accepting(false),
+      m_bufRing(0),
+      m_bufs(0),
+      m_bufCount(256),
+      m_bufSize(BODY_BUF_SIZE),
+      m_ringOk(false),
+      m_multishot(true),
+      m_listenFd(-1),
+      m_wake(-1),
+      m_wakeBuf(0),
+      m_mutex(false, "HTTPUring")
+{
+    // provided buffers ring size must be a power of 2
+    unsigned int n = listener->cfg().getIntValue("uringbuffers",256,16,32768);
+    for (m_bufCount = 16; m_bufCount < n; m_bufCount <<= 1)
+	;
+}
+
+HTTPUring::~HTTPUring()
+{
+    m_conns.clear();
+    if (m_bufRing)
+	::io_uring_free_buf_ring(&m_ring, m_bufRing, m_bufCount, URING_BGID);
+    if (m_ringOk)
+	::io_uring_queue_exit(&m_ring);
+    delete[] m_bufs;
+    if (m_wake >= 0)
+	::close(m_wake);
+}
+
+// Set up ring and provided receive buffers, fail if kernel lacks support
+bool HTTPUring::init(int fd)
+{
+    int err = ::io_uring_queue_init(URING_ENTRIES, &m_ring, 0);
+    if (err < 0) {
+	Debug("HTTPServer",DebugNote,"Unable to create io_uring: %s",strerror(-err));
+	return false;
+    }
+    m_ringOk = true;
+    m_bufRing = ::io_uring_setup_buf_ring(&m_ring, m_bufCount, URING_BGID, 0, &err);
+    if (!m_bufRing) {
+	Debug("HTTPServer",DebugNote,"Unable to register io_uring buffer ring: %s",strerror(-err));
+	return false;
     }
+    m_bufs = new unsigned char[m_bufCount * m_bufSize];
+    int mask = ::io_uring_buf_ring_mask(m_bufCount);
+    for (unsigned int i = 0; i < m_bufCount; i++)
+	::io_uring_buf_ring_add(m_bufRing, m_bufs + i * m_bufSize, m_bufSize, i, mask, i);
+    ::io_uring_buf_ring_advance(m_bufRing, m_bufCount);
+    m_wake = ::eventfd(0, EFD_CLOEXEC);
+    if (m_wake < 0) {
+	Debug("HTTPServer",DebugNote,"Unable to create io_uring wakeup event: %s",strerror(errno));
+	return false;
+    }
+    m_listenFd = fd;
+    return true;
+}
 
-    // Prepare response
-    m_rsp->setHeader("Connection", connectionHeader());
-    m_rsp->update(m);
-    if (m.retValue().null() || 0 == m.retValue().length()) {
-	TelEngine::Stream* strm = reinterpret_cast<TelEngine::Stream*>(m.userObject(YATOM("Stream")));
-	if(strm) {
-	    TelEngine::RefObject* ref = reinterpret_cast<TelEngine::RefObject*>(m.userObject("RefObject"));
-	    XDebug("HTTPServer",DebugInfo,"Connection[%p] got stream response %p, ref %p", this, strm, ref);
-	    m_rsp->setBody(strm, ref);
+// Get a submission entry, flush the queue if it's full
+struct io_uring_sqe* HTTPUring::getSqe()
+{
+    struct io_uring_sqe* sqe = ::io_uring_get_sqe(&m_ring);
+    if (!sqe) {
+	::io_uring_submit(&m_ring);
+	sqe = ::io_uring_get_sqe(&m_ring);
+    }
+    return sqe;
+}
+
+// Operation is tagged in the low bits of connection pointer
+void HTTPUring::submit(struct io_uring_sqe* sqe, UringConn* c, int op)
+{
+    ::io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)c | op);
+    if (c && op != Cancel)
+	c->m_pending++;
+}
+
+bool HTTPUring::armAccept()
+{
+    struct io_uring_sqe* sqe = getSqe();
+    if (!sqe)
+	return false;
+    if (m_multishot)
+	::io_uring_prep_multishot_accept(sqe, m_listenFd, 0, 0, 0);
+    else
+	::io_uring_prep_accept(sqe, m_listenFd, 0, 0, 0);
+    submit(sqe, 0, Accept);
+    m_accepting = true;
+    return true;
+}
+
+// Keep a read pending on the event workers signal when they are done
+bool HTTPUring::armWake()
+{
+    struct io_uring_sqe* sqe = getSqe();
+    if (!sqe)
+	return false;
+    ::io_uring_prep_read(sqe, m_wake, &m_wakeBuf, sizeof(m_wakeBuf), 0);
+    submit(sqe, 0, Wake);
+    return true;
+}
+
+bool HTTPUring::armRecv(UringConn* c)
+{
+    struct io_uring_sqe* sqe = getSqe();
+    if (!sqe)
+	return false;
+    if (m_multishot)
+	::io_uring_prep_recv_multishot(sqe, c->m_fd, 0, 0, 0);
+    else
+	::io_uring_prep_recv(sqe, c->m_fd, 0, m_bufSize, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    submit(sqe, c, Recv);
+    c->m_recv = true;
+    return true;
+}
+
+void HTTPUring::run()
+{
+    armAccept();
+    armWake();
+    bool cancelled = false;
+    for (;;) {
+	Thread::check();
+	// stopped listener serves it's connections until they are gone
+	if (m_listener->m_stopping) {
+	    if (m_accepting && !cancelled) {
+		struct io_uring_sqe* sqe = getSqe();
+		if (sqe) {
+		    ::io_uring_prep_cancel64(sqe, Accept, 0);
+		    submit(sqe, 0, Cancel);
+		    cancelled = true;
+		}
+	    }
+	    else if (!(m_accepting || m_conns.skipNull()))
+		break;
 	}
-	else {
-	    m_rsp->contentLength(0);
-	    appendMissingErrorResponseBody(*m_rsp);
+	struct __kernel_timespec ts;
+	ts.tv_sec = 0;
+	ts.tv_nsec = REACTOR_WAIT_MS * 1000000;
+	struct io_uring_cqe* cqe = 0;
+	int err = ::io_uring_submit_and_wait_timeout(&m_ring, &cqe, 1, &ts, 0);
+	if (err < 0 && err != -ETIME && err != -EINTR) {
+	    Debug("HTTPServer",DebugWarn,"io_uring wait error: %s",strerror(-err));
+	    Thread::idle();
 	}
+	unsigned int head;
+	unsigned int n = 0;
+	io_uring_for_each_cqe(&m_ring, head, cqe) {
+	    complete(cqe);
+	    n++;
+	}
+	::io_uring_cq_advance(&m_ring, n);
     }
-    else {
-	XDebug("HTTPServer",DebugInfo,"Connection[%p] got simple response <<%s>>", this, m.retValue().c_str());
-	m_rsp->setBody(m.retValue());
+}
+
+void HTTPUring::complete(struct io_uring_cqe* cqe)
+{
+    uint64_t data = ::io_uring_cqe_get_data64(cqe);
+    UringConn* c = (UringConn*)(uintptr_t)(data & ~(uint64_t)7);
+    bool more = 0 != (cqe->flags & IORING_CQE_F_MORE);
+    switch ((int)(data & 7)) {
+	case Accept:
+	    if (cqe->res == -EINVAL && m_multishot) {
+		Debug("HTTPServer",DebugNote,"Kernel has no multishot io_uring operations, using single shot ones");
+		m_multishot = false;
+	    }
+	    else if (cqe->res >= 0)
+		accepted(cqe->res);
+	    else if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED)
+		Debug("HTTPServer",DebugWarn,"Accept error: %s",strerror(-cqe->res));
+	    if (more)
+		break;
+	    if (!m_listener->m_stopping)
+		armAccept();
+	    else {
+		m_accepting = false;
+		// serve what is queued on a socket nobody took over
+		int fd;
+		while (!m_listener->m_takenOver &&
+			(fd = ::accept4(m_listenFd, 0, 0, SOCK_CLOEXEC)) >= 0)
+		    accepted(fd);
+		m_listener->m_socket.terminate();
+	    }
+	    break;
+	case Recv:
+	    if (!more) {
+		c->m_recv = false;
+		c->m_pending--;
+	    }
+	    received(c, cqe);
+	    release(c);
+	    break;
+	case Send:
+	    c->m_pending--;
+	    c->m_sending = false;
+	    sent(c, cqe->res);
+	    release(c);
+	    break;
+	case Wake:
+	    resumed();
+	    armWake();
+	    break;
+    }
+}
+
+// Listener stops, wake up loop to cancel accepting
+void HTTPUring::stop()
+{
+    uint64_t one = 1;
+    if (::write(m_wake, &one, sizeof(one)) < 0)
+	Debug("HTTPServer",DebugWarn,"Failed to wake up io_uring loop: %s",strerror(errno));
+}
+
+// Called from worker thread, UringConn can't go away while dispatching
+void HTTPUring::resume(Connection* conn, void* data)
+{
+    m_mutex.lock();
+    m_resumed.append(static_cast<UringConn*>(data))->setDelete(false);
+    m_mutex.unlock();
+    uint64_t one = 1;
+    if (::write(m_wake, &one, sizeof(one)) < 0)
+	Debug("HTTPServer",DebugWarn,"Failed to wake up io_uring loop: %s",strerror(errno));
+}
+
+// Continue connections whose handlers have finished
+void HTTPUring::resumed()
+{
+    for (;;) {
+	m_mutex.lock();
+	UringConn* c = static_cast<UringConn*>(m_resumed.remove(false));
+	m_mutex.unlock();
+	if (!c)
+	    break;
+	if (c->m_conn->resume())
+	    pump(c);
+	else
+	    close(c);
+	release(c);
+    }
+    for (;;) {
+	m_mutex.lock();
+	Connection* conn = static_cast<Connection*>(m_woken.remove(false));
+	m_mutex.unlock();
+	if (!conn)
+	    break;
+	// connection may have closed meanwhile
+	UringConn* c = static_cast<UringConn*>(conn->driverData());
+	if (m_conns.find(c) && c->m_conn == conn && !c->m_closing) {
+	    if (conn->woken())
+		pump(c);
+	    else
+		close(c);
+	    release(c);
+	}
+	conn->deref();
+    }
+}
+
+// Called from any thread with a referenced connection
+void HTTPUring::wake(Connection* conn)
+{
+    m_mutex.lock();
+    m_woken.append(conn)->setDelete(false);
+    m_mutex.unlock();
+    uint64_t one = 1;
+    if (::write(m_wake, &one, sizeof(one)) < 0)
+	Debug("HTTPServer",DebugWarn,"Failed to wake up io_uring loop: %s",strerror(errno));
+}
+
+void HTTPUring::accepted(int fd)
+{
+    Socket* sock = new Socket(fd);
+    SocketAddr sa;
+    sock->getPeerName(sa);
+    if (!m_listener->admit(sock,sa))
+	return;
+    Connection* conn = m_listener->create(sock,sa,false,0);
+    if (!conn) {
+	Debug("HTTPServer",DebugWarn,"Connection rejected for %s",sa.addr().c_str());
+	return;
+    }
+    UringConn* c = new UringConn(conn);
+    conn->driver(this, c);
+    conn->deref();
+    m_conns.append(c);
+    conn->timer();
+    if (!armRecv(c))
+	close(c);
+    release(c);
+}
+
+void HTTPUring::received(UringConn* c, struct io_uring_cqe* cqe)
+{
+    int res = cqe->res;
+    if (res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+	unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	unsigned char* buf = m_bufs + bid * m_bufSize;
+	bool ok = c->m_closing || c->m_conn->input(buf, res);
+	// give the buffer back to kernel
+	::io_uring_buf_ring_add(m_bufRing, buf, m_bufSize, bid, ::io_uring_buf_ring_mask(m_bufCount), 0);
+	::io_uring_buf_ring_advance(m_bufRing, 1);
+	if (!ok) {
+	    close(c);
+	    return;
+	}
+    }
+    else if (c->m_closing || res == -ECANCELED)
+	return;
+    else if (!res) {
+	if (!c->m_conn->input(0, 0)) {
+	    close(c);
+	    return;
+	}
+    }
+    else if (res == -EINVAL && m_multishot) {
+	Debug("HTTPServer",DebugNote,"Kernel has no multishot io_uring receive, using single shot one");
+	m_multishot = false;
+    }
+    else if (res != -ENOBUFS) {
+	Debug("HTTPServer",DebugInfo,"Socket read error %d on %d",-res,c->m_fd);
+	close(c);
+	return;
+    }
+    // peer sent EOF, no point in receiving more
+    if (!(c->m_recv || c->m_paused || c->m_closing) && res && !armRecv(c)) {
+	close(c);
+	return;
+    }
+    pump(c);
+}
+
+void HTTPUring::sent(UringConn* c, int res)
+{
+    if (c->m_closing)
+	return;
+    if (res < 0) {
+	Debug("HTTPServer",DebugInfo,"Socket write error %d on %d",-res,c->m_fd);
+	close(c);
+	return;
+    }
+    c->m_conn->sent(res);
+    pump(c);
+}
+
+// Keep one send in flight while connection has something to say
+void HTTPUring::pump(UringConn* c)
+{
+    flow(c);
+    if (c->m_closing)
+	return;
+    Connection* conn = c->m_conn;
+    conn->timer();
+    if (c->m_sending)
+	return;
+    if (conn->wantWrite()) {
+	const void* data = 0;
+	unsigned int len = 0;
+	if (!conn->output(data, len)) {
+	    close(c);
+	    return;
+	}
+	if (len) {
+	    struct io_uring_sqe* sqe = getSqe();
+	    if (!sqe) {
+		close(c);
+		return;
+	    }
+	    if (c->m_out.length() < len)
+		c->m_out.resize(len);
+	    ::memcpy(c->m_out.data(), data, len);
+	    ::io_uring_prep_send(sqe, c->m_fd, c->m_out.data(), len, MSG_NOSIGNAL);
+	    submit(sqe, c, Send);
+	    c->m_sending = true;
+	    return;
+	}
+    }
+    if (conn->upgraded()) {
+	// handler runs in a thread of its own once our receive is gone
+	close(c);
+    }
+}
+
+// Stop receiving while request body waits for it's reader, restart after
+void HTTPUring::flow(UringConn* c)
+{
+    if (c->m_closing)
+	return;
+    if (c->m_conn->stalled()) {
+	if (c->m_recv && !c->m_paused) {
+	    struct io_uring_sqe* sqe = getSqe();
+	    if (sqe) {
+		::io_uring_prep_cancel64(sqe, (uint64_t)(uintptr_t)c | Recv, 0);
+		submit(sqe, c, Cancel);
+	    }
+	}
+	c->m_paused = true;
+    }
+    else if (c->m_paused) {
+	c->m_paused = false;
+	if (!c->m_recv && !armRecv(c))
+	    close(c);
+    }
+}
+
+// Cancel everything pending on connection, it goes away when they complete
+void HTTPUring::close(UringConn* c)
+{
+    if (c->m_closing)
+	return;
+    c->m_closing = true;
+    if (c->m_recv) {
+	struct io_uring_sqe* sqe = getSqe();
+	if (sqe) {
+	    ::io_uring_prep_cancel64(sqe, (uint64_t)(uintptr_t)c | Recv, 0);
+	    submit(sqe, c, Cancel);
+	}
+	else
+	    ::shutdown(c->m_fd, SHUT_RDWR);
+    }
+}
+
+void HTTPUring::release(UringConn* c)
+{
+    if (!(c->m_closing && !c->m_pending) || c->m_conn->dispatching() || c->m_conn->working())
+	return;
+    RefPointer<Connection> conn = c->m_conn;
+    m_conns.remove(c);
+    if (conn->upgraded()) {
+	ConnectionThread* t = new ConnectionThread(conn);
+	if (t->startup())
+	    return;
+	delete t;
+    }
+    conn->reset();
+}
+#endif
+
+#ifdef HAVE_EPOLL
+/**
+ * TLSHandshaker
+ */
+TLSPending::TLSPending(HTTPServerListener* listener, Socket* sock, const SocketAddr& addr)
+    : m_listener(listener),
+      m_sock(sock),
+      m_tls(0),
+      m_addr(addr),
+      m_start(Time::now()),
+      m_deadline(0),
+      m_events(0)
+{
+    if (listener->handshakeTimeout())
+	m_deadline = Time::secNow() + listener->handshakeTimeout();
+    // admitted already, later sockets must see it in limits
+    Lock mylock(s_mutex);
+    countAdmitted(listener->cfg(),m_addr.host(),true);
+}
+
+TLSPending::~TLSPending()
+{
+    delete m_sock;
+}
+
+// Connection built from socket (if any) counts itself from now on
+void TLSPending::release()
+{
+    Lock mylock(s_mutex);
+    countAdmitted(m_listener->cfg(),m_addr.host(),false);
+}
+
+TLSHandshaker::TLSHandshaker()
+    : Thread("HTTPServer handshake"),
+      m_epoll(-1),
+      m_wake(-1),
+      m_mutex(false, "TLSHandshaker"),
+      m_count(0)
+{
+    m_epoll = ::epoll_create(REACTOR_EVENTS);
+    if (m_epoll < 0) {
+	Alarm("HTTPServer","system",DebugGoOn,"Unable to create epoll instance: %s",strerror(errno));
+	return;
+    }
+    // accept threads poke this one when they queue a socket
+    m_wake = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev;
+    ::memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0;
+    if (m_wake < 0 || ::epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &ev)) {
+	Alarm("HTTPServer","system",DebugGoOn,"Unable to create handshake wakeup event: %s",strerror(errno));
+	::close(m_epoll);
+	m_epoll = -1;
+    }
+}
+
+TLSHandshaker::~TLSHandshaker()
+{
+    m_queue.clear();
+    m_pending.clear();
+    if (m_wake >= 0)
+	::close(m_wake);
+    if (m_epoll >= 0)
+	::close(m_epoll);
+}
+
+// Start handshake threads, return how many are running
+unsigned int TLSHandshaker::start(unsigned int threads)
+{
+    if (s_handshakers || !threads)
+	return s_handshakerCount;
+    s_handshakers = new TLSHandshaker*[threads];
+    for (unsigned int i = 0; i < threads; i++) {
+	TLSHandshaker* h = new TLSHandshaker;
+	if (h->m_epoll < 0 || !h->startup()) {
+	    delete h;
+	    break;
+	}
+	s_handshakers[s_handshakerCount++] = h;
+    }
+    Debug("HTTPServer",DebugInfo,"Started %u handshake threads",s_handshakerCount);
+    return s_handshakerCount;
+}
+
+// Hand accepted TLS socket to the least busy handshake thread
+// Socket is dropped if all of them have maxhandshakes already
+bool TLSHandshaker::queue(HTTPServerListener* listener, Socket* sock, const SocketAddr& addr)
+{
+    TLSHandshaker* best = 0;
+    for (unsigned int i = 0; i < s_handshakerCount; i++)
+	if (!best || s_handshakers[i]->count() < best->count())
+	    best = s_handshakers[i];
+    if (!best)
+	return false;
+    if (s_maxHandshakes && best->count() >= s_maxHandshakes) {
+	listener->metrics()->add(HTTPMetrics::RejectLimit);
+	DDebug("HTTPServer",DebugInfo,"Listener '%s' refused %s, handshake queue full",
+	    listener->cfg().c_str(),addr.addr().c_str());
+	delete sock;
+	return true;
+    }
+    best->m_mutex.lock();
+    best->m_queue.append(new TLSPending(listener,sock,addr));
+    best->m_count++;
+    best->m_mutex.unlock();
+    uint64_t one = 1;
+    if (::write(best->m_wake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	Debug("HTTPServer",DebugWarn,"Failed to wake up handshake thread: %s",strerror(errno));
+    return true;
+}
+
+// Handshakes queued or in progress in all threads
+unsigned int TLSHandshaker::pending()
+{
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < s_handshakerCount; i++)
+	n += s_handshakers[i]->count();
+    return n;
+}
+
+void TLSHandshaker::run()
+{
+    struct epoll_event events[REACTOR_EVENTS];
+    u_int32_t checked = 0;
+    for (;;) {
+	Thread::check();
+	int n = ::epoll_wait(m_epoll, events, REACTOR_EVENTS, REACTOR_WAIT_MS);
+	if (n < 0 && errno != EINTR) {
+	    Debug("HTTPServer",DebugWarn,"Handshake wait error: %s",strerror(errno));
+	    Thread::idle();
+	}
+	for (int i = 0; i < n; i++) {
+	    TLSPending* p = static_cast<TLSPending*>(events[i].data.ptr);
+	    if (p)
+		step(p);
+	    else
+		incoming();
+	}
+	u_int32_t now = Time::secNow();
+	if (now != checked) {
+	    checked = now;
+	    expire(now);
+	}
+    }
+}
+
+// Take sockets queued by accept threads
+void TLSHandshaker::incoming()
+{
+    uint64_t count;
+    while (::read(m_wake, &count, sizeof(count)) > 0)
+	;
+    for (;;) {
+	m_mutex.lock();
+	TLSPending* p = static_cast<TLSPending*>(m_queue.remove(false));
+	m_mutex.unlock();
+	if (!p)
+	    break;
+	begin(p);
+    }
+}
+
+// Start handshake of a queued socket, socket.ssl handler does it's part
+// of it while dispatched from here
+void TLSHandshaker::begin(TLSPending* p)
+{
+#ifdef HAVE_OPENSSL
+    TLSContext* ctx = p->m_listener->tls();
+    if (ctx) {
+	SSL* ssl = p->m_sock->setBlocking(false) ?
+	    ctx->create(p->m_sock->handle(),p->m_listener->cfg().getBoolValue("http2",true)) : 0;
+	if (!ssl) {
+	    finish(p,false);
+	    return;
+	}
+	p->m_tls = new TLSSocket(p->m_sock->detach(),ssl);
+	delete p->m_sock;
+	p->m_sock = p->m_tls;
+	struct epoll_event ev;
+	::memset(&ev, 0, sizeof(ev));
+	ev.events = p->m_events = EPOLLIN;
+	ev.data.ptr = p;
+	m_pending.append(p);
+	if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, p->m_sock->handle(), &ev)) {
+	    Debug("HTTPServer",DebugWarn,"Failed to add socket %d to handshake thread: %s",
+		p->m_sock->handle(),strerror(errno));
+	    finish(p,false);
+	    return;
+	}
+	// client hello is usually there already
+	step(p);
+	return;
     }
+#endif
+    finish(p,true);
+}
+
+// Socket is ready, go on with handshake
+void TLSHandshaker::step(TLSPending* p)
+{
+#ifdef HAVE_OPENSSL
+    int res = p->m_tls->handshake();
+    if (res) {
+	finish(p,res > 0);
+	return;
+    }
+    unsigned int want = p->m_tls->wantWrite() ? EPOLLOUT : EPOLLIN;
+    if (want == p->m_events)
+	return;
+    struct epoll_event ev;
+    ::memset(&ev, 0, sizeof(ev));
+    ev.events = want;
+    ev.data.ptr = p;
+    if (::epoll_ctl(m_epoll, EPOLL_CTL_MOD, p->m_sock->handle(), &ev))
+	finish(p,false);
+    else
+	p->m_events = want;
+#endif
+}
+
+// Handshake is over, build connection around socket or drop it
+void TLSHandshaker::finish(TLSPending* p, bool ok)
+{
+    if (p->m_tls) {
+	::epoll_ctl(m_epoll, EPOLL_CTL_DEL, p->m_sock->handle(), 0);
+	m_pending.remove(p,false);
+    }
+    m_mutex.lock();
+    m_count--;
+    m_mutex.unlock();
+    HTTPServerListener* lst = p->m_listener;
+#ifdef HAVE_OPENSSL
+    if (p->m_tls) {
+	if (ok) {
+	    lst->metrics()->add(p->m_tls->resumed() ? HTTPMetrics::TlsResumed : HTTPMetrics::TlsFull);
+	    if (p->m_tls->ktls())
+		lst->metrics()->add(HTTPMetrics::TlsKernel);
+	    lst->metrics()->time(HTTPMetrics::Handshake, Time::now() - p->m_start);
+	}
+	else
+	    lst->metrics()->add(HTTPMetrics::TlsFailed);
+    }
+#endif
+    if (ok) {
+	Socket* sock = p->m_sock;
+	p->m_sock = 0;
+	if (!lst->checkCreate(sock,p->m_addr,p->m_tls != 0,p->m_tls))
+	    Debug("HTTPServer",DebugWarn,"Connection rejected for %s",p->m_addr.addr().c_str());
+    }
+    p->release();
+    TelEngine::destruct(p);
+}
+
+// Drop clients that take too long to finish handshake
+void TLSHandshaker::expire(u_int32_t now)
+{
+    ObjList* l = m_pending.skipNull();
+    while (l) {
+	TLSPending* p = static_cast<TLSPending*>(l->get());
+	if (!p->m_deadline || now < p->m_deadline) {
+	    l = l->skipNext();
+	    continue;
+	}
+	Debug("HTTPServer",DebugInfo,"TLS handshake with %s timed out",p->m_addr.addr().c_str());
+	l->remove(false);
+	finish(p,false);
+	l = l->skipNull();
+    }
+}
+#endif
+
+#ifdef HAVE_OPENSSL
+/**
+ * TLSContext
+ */
+TLSContext::TLSContext(const NamedList& params)
+    : m_params(params),
+      m_ctx(0),
+      m_keyMutex(false, "TLSContext"),
+      m_rotate(0),
+      m_rotated(0)
+{
+    ::memset(m_keys, 0, sizeof(m_keys));
+}
+
+TLSContext::~TLSContext()
+{
+    if (m_ctx)
+	::SSL_CTX_free(m_ctx);
+    ::OPENSSL_cleanse(m_keys, sizeof(m_keys));
+}
 
-    // Send response
-    if(! sendResponse(*m_rsp))
+// Load certificate and key, set up session cache and ticket keys
+bool TLSContext::init()
+{
+    const String& cert = m_params["certificate"];
+    const String& key = m_params["key"];
+    m_ctx = ::SSL_CTX_new(::TLS_server_method());
+    if (!m_ctx) {
+	Debug("HTTPServer",DebugWarn,"Unable to create TLS context '%s'",m_params.c_str());
 	return false;
-    if(! m_keepalive) {
-	DDebug("HTTPServer",DebugInfo,"Closing non-keepalive Connection[%p], socket %d",this,m_socket->handle());
-	m_socket->shutdown(true, true);
+    }
+    ::SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+    long opts = SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_NO_RENEGOTIATION
+    opts |= SSL_OP_NO_RENEGOTIATION;
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // peers often close without close_notify, that is just end of stream
+    opts |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+#ifdef HAVE_KTLS
+    // hand record keys to kernel after handshake if it supports the cipher
+    if (m_params.getBoolValue("sslktls", true))
+	opts |= SSL_OP_ENABLE_KTLS;
+#endif
+    ::SSL_CTX_set_options(m_ctx, opts);
+    // send buffer may move and is written in pieces
+    ::SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+	SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    if (::SSL_CTX_use_certificate_chain_file(m_ctx, cert) != 1 ||
+	    ::SSL_CTX_use_PrivateKey_file(m_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+	    ::SSL_CTX_check_private_key(m_ctx) != 1) {
+	char buf[256];
+	::ERR_error_string_n(::ERR_get_error(), buf, sizeof(buf));
+	Alarm("HTTPServer","config",DebugWarn,"TLS context '%s' can't use '%s' and '%s': %s",
+	    m_params.c_str(),cert.c_str(),key.c_str(),buf);
 	return false;
     }
-
-    // Request complete
-    XDebug(DebugAll, "RequestComplete, refcounts: req: %d, rsp: %d", m_req ? m_req->refcount() : 0, m_rsp ? m_rsp->refcount() : 0);
-    m_req = NULL;
-    m_rsp = NULL;
+    SSL_CTX_set_app_data(m_ctx, this);
+    ::SSL_CTX_set_alpn_select_cb(m_ctx, selectAlpn, 0);
+    // sessions resume only in context that made them
+    ::SSL_CTX_set_session_id_context(m_ctx, (const unsigned char*)m_params.c_str(),
+	min(m_params.length(), (unsigned int)SSL_MAX_SID_CTX_LENGTH));
+    int sessions = m_params.getIntValue("sslsessions", 20480, 0);
+    ::SSL_CTX_set_session_cache_mode(m_ctx, sessions ? SSL_SESS_CACHE_SERVER : SSL_SESS_CACHE_OFF);
+    if (sessions)
+	::SSL_CTX_sess_set_cache_size(m_ctx, sessions);
+    ::SSL_CTX_set_timeout(m_ctx, m_params.getIntValue("sslsessiontimeout", 300, 1));
+    m_rotate = m_params.getIntValue("sslticketrotate", 3600, 0);
+    if (m_rotate) {
+	if (!(newKey(m_keys[0]) && newKey(m_keys[1])))
+	    return false;
+	m_rotated = Time::secNow();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	::SSL_CTX_set_tlsext_ticket_key_evp_cb(m_ctx, ticketKey);
+#else
+	::SSL_CTX_set_tlsext_ticket_key_cb(m_ctx, ticketKey);
+#endif
+    }
+    else
+	::SSL_CTX_set_options(m_ctx, SSL_OP_NO_TICKET);
+    Debug("HTTPServer",DebugInfo,"Loaded TLS context '%s' from '%s', %d sessions cached, ticket keys %s",
+	m_params.c_str(),cert.c_str(),sessions,
+	m_rotate ? String(m_rotate).append("s").c_str() : "off");
     return true;
 }
 
-bool Connection::readRequestBody(Message& msg)
+bool TLSContext::newKey(TicketKey& key)
 {
-    unsigned int cl = m_req->contentLength();
-    bool untilEof = !m_keepalive && cl == YHttpMessage::UnknownLength; // HTTP 0.x request
-    unsigned int maxBodyBuf = msg.getIntValue("maxreqbody", m_maxReqBody);
-    if(cl != YHttpMessage::UnknownLength && cl > maxBodyBuf) // request body is too long
-	return sendErrorResponse(413);
+    if (::RAND_bytes(key.name, sizeof(key.name)) == 1 &&
+	    ::RAND_bytes(key.aes, sizeof(key.aes)) == 1 &&
+	    ::RAND_bytes(key.hmac, sizeof(key.hmac)) == 1)
+	return true;
+    Debug("HTTPServer",DebugWarn,"No random data for TLS ticket key of '%s'",m_params.c_str());
+    return false;
+}
 
-    TelEngine::Stream* strm = m_req->bodyStream();
-    if (! strm) {
-	Debug("HTTPServer",DebugWarn,"Connection[%p]: no request body buffer (socket %d)",this,m_socket->handle());
-	return sendErrorResponse(500);
+// Server side of a new connection
+SSL* TLSContext::create(int fd, bool http2)
+{
+    SSL* ssl = ::SSL_new(m_ctx);
+    if (!ssl)
+	return 0;
+    if (::SSL_set_fd(ssl, fd) != 1) {
+	::SSL_free(ssl);
+	return 0;
+    }
+    ::SSL_set_accept_state(ssl);
+    // ALPN callback offers h2 only when set
+    SSL_set_app_data(ssl, http2 ? this : 0);
+    return ssl;
+}
+
+// Put a new ticket key in use once it's time, tickets made with the
+// previous one are still accepted and replaced
+void TLSContext::rotate(u_int32_t now)
+{
+    if (!m_rotate || now < m_rotated + m_rotate)
+	return;
+    TicketKey key;
+    if (!newKey(key))
+	return;
+    Lock mylock(m_keyMutex);
+    m_keys[1] = m_keys[0];
+    m_keys[0] = key;
+    m_rotated = now;
+    mylock.drop();
+    ::OPENSSL_cleanse(&key, sizeof(key));
+    DDebug("HTTPServer",DebugInfo,"Rotated ticket key of TLS context '%s'",m_params.c_str());
+}
+
+// Pick ticket key: current one to make tickets, the one named to open them
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int TLSContext::ticketKey(SSL* ssl, unsigned char* name, unsigned char* iv,
+    EVP_CIPHER_CTX* ectx, EVP_MAC_CTX* hctx, int enc)
+#else
+int TLSContext::ticketKey(SSL* ssl, unsigned char* name, unsigned char* iv,
+    EVP_CIPHER_CTX* ectx, HMAC_CTX* hctx, int enc)
+#endif
+{
+    TLSContext* ctx = static_cast<TLSContext*>(SSL_CTX_get_app_data(::SSL_get_SSL_CTX(ssl)));
+    if (!ctx)
+	return -1;
+    Lock mylock(ctx->m_keyMutex);
+    const TicketKey* key = &ctx->m_keys[0];
+    int ret = 1;
+    if (enc) {
+	if (::RAND_bytes(iv, ::EVP_CIPHER_iv_length(::EVP_aes_256_cbc())) != 1)
+	    return -1;
+	::memcpy(name, key->name, TLS_KEY_NAME);
     }
-    if (m_rcvBuffer.length()) { // body part that arrived with headers
-	XDebug("HTTPServer", DebugAll, "Connection[%p]: readRequestBody: got %u bytes of body together with with headers", this, m_rcvBuffer.length());
-	if(m_rcvBuffer.length() > maxBodyBuf)
-	    return sendErrorResponse(413);
-	strm->writeData(m_rcvBuffer);
+    else if (::memcmp(name, key->name, TLS_KEY_NAME)) {
+	key = &ctx->m_keys[1];
+	if (::memcmp(name, key->name, TLS_KEY_NAME))
+	    return 0;
+	// still good but client should get a ticket of current key
+	ret = 2;
     }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[2];
+    params[0] = ::OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0);
+    params[1] = ::OSSL_PARAM_construct_end();
+    if (::EVP_MAC_init(hctx, key->hmac, sizeof(key->hmac), params) != 1)
+	return -1;
+#else
+    if (::HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac), ::EVP_sha256(), 0) != 1)
+	return -1;
+#endif
+    int ok = enc ?
+	::EVP_EncryptInit_ex(ectx, ::EVP_aes_256_cbc(), 0, key->aes, iv) :
+	::EVP_DecryptInit_ex(ectx, ::EVP_aes_256_cbc(), 0, key->aes, iv);
+    return (ok == 1) ? ret : -1;
+}
 
-    char buf[BODY_BUF_SIZE];
+// Offer h2 ahead of http/1.1 unless listener has it disabled
+int TLSContext::selectAlpn(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+    const unsigned char* in, unsigned int inlen, void* arg)
+{
+    static const unsigned char s_h2[] = "\x02h2\x08http/1.1";
+    static const unsigned char s_h1[] = "\x08http/1.1";
+    bool h2 = (SSL_get_app_data(ssl) != 0);
+    unsigned char* sel = 0;
+    if (::SSL_select_next_proto(&sel, outlen, h2 ? s_h2 : s_h1,
+	    (h2 ? sizeof(s_h2) : sizeof(s_h1)) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+	return SSL_TLSEXT_ERR_NOACK;
+    *out = sel;
+    return SSL_TLSEXT_ERR_OK;
+}
 
-    u_int32_t killtime = Time::secNow() + m_timeout;
-    while(cl) {
-	int r = m_socket->readData(buf, min(cl, sizeof(buf)));
-	XDebug("HTTPServer", DebugAll, "Connection[%p]: readRequestBody: read %d bytes, left %d, untilEof=%s, maxBodyBuf=%u", this, r, cl, String::boolText(untilEof), maxBodyBuf);
-	if(r == 0 && untilEof)
-	    break;
-	if(r < 0 && m_socket->canRetry() && (!m_timeout || Time::secNow() < killtime)) {
-	    yield();
-	    continue;
-	}
-	if(r <= 0)
-	    return sendErrorResponse(400);
+// Context of a listener, an existing one if nothing changed. Certificate
+// and key file names are relative to configuration directory, their
+// modification times are kept so renewed files are loaded on reload
+TLSContext* TLSContext::get(const String& name, const NamedList& cfg)
+{
+    Configuration ossl(Engine::configFile("openssl"), false);
+    NamedList* sect = ossl.getSection(name);
+    if (!(sect && sect->getBoolValue("enable", true) && sect->getValue("certificate"))) {
+	Debug("HTTPServer",DebugMild,"No certificate of TLS context '%s' in openssl.conf",name.c_str());
+	return 0;
+    }
+    NamedList params(*sect);
+    params.copyParam(cfg, "sslsessions");
+    params.copyParam(cfg, "sslsessiontimeout");
+    params.copyParam(cfg, "sslticketrotate");
+    params.copyParam(cfg, "sslktls");
+    static const char* s_files[] = { "certificate", "key", 0 };
+    for (int i = 0; s_files[i]; i++) {
+	String file = params.getValue(s_files[i], params.getValue("certificate"));
+	if (!file.startsWith(Engine::pathSeparator()))
+	    file = Engine::configPath() + Engine::pathSeparator() + file;
+	unsigned int mtime = 0;
+	File::getFileTime(file, mtime);
+	params.setParam(s_files[i], file);
+	params.setParam(String(s_files[i]) + "_time", String(mtime));
+    }
+    Lock mylock(s_mutex);
+    for (ObjList* l = s_tlsContexts.skipNull(); l; l = l->skipNext()) {
+	TLSContext* ctx = static_cast<TLSContext*>(l->get());
+	if (ctx->params() == params && sameParams(ctx->params(), params))
+	    return ctx;
+    }
+    TLSContext* ctx = new TLSContext(params);
+    if (!ctx->init()) {
+	TelEngine::destruct(ctx);
+	return 0;
+    }
+    s_tlsContexts.append(ctx);
+    return ctx;
+}
 
-	if(strm->seek(TelEngine::Stream::SeekCurrent) + r > maxBodyBuf)
-	    return sendErrorResponse(413);
-	strm->writeData(buf, r);
-	if(cl != YHttpMessage::UnknownLength)
-	    cl -= r;
+void TLSContext::rotateAll(u_int32_t now)
+{
+    Lock mylock(s_mutex);
+    for (ObjList* l = s_tlsContexts.skipNull(); l; l = l->skipNext())
+	static_cast<TLSContext*>(l->get())->rotate(now);
+}
+
+// Forget contexts no listener uses any more
+void TLSContext::prune()
+{
+    Lock mylock(s_mutex);
+    ObjList* l = s_tlsContexts.skipNull();
+    while (l) {
+	if (static_cast<TLSContext*>(l->get())->refcount() == 1) {
+	    l->remove();
+	    l = l->skipNull();
+	}
+	else
+	    l = l->skipNext();
     }
-    strm->terminate();
-    return true;
 }
 
-bool Connection::sendData(unsigned int length, unsigned int offset /* = 0 */)
+/**
+ * TLSSocket
+ */
+TLSSocket::TLSSocket(SOCKET handle, SSL* ssl)
+    : Socket(handle),
+      m_ssl(ssl),
+      m_wantWrite(false)
 {
-    unsigned char * pos = m_sndBuffer.data(offset);
-    u_int32_t killtime = Time::secNow() + m_timeout;
-    while (m_socket && m_socket->valid()) {
-	Thread::check();
-	bool writeok = false;
-	bool error = false;
-	if (m_socket->select(0, &writeok, &error, 10000)) {
-	    if (error) {
-		Debug("HTTPServer",DebugInfo,"Socket exception condition on %d",m_socket->handle());
-		/* Can happen when client shuts down it's socket's sending part */
-		return false; // XXX
-	    }
-	    if (!writeok) {
-		if(!m_timeout || Time::secNow() < killtime) {
-		    yield();
-		    continue;
-		}
-		Debug("HTTPServer",DebugAll, "Timeout waiting for socket %d", m_socket->handle());
-		return false;
-	    }
+}
 
-	    unsigned int written = (unsigned int)m_socket->writeData(pos, length);
-	    if (!m_socket->canRetry()) {
-		Debug("HTTPServer",DebugWarn,"Socket write error %d on %d",errno,m_socket->handle());
-		return false;
-	    }
+TLSSocket::~TLSSocket()
+{
+    terminate();
+}
 
-	    if (written) {
-		length -= written;
-		pos += written;
-		if (0 == length)
-		    return true;
-		killtime = Time::secNow() + m_timeout;
-	    }
-	}
-	else if (!m_socket->canRetry()) {
-	    Debug("HTTPServer",DebugWarn,"socket select error %d on %d",errno,m_socket->handle());
-	    return false;
-	}
+bool TLSSocket::terminate()
+{
+    if (m_ssl) {
+	// tell peer we are done, don't wait for it's answer
+	if (::SSL_is_init_finished(m_ssl))
+	    ::SSL_shutdown(m_ssl);
+	::SSL_free(m_ssl);
+	m_ssl = 0;
+    }
+    return Socket::terminate();
+}
+
+int TLSSocket::writeData(const void* buffer, int length)
+{
+    if (!m_ssl)
+	return -1;
+    ::ERR_clear_error();
+    errno = 0;
+    int n = ::SSL_write(m_ssl, buffer, length);
+    if (n > 0) {
+	clearError();
+	return n;
     }
+    return result(n, true);
+}
+
+int TLSSocket::readData(void* buffer, int length)
+{
+    if (!m_ssl)
+	return -1;
+    ::ERR_clear_error();
+    errno = 0;
+    int n = ::SSL_read(m_ssl, buffer, length);
+    if (n > 0) {
+	clearError();
+	return n;
+    }
+    return result(n, false);
+}
+
+bool TLSSocket::ktls() const
+{
+#ifdef HAVE_KTLS
+    return m_ssl && BIO_get_ktls_send(::SSL_get_wbio(m_ssl));
+#else
     return false;
+#endif
 }
 
-bool Connection::sendResponse(YHttpResponse& rsp)
+int TLSSocket::sendFile(int fd, int64_t& offset, unsigned int length)
 {
-    unsigned int to_send = rsp.contentLength();
-    bool chunked = to_send == YHttpMessage::UnknownLength;
+#ifdef HAVE_KTLS
+    if (!m_ssl)
+	return -1;
+    ::ERR_clear_error();
+    errno = 0;
+    ossl_ssize_t n = ::SSL_sendfile(m_ssl, fd, offset, length, 0);
+    if (n > 0) {
+	clearError();
+	offset += n;
+	return n;
+    }
+    return result(n, true);
+#else
+    m_error = ENOSYS;
+    return -1;
+#endif
+}
 
-    if (chunked)
-	rsp.addHeader("Transfer-Encoding", "chunked");
+int TLSSocket::handshake()
+{
+    ::ERR_clear_error();
+    errno = 0;
+    int res = ::SSL_accept(m_ssl);
+    if (res == 1)
+	return 1;
+    if (result(res, false) < 0 && canRetry())
+	return 0;
+    char buf[256];
+    unsigned long err = ::ERR_peek_last_error();
+    if (err)
+	::ERR_error_string_n(err, buf, sizeof(buf));
     else
-	rsp.addHeader("Content-Length", TelEngine::String(to_send));
-    if (! rsp.build(m_sndBuffer))
-	return false;
-    XDebug("HTTPServer",DebugInfo,"Connection[%p]::sendResponse(): chunked: %s, to_send: %u, stream: %p", this, String::boolText(chunked), to_send, rsp.bodyStream());
+	::strcpy(buf, "connection closed");
+    Debug("HTTPServer",DebugInfo,"TLS handshake on socket %d failed: %s",handle(),buf);
+    return -1;
+}
 
-    if (! sendData(m_sndBuffer.length()))
-	return false;
-    m_sndBuffer.clear();
-
-    if(rsp.bodyStream()) {
-	m_sndBuffer.resize(m_maxSendChunkSize + 8); // 4 hex digits + crlf + data + crlf
-	unsigned char * read_ptr = m_sndBuffer.data(6);
-	for (;;) {
-	    unsigned int to_read = m_maxSendChunkSize;
-	    if (! chunked && to_send < m_maxSendChunkSize)
-		to_read = to_send;
-	    int rd = rsp.bodyStream()->readData(read_ptr, to_read);
-	    XDebug("HTTPServer",DebugInfo,"Connection[%p]::sendResponse(): got %d from rsp.bodyStream()->readData(%p, %d)", this, rd, read_ptr, to_read);
-	    if (! rd) {
-		if (! chunked) {
-		    Debug("HTTPServer",DebugInfo,"Connection[%p]::sendResponse: Socket %d: got EOF, while %u bytes more expected",this,m_socket->handle(),to_send);
-		    return false;
-		}
-		XDebug("HTTPServer",DebugInfo,"Connection[%p]::sendResponse(): got EOF", this);
-		break;
-	    }
-	    if (chunked) {
-		snprintf((char*)m_sndBuffer.data(), 6, "%04x", rd);
-		*m_sndBuffer.data(4) = '\r';
-		*m_sndBuffer.data(5) = '\n';
-		read_ptr[rd] = '\r';
-		read_ptr[rd + 1] = '\n';
-	    }
-	    if (chunked) {
-		if (! sendData(rd + 8))
-		    return false;
-		XDebug("HTTPServer",DebugInfo,"Connection[%p]::sendResponse(): sent chunk %u bytes", this, rd);
-	    }
-	    else {
-		if (! sendData(rd, 6))
-		    return false;
-		to_send -= rd;
-		XDebug("HTTPServer",DebugInfo,"Connection[%p]::sendResponse(): sent chunk %u bytes, %u bytes left", this, rd, to_send);
-		if (! to_send)
-		    break;
+// Turn OpenSSL failure into socket error, 0 at end of stream
+int TLSSocket::result(int ret, bool write)
+{
+    int err = ::SSL_get_error(m_ssl, ret);
+    m_wantWrite = (err == SSL_ERROR_WANT_WRITE);
+    switch (err) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	    m_error = EAGAIN;
+	    return -1;
+	case SSL_ERROR_ZERO_RETURN:
+	    break;
+	case SSL_ERROR_SYSCALL:
+	    if (ret < 0 && errno) {
+		m_error = errno;
+		return -1;
 	    }
+	    break;
+	default:
+	    m_error = EPROTO;
+	    return -1;
 	}
-	if (chunked) {
-	    XDebug("HTTPServer",DebugInfo,"Connection[%p]::sendResponse(): sending empty chunk and empty trailer", this);
-	    m_socket->writeData("0\r\n\r\n", 5);
-	}
-	else {
-	    XDebug("HTTPServer",DebugInfo,"Connection[%p]::sendResponse(): done sending message", this);
-	}
+    // peer closed it's side, nothing can be written any more
+    if (write) {
+	m_error = EPIPE;
+	return -1;
     }
-    return true;
+    clearError();
+    return 0;
 }
+#endif
 
-bool Connection::sendErrorResponse(int code)
+/**
+ * HTTPWorkers
+ */
+static const TokenDict s_overflowPolicy[] = {
+    { "queue", HTTPWorkers::Queue },
+    { "503",   HTTPWorkers::Reject },
+    { "close", HTTPWorkers::Drop },
+    { 0, 0 }
+};
+
+HTTPWorkers::HTTPWorkers(const NamedList& cfg)
+    : m_mutex(false, "HTTPWorkers"),
+      m_sem(65536, "HTTPWorkers", 0),
+      m_queued(0),
+      m_maxQueue(cfg.getIntValue("maxqueue",256,1)),
+      m_overflow(cfg.getIntValue("overflow",s_overflowPolicy,Reject)),
+      m_threads(0),
+      m_jobs(0),
+      m_overflows(0),
+      m_waitUsec(0),
+      m_runUsec(0),
+      m_maxWait(0),
+      m_users(0),
+      m_stopped(false)
 {
-    YHttpResponse e(this);
-    e.setHeader("Connection", "close");
-    e.status(code);
-    appendMissingErrorResponseBody(e);
-    sendResponse(e);
-    return false;
 }
 
-void Connection::connectionHeader(const char* hdr)
+// Start worker threads, return how many are running
+unsigned int HTTPWorkers::start(unsigned int threads)
 {
-    m_connection = 0;
-    ObjList* conntokens = String(m_req->getHeader("Connection")).split(',', false);
-    for (ObjList* tok = conntokens->skipNull(); tok; tok = tok->skipNext()) {
-	String key = tok->get()->toString();
-	m_connection |= lookup(key.trimSpaces().toLower(), s_connTokens);
+    for (unsigned int i = 0; i < threads; i++) {
+	HTTPWorker* t = new HTTPWorker(this);
+	if (!t->startup()) {
+	    delete t;
+	    break;
+	}
+	m_threads++;
     }
-    TelEngine::destruct(conntokens);
+    return m_threads;
 }
 
-String Connection::connectionHeader()
+// Queue a connection for a worker, return overflow policy if queue is full
+int HTTPWorkers::enqueue(Connection* conn)
 {
-    String r;
-    int flags = m_connection;
-    for(int fl = 1; flags; fl <<= 1) {
-	if(flags & fl) {
-	    if(r.length())
-		r << ",";
-	    r << lookup(fl, s_connTokens);
+    Lock mylock(m_mutex);
+    if (m_queued >= m_maxQueue) {
+	m_overflows++;
+	if (m_overflow != Queue) {
+	    Debug("HTTPServer",DebugMild,"Worker queue full (%u), %s socket %d",
+		m_queued,lookup(m_overflow,s_overflowPolicy),conn->socket()->handle());
+	    return m_overflow;
 	}
-	flags &= ~fl;
     }
-    return r;
+    if (!conn->ref())
+	return Drop;
+    m_queue.append(conn);
+    m_queued++;
+    mylock.drop();
+    m_sem.unlock();
+    return Queue;
 }
 
-void Connection::appendMissingErrorResponseBody(YHttpResponse& rsp)
+// Take next queued connection, waiting at most maxwait microseconds
+Connection* HTTPWorkers::dequeue(long maxwait)
 {
-    int status = rsp.status();
-    if (status < 200 || status >= 600)
+    for (int i = 0; i < 2; i++) {
+	m_mutex.lock();
+	Connection* conn = static_cast<Connection*>(m_queue.remove(false));
+	if (conn)
+	    m_queued--;
+	m_mutex.unlock();
+	if (conn)
+	    return conn;
+	if (i || !m_sem.lock(maxwait))
+	    break;
+    }
+    return 0;
+}
+
+void HTTPWorkers::attach()
+{
+    Lock mylock(m_mutex);
+    m_users++;
+}
+
+void HTTPWorkers::detach()
+{
+    Lock mylock(m_mutex);
+    if (--m_users)
 	return;
-    String b(status);
-    b << " " << rsp.statusText() << "\r\n";
-    rsp.setBody(b);
-    rsp.addHeader("Content-Type", "text/plain");
+    m_stopped = true;
+    mylock.drop();
+    for (unsigned int i = 0; i < m_threads; i++)
+	m_sem.unlock();
+}
+
+// Account time spent in queue and running handlers
+void HTTPWorkers::done(u_int64_t wait, u_int64_t run)
+{
+    Lock mylock(m_mutex);
+    m_jobs++;
+    m_waitUsec += wait;
+    m_runUsec += run;
+    if (m_maxWait < wait)
+	m_maxWait = wait;
+}
+
+void HTTPWorkers::status(String& str)
+{
+    Lock mylock(m_mutex);
+    str << "threads=" << m_threads << ",queued=" << m_queued;
+    str << ",jobs=" << m_jobs << ",overflows=" << m_overflows;
+    str << ",avgwait=" << (m_jobs ? m_waitUsec / m_jobs : 0);
+    str << ",avgrun=" << (m_jobs ? m_runUsec / m_jobs : 0);
+    str << ",maxwait=" << m_maxWait;
+}
+
+void HTTPWorker::run()
+{
+    for (;;) {
+	Thread::check();
+	Connection* conn = m_pool->dequeue(REACTOR_WAIT_MS * 1000);
+	if (!conn) {
+	    if (m_pool->stopped())
+		break;
+	    continue;
+	}
+	u_int64_t start = Time::now();
+	conn->runJob();
+	u_int64_t stop = Time::now();
+	m_pool->done(start - conn->queued(), stop - start);
+	XDebug("HTTPServer",DebugAll,"Worker ran job for socket %d in " FMT64U " usec after " FMT64U " usec in queue",
+	    conn->socket()->handle(),stop - start,start - conn->queued());
+	conn->wakeDriver();
+	conn->deref();
+    }
 }
 
 /**
  * HTTPServer
  */
 HTTPServer::HTTPServer()
-    : Plugin("httpserver"),
+    : Module("httpserver","misc"),
       m_first(true)
 {
     Output("Loaded module HTTPServer");
@@ -1159,7 +7733,11 @@ HTTPServer::~HTTPServer()
 {
     Output("Unloading module HTTPServer");
     s_connList.clear();
+    s_draining.clear();
     s_listeners.clear();
+#ifdef HAVE_OPENSSL
+    s_tlsContexts.clear();
+#endif
 }
 
 bool HTTPServer::isBusy() const
@@ -1168,29 +7746,247 @@ bool HTTPServer::isBusy() const
     return (s_connList.count() != 0);
 }
 
+// Running listener of a section shard, NULL if there is none
+static HTTPServerListener* findListener(const ObjList& list, const String& name, unsigned int shard)
+{
+    for (ObjList* l = list.skipNull(); l; l = l->skipNext()) {
+	HTTPServerListener* lst = static_cast<HTTPServerListener*>(l->get());
+	if (lst->cfg() == name && lst->shard() == shard)
+	    return lst;
+    }
+    return 0;
+}
+
+// Check if all shards of a section run with it's current parameters
+// If so take them out of list so they go on as they are
+static bool keepListeners(ObjList& list, const NamedList& sect, unsigned int shards)
+{
+    unsigned int n = 0;
+    for (ObjList* l = list.skipNull(); l; l = l->skipNext()) {
+	HTTPServerListener* lst = static_cast<HTTPServerListener*>(l->get());
+	if (lst->cfg() != sect)
+	    continue;
+	if (lst->shards() != shards || !sameParams(lst->cfg(),sect))
+	    return false;
+	n++;
+    }
+    if (n != shards)
+	return false;
+    ObjList* l = list.skipNull();
+    while (l) {
+	if (static_cast<HTTPServerListener*>(l->get())->cfg() == sect) {
+	    l->remove();
+	    l = l->skipNull();
+	}
+	else
+	    l = l->skipNext();
+    }
+    return true;
+}
+
+// Called at startup and on every reload. Listeners of changed sections are
+// replaced, taking over their sockets, and old ones drain their connections
 void HTTPServer::initialize()
 {
+    Output("Initializing module HTTPServer");
+    Configuration cfg;
+    cfg = Engine::configFile("httpserver");
+    cfg.load();
     if (m_first) {
-	Output("Initializing module HTTPServer");
-	Configuration cfg;
-	cfg = Engine::configFile("httpserver");
-	cfg.load();
-	for (unsigned int i = 0; i < cfg.sections(); i++) {
-	    NamedList* s = cfg.getSection(i);
-	    String name = s ? s->c_str() : "";
-	    if (! name.startSkip("listener ",false))
-		continue;
-	    name.trimBlanks();
-	    s->String::operator=(name);
-	    (new HTTPServerListener(*s))->init();
+	initStatusLines();
+#ifdef HAVE_EPOLL
+	HTTPReactor::start(cfg.getIntValue("general","reactors",2,0,64));
+	TLSHandshaker::start(cfg.getIntValue("general","handshakes",2,1,64));
+#endif
+    }
+    s_maxConns = cfg.getIntValue("general","maxconns",0,0);
+    s_shedCongestion = cfg.getBoolValue("general","congestion",true);
+    s_maxMessages = cfg.getIntValue("general","maxmessages",0,0);
+    s_maxHandshakes = cfg.getIntValue("general","maxhandshakes",1024,0);
+    unsigned int retry = cfg.getIntValue("general","retryafter",5,1);
+    if (s_busyResponse.null() || retry != s_retryAfter) {
+	// listeners keep refusing connections while we reload
+	String busy;
+	busy << "HTTP/1.1 503 Service Unavailable\r\nRetry-After: " << retry <<
+	    "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	Lock lck(s_mutex);
+	s_retryAfter = retry;
+	s_busyResponse = busy;
+    }
+    // listeners left here once sections are gone through are stopped
+    ObjList running;
+    s_mutex.lock();
+    for (ObjList* l = s_listeners.skipNull(); l; l = l->skipNext()) {
+	HTTPServerListener* lst = static_cast<HTTPServerListener*>(l->get());
+	if (lst->ref())
+	    running.append(lst);
+    }
+    s_mutex.unlock();
+    for (unsigned int i = 0; i < cfg.sections(); i++) {
+	NamedList* s = cfg.getSection(i);
+	String name = s ? s->c_str() : "";
+	if (! name.startSkip("listener ",false))
+	    continue;
+	name.trimBlanks();
+	s->String::operator=(name);
+	unsigned int shards = s->getIntValue("shards",1,0,64);
+	if (!shards)
+	    shards = cpuCount();
+	if (keepListeners(running,*s,shards))
+	    continue;
+	RefPointer<HTTPWorkers> workers;
+	// counters go on across reloads
+	HTTPServerListener* prev = findListener(running,name,0);
+	RefPointer<HTTPMetrics> metrics = prev ? prev->metrics() : 0;
+	if (!metrics) {
+	    metrics = new HTTPMetrics(name);
+	    metrics->deref();
 	}
-	Lock mylock(s_mutex);
-	// don't bother to install handlers until we are listening
-	if (s_listeners.count()) {
-	    m_first = false;
-//	    Engine::self()->setHook(new RHook);
+	for (unsigned int n = 0; n < shards; n++) {
+	    prev = findListener(running,name,n);
+	    // replaced listener goes on if the new one can't start
+	    if (!(new HTTPServerListener(*s,metrics,n,shards))->init(workers,prev) && prev)
+		running.remove(prev);
 	}
     }
+    for (ObjList* l = running.skipNull(); l; l = l->skipNext())
+	static_cast<HTTPServerListener*>(l->get())->stop();
+#ifdef HAVE_OPENSSL
+    TLSContext::prune();
+#endif
+    Lock mylock(s_mutex);
+    // don't bother to install handlers until we are listening
+    if (m_first && s_listeners.count()) {
+	m_first = false;
+	setup();
+	installRelay(Register, "http.register", 100);
+	installRelay(Complete, "http.complete", 100);
+//	Engine::self()->setHook(new RHook);
+    }
+}
+
+bool HTTPServer::received(Message& msg, int id)
+{
+    if (id == Register)
+	return s_routes.received(msg);
+    if (id == Complete) {
+	// deferred response given by message, token parameter tells which
+	DeferredResponse* resp = DeferredResponse::find(msg["token"]);
+	if (!resp)
+	    return false;
+	bool ok = resp->complete(msg);
+	resp->deref();
+	return ok;
+    }
+    return Module::received(msg,id);
+}
+
+void HTTPServer::msgTimer(Message& msg)
+{
+    Module::msgTimer(msg);
+    u_int32_t now = Time::secNow();
+    s_timers.tick(now);
+    HTTPServerListener::drain(now);
+#ifdef HAVE_OPENSSL
+    TLSContext::rotateAll(now);
+#endif
+    DeferredResponse::expire(now);
+}
+
+// Metrics of running listeners, once for all shards of a section
+void HTTPServer::metrics(ObjList& list)
+{
+    Lock mylock(s_mutex);
+    for (ObjList* l = s_listeners.skipNull(); l; l = l->skipNext()) {
+	HTTPMetrics* m = static_cast<HTTPServerListener*>(l->get())->metrics();
+	if (m && !list.find(m) && m->ref())
+	    list.append(m);
+    }
+}
+
+void HTTPServer::statusModule(String& str)
+{
+    Module::statusModule(str);
+    str.append("format=Active|Accepted|Requests|Reused|1xx|2xx|3xx|4xx|5xx|BytesIn|BytesOut|Rejected",",");
+}
+
+void HTTPServer::statusParams(String& str)
+{
+    Lock mylock(s_mutex);
+    str.append("listeners=",",") << s_listeners.count() << ",connections=" << s_connCount <<
+	",draining=" << s_draining.count() << ",routes=" << s_routes.count() <<
+	",deferred=" << DeferredResponse::count();
+#ifdef HAVE_EPOLL
+    str << ",handshakes=" << TLSHandshaker::pending();
+#endif
+    s_timers.status(str);
+}
+
+void HTTPServer::statusDetail(String& str)
+{
+    ObjList list;
+    metrics(list);
+    for (ObjList* l = list.skipNull(); l; l = l->skipNext()) {
+	HTTPMetrics* m = static_cast<HTTPMetrics*>(l->get());
+	str.append(m->name(),",") << "=";
+	m->status(str);
+    }
+}
+
+// "httpserver metrics [listener]", "httpserver reset [listener]" and
+// "httpserver routes"
+bool HTTPServer::commandExecute(String& retVal, const String& line)
+{
+    String l = line;
+    if (!l.startSkip(name()))
+	return Module::commandExecute(retVal,line);
+    if (l == YSTRING("routes")) {
+	s_routes.list(retVal);
+	return true;
+    }
+    bool reset = l.startSkip("reset");
+    if (!(reset || l.startSkip("metrics")))
+	return false;
+    l.trimBlanks();
+    ObjList list;
+    metrics(list);
+    bool found = false;
+    for (ObjList* o = list.skipNull(); o; o = o->skipNext()) {
+	HTTPMetrics* m = static_cast<HTTPMetrics*>(o->get());
+	if (l && l != m->name())
+	    continue;
+	found = true;
+	if (reset)
+	    m->reset();
+	else
+	    m->dump(retVal);
+    }
+    if (!found)
+	retVal << "No listener " << l << "\r\n";
+    else if (reset)
+	retVal << "Metrics reset\r\n";
+    return true;
+}
+
+bool HTTPServer::commandComplete(Message& msg, const String& partLine, const String& partWord)
+{
+    if (partLine.null() && itemComplete(msg.retValue(),name(),partWord))
+	return false;
+    if (partLine == name()) {
+	itemComplete(msg.retValue(),"metrics",partWord);
+	itemComplete(msg.retValue(),"reset",partWord);
+	itemComplete(msg.retValue(),"routes",partWord);
+	return true;
+    }
+    String l = partLine;
+    if (l.startSkip(name()) && (l == YSTRING("metrics") || l == YSTRING("reset"))) {
+	ObjList list;
+	metrics(list);
+	for (ObjList* o = list.skipNull(); o; o = o->skipNext())
+	    itemComplete(msg.retValue(),static_cast<HTTPMetrics*>(o->get())->name(),partWord);
+	return true;
+    }
+    return Module::commandComplete(msg,partLine,partWord);
 }
 
 INIT_PLUGIN(HTTPServer);
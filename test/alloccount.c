@@ -0,0 +1,85 @@
+/**
+ * alloccount.c
+ *
+ * Counting allocator for httpserver benchmarks, preloaded into Yate:
+ *   make test/alloccount.so
+ *   LD_PRELOAD=./test/alloccount.so yate ...
+ * Every malloc() family call of the process is counted except those made
+ * by threads that asked to be left out, like benchhttp's client threads.
+ * benchhttp finds the counter at run time and then also reports
+ * allocations per request.
+ *
+ * MIT License http://opensource.org/licenses/MIT
+ */
+
+#include <stddef.h>
+#include <errno.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t align, size_t size);
+
+static unsigned long s_count = 0;
+static __thread int s_ignore = 0;
+
+static inline void count(void)
+{
+    if (!s_ignore)
+	__sync_fetch_and_add(&s_count, 1);
+}
+
+/* Allocations made so far by threads that are counted */
+unsigned long httpbenchAllocs(void)
+{
+    return __sync_fetch_and_add(&s_count, 0);
+}
+
+/* Leave calling thread's allocations out of count or count them again */
+void httpbenchAllocIgnore(int ignore)
+{
+    s_ignore = ignore;
+}
+
+void* malloc(size_t size)
+{
+    count();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    count();
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    count();
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t align, size_t size)
+{
+    count();
+    return __libc_memalign(align, size);
+}
+
+int posix_memalign(void** ptr, size_t align, size_t size)
+{
+    void* p;
+    count();
+    p = __libc_memalign(align, size);
+    if (!p)
+	return ENOMEM;
+    *ptr = p;
+    return 0;
+}
+
+void* aligned_alloc(size_t align, size_t size)
+{
+    count();
+    return __libc_memalign(align, size);
+}
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
@@ -0,0 +1,664 @@
+/**
+ * benchhttp.cpp
+ *
+ * Load generator for httpserver module benchmarks.
+ * Run from rmanager:
+ *   httpbench ADDR:PORT [conns=N] [requests=N] [uri=/path]
+ *   httpbench parse [count=N] [step=N]
+ *   httpbench route ADDR:PORT [conns=N] [requests=N]
+ * Compare listeners using different backends on loopback by running the
+ * same command against each of them.
+ * CPU time is that of whole Yate process, so bytes per CPU second compare
+ * server implementations when it runs in the same engine as httpserver.
+ * With test/alloccount.so preloaded allocations per request made outside
+ * client threads are reported too.
+ * The parse variant first checks that old way and httpserver's incremental
+ * parser read a small corpus of heads alike, then times both, optionally
+ * with head arriving in pieces of step bytes.
+ * The route variant loads /bench/message, served by http.route and
+ * http.serve handlers of this module, then /bench/direct, served by it's
+ * handler registered in httpserver's route table, and prints both results.
+ *
+ * MIT License http://opensource.org/licenses/MIT
+ */
+
+#include <yatephone.h>
+#include <yatemime.h>
+#include "../httpparser.h"
+#include "../httphandler.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifndef _WINDOWS
+#include <sys/resource.h>
+#include <dlfcn.h>
+#endif
+
+using namespace TelEngine;
+
+namespace { // anonymous
+
+class BenchRun;
+
+class BenchModule : public Module
+{
+public:
+    enum {
+	HttpRoute = Private,
+	HttpServe = (Private << 1),
+	EngineStart = (Private << 2),
+    };
+    BenchModule();
+    virtual ~BenchModule();
+    virtual void initialize();
+    virtual bool received(Message& msg, int id);
+protected:
+    virtual bool commandExecute(String& retVal, const String& line);
+    virtual bool commandComplete(Message& msg, const String& partLine, const String& partWord);
+};
+
+// One benchmark run shared by all it's client threads
+class BenchRun : public RefObject, public Mutex
+{
+public:
+    BenchRun(const NamedList& params);
+    bool start();
+    void done(unsigned int requests, unsigned int errors, u_int64_t bytes,
+	u_int64_t latency, u_int64_t maxLatency);
+    // run to start when this one is done
+    inline void next(BenchRun* run)
+	{ m_next = run; }
+    inline const SocketAddr& addr() const
+	{ return m_addr; }
+    inline const String& request() const
+	{ return m_request; }
+    inline unsigned int requests() const
+	{ return m_requests; }
+private:
+    SocketAddr m_addr;
+    String m_uri;
+    String m_request;
+    unsigned int m_conns;
+    unsigned int m_requests;
+    unsigned int m_running;
+    unsigned int m_done;
+    unsigned int m_errors;
+    u_int64_t m_bytes;
+    u_int64_t m_latency;
+    u_int64_t m_maxLatency;
+    u_int64_t m_start;
+    u_int64_t m_cpu;
+    unsigned long m_allocs;
+    RefPointer<BenchRun> m_next;
+};
+
+// Keep-alive client sending requests one after another
+class BenchThread : public Thread
+{
+public:
+    inline BenchThread(BenchRun* run)
+	: Thread("HTTP bench"), m_run(run)
+	{ }
+    virtual void run();
+private:
+    int readResponse(Socket& sock, DataBlock& buf);
+    RefPointer<BenchRun> m_run;
+};
+
+// Serves /bench/direct, called by httpserver without any message
+class BenchHandler : public HttpHandler
+{
+public:
+    virtual int serve(HttpExchange& xchg);
+};
+
+static BenchModule plugin;
+static BenchHandler* s_handler = 0;
+
+// Same small body on both paths
+static const String s_body = "Hello from httpbench\n";
+
+// Head of a typical browser request
+static const char s_sampleHead[] =
+    "GET /static/js/app.min.js?v=20160412 HTTP/1.1\r\n"
+    "Host: pbx.example.com:2080\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/50.0 Safari/537.36\r\n"
+    "Referer: http://pbx.example.com:2080/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, sdch\r\n"
+    "Accept-Language: en-US,en;q=0.8,ro;q=0.6\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+    "If-None-Match: \"5a1b-52f3d0c8\"\r\n"
+    "If-Modified-Since: Tue, 12 Apr 2016 10:20:30 GMT\r\n"
+    "DNT: 1\r\n"
+    "\r\n";
+static const unsigned int s_sampleHeaders = 12;
+
+// Heads both parsers must read alike: methods, versions, blanks, folded
+// and repeated fields, bare LF line ends
+static const char* const s_corpus[] = {
+    s_sampleHead,
+    "GET / HTTP/1.0\r\n\r\n",
+    "post /api/v1/items?id=5&x=%20y HTTP/1.1\r\nHost: a\r\nContent-Length: 12\r\n\r\n",
+    "OPTIONS * HTTP/1.1\r\nHost:nospace\r\nX-Empty:\r\nX-Blanks:   padded value \t \r\n\r\n",
+    "GET /fold HTTP/1.1\r\nX-Folded: first\r\n  second\r\n\tthird\r\nHost: b\r\n\r\n",
+    "GET /repeat HTTP/1.1\r\nAccept: a\r\nAccept: b\r\naccept: c\r\n\r\n",
+    "GET /lf HTTP/1.1\nHost: c\nUser-Agent: curl/7.47.0\n\n",
+    "PUT /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\nExpect: 100-continue\r\n\r\n",
+    0
+};
+
+// Find an empty line in a buffer, as httpserver did on every read
+// Return the position past it or buffer length + 1 if not found
+static unsigned int getEmptyLine(const char* buf, unsigned int len)
+{
+    int count = 0;
+    unsigned int i = 0;
+    for (; count < 2 && i < len; i++) {
+	if (buf[i] == '\r') {
+	    i++;
+	    if (i < len && buf[i] == '\n')
+		count++;
+	    else
+		count = 0;
+	}
+	else if (buf[i] == '\n')
+	    count++;
+	else
+	    count = 0;
+    }
+    return (count == 2) ? i : len + 1;
+}
+
+// Request head parsing httpserver used before incremental parser
+static bool legacyParse(const char* buf, int len, NamedList& hdrs)
+{
+    static const Regexp r("^\\([[:alpha:]]\\+\\)[[:space:]]\\+\\([^[:space:]]\\+\\)[[:space:]]\\+[Hh][Tt][Tt][Pp]/\\([0-9]\\.[0-9]\\+\\)$");
+    String* line = MimeBody::getUnfoldedLine(buf, len);
+    bool ok = line->matches(r);
+    if (ok) {
+	hdrs.setParam("method", line->matchString(1).toUpper());
+	hdrs.setParam("uri", line->matchString(2));
+	hdrs.setParam("version", line->matchString(3).toUpper());
+    }
+    line->destruct();
+    while (ok && len > 0) {
+	line = MimeBody::getUnfoldedLine(buf, len);
+	if (line->null()) {
+	    line->destruct();
+	    break;
+	}
+	int col = line->find(':');
+	if (col <= 0) {
+	    line->destruct();
+	    return false;
+	}
+	String name = line->substr(0, col);
+	name.trimBlanks();
+	*line >> ":";
+	line->trimBlanks();
+	hdrs.addParam(name, *line);
+	line->destruct();
+    }
+    return ok;
+}
+
+// Incremental parsing and building of header list as httpserver does now
+static bool newParse(HttpHeadParser& head, const char* buf, NamedList& hdrs)
+{
+    const HttpField& l = head.requestLine();
+    String method(buf + l.nameOffs, l.nameLen);
+    hdrs.setParam("method", method.toUpper());
+    hdrs.setParam("uri", String(buf + l.valueOffs, l.valueLen));
+    hdrs.setParam("version", String(buf + head.versionOffs() + 5, head.versionLen() - 5));
+    for (unsigned int i = 0; i < head.count(); i++) {
+	const HttpField& f = head.header(i);
+	String value;
+	HttpHeadParser::value(value, buf, f.valueOffs, f.valueLen);
+	hdrs.addParam(String(buf + f.nameOffs, f.nameLen), value);
+    }
+    return true;
+}
+
+// Values are the same when they differ only in length of blank runs,
+// legacy parser keeps blanks of folded lines while new one makes a space
+static bool sameValue(const String& v1, const String& v2)
+{
+    const char* a = v1.safe();
+    const char* b = v2.safe();
+    for (;;) {
+	bool ba = (*a == ' ' || *a == '\t');
+	bool bb = (*b == ' ' || *b == '\t');
+	if (ba != bb)
+	    return false;
+	if (ba) {
+	    while (*a == ' ' || *a == '\t')
+		a++;
+	    while (*b == ' ' || *b == '\t')
+		b++;
+	    continue;
+	}
+	if (*a != *b)
+	    return false;
+	if (!*a)
+	    return true;
+	a++;
+	b++;
+    }
+}
+
+// Run both parsers on every corpus head and compare request line and
+// header list, return number of heads read differently
+static unsigned int compareParsers(String& retVal)
+{
+    unsigned int diffs = 0;
+    HttpHeadParser head;
+    for (const char* const* c = s_corpus; *c; c++) {
+	const char* buf = *c;
+	unsigned int len = ::strlen(buf);
+	NamedList h1("");
+	NamedList h2("");
+	unsigned int end = getEmptyLine(buf, len);
+	bool ok1 = end <= len && legacyParse(buf, end, h1);
+	head.reset();
+	bool ok2 = head.parse(buf, len) == HttpHeadParser::Complete && newParse(head, buf, h2);
+	bool same = (ok1 == ok2) && h1.length() == h2.length();
+	for (unsigned int i = 0; same && i < h1.length(); i++) {
+	    const NamedString* p1 = h1.getParam(i);
+	    const NamedString* p2 = h2.getParam(i);
+	    same = p1 && p2 && (p1->name() &= p2->name()) && sameValue(*p1, *p2);
+	}
+	if (same)
+	    continue;
+	diffs++;
+	String l1, l2;
+	h1.dump(l1, " ");
+	h2.dump(l2, " ");
+	int eol = String(buf).find('\n');
+	retVal << "differ on '" << String(buf, eol > 0 ? eol : len).trimBlanks() << "':\r\n"
+	    << "  legacy:" << (ok1 ? "" : " failed") << l1 << "\r\n"
+	    << "  incremental:" << (ok2 ? "" : " failed") << l2 << "\r\n";
+    }
+    return diffs;
+}
+
+// Check both parsers agree on corpus, then time them on sample head
+// delivered step bytes at a time
+static void parseBench(String& retVal, const NamedList& params)
+{
+    unsigned int count = params.getIntValue("count", 100000, 1);
+    unsigned int len = sizeof(s_sampleHead) - 1;
+    unsigned int step = params.getIntValue("step", len, 1);
+    const char* buf = s_sampleHead;
+    unsigned int errors = 0;
+
+    u_int64_t t = Time::now();
+    for (unsigned int i = 0; i < count; i++) {
+	unsigned int n = 0;
+	unsigned int end;
+	do {
+	    n = (n + step < len) ? n + step : len;
+	    end = getEmptyLine(buf, n);
+	} while (end > n && n < len);
+	NamedList hdrs("");
+	if (end > n || !legacyParse(buf, end, hdrs))
+	    errors++;
+    }
+    u_int64_t legacy = Time::now() - t;
+
+    HttpHeadParser head;
+    t = Time::now();
+    for (unsigned int i = 0; i < count; i++) {
+	unsigned int n = 0;
+	int res;
+	head.reset();
+	do {
+	    n = (n + step < len) ? n + step : len;
+	    res = head.parse(buf, n);
+	} while (res == HttpHeadParser::Incomplete && n < len);
+	NamedList hdrs("");
+	if (res != HttpHeadParser::Complete || !newParse(head, buf, hdrs))
+	    errors++;
+    }
+    u_int64_t incremental = Time::now() - t;
+
+    if (!legacy)
+	legacy = 1;
+    if (!incremental)
+	incremental = 1;
+    u_int64_t total = (u_int64_t)count * s_sampleHeaders;
+    unsigned int diffs = compareParsers(retVal);
+    retVal << "Compared " << (unsigned int)(sizeof(s_corpus) / sizeof(s_corpus[0]) - 1)
+	<< " heads, " << diffs << " parsed differently\r\n";
+    retVal << "Parsed " << count << " heads of " << len << " bytes in pieces of "
+	<< step << ", " << errors << " errors\r\n";
+    retVal << "legacy: " << (total * 1000000 / legacy) << " headers/s\r\n";
+    retVal << "incremental: " << (total * 1000000 / incremental) << " headers/s\r\n";
+}
+
+// Counting allocator hooks, found only when test/alloccount.so is preloaded
+static unsigned long (*s_allocs)() = 0;
+static void (*s_allocIgnore)(int) = 0;
+
+static void allocIgnore(bool ignore)
+{
+    if (s_allocIgnore)
+	s_allocIgnore(ignore ? 1 : 0);
+}
+
+// User plus system CPU time of this process in microseconds
+static u_int64_t cpuTime()
+{
+#ifndef _WINDOWS
+    struct rusage ru;
+    if (!::getrusage(RUSAGE_SELF, &ru))
+	return (u_int64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+	    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+    return 0;
+}
+
+/**
+ * BenchRun
+ */
+BenchRun::BenchRun(const NamedList& params)
+    : Mutex(false, "BenchRun"),
+      m_addr(AF_INET),
+      m_conns(params.getIntValue("conns", 10, 1, 10000)),
+      m_requests(params.getIntValue("requests", 1000, 1)),
+      m_running(0), m_done(0), m_errors(0),
+      m_bytes(0), m_latency(0), m_maxLatency(0), m_start(0), m_cpu(0), m_allocs(0)
+{
+    String target = params.getValue("target", "127.0.0.1:2080");
+    int col = target.find(':');
+    m_addr.host(target.substr(0, col));
+    m_addr.port(col > 0 ? target.substr(col + 1).toInteger(80) : 80);
+    m_uri = params.getValue("uri", "/");
+    m_request << "GET " << m_uri << " HTTP/1.1\r\n"
+	<< "Host: " << target << "\r\n"
+	<< "User-Agent: YATE-httpbench\r\n"
+	<< "\r\n";
+}
+
+bool BenchRun::start()
+{
+    m_start = Time::now();
+    m_cpu = cpuTime();
+    m_allocs = s_allocs ? s_allocs() : 0;
+    // only server side allocations are counted, not those of clients
+    allocIgnore(true);
+    // threads that finish early wait here so run can't end before all started
+    Lock mylock(this);
+    for (unsigned int i = 0; i < m_conns; i++) {
+	BenchThread* t = new BenchThread(this);
+	if (!t->startup()) {
+	    delete t;
+	    break;
+	}
+	m_running++;
+    }
+    allocIgnore(false);
+    return m_running != 0;
+}
+
+void BenchRun::done(unsigned int requests, unsigned int errors, u_int64_t bytes,
+    u_int64_t latency, u_int64_t maxLatency)
+{
+    Lock mylock(this);
+    m_done += requests;
+    m_errors += errors;
+    m_bytes += bytes;
+    m_latency += latency;
+    if (m_maxLatency < maxLatency)
+	m_maxLatency = maxLatency;
+    if (--m_running)
+	return;
+    mylock.drop();
+    u_int64_t usec = Time::now() - m_start;
+    if (!usec)
+	usec = 1;
+    u_int64_t cpu = cpuTime() - m_cpu;
+    if (!cpu)
+	cpu = 1;
+    String allocs;
+    if (s_allocs && m_done) {
+	u_int64_t n = (u_int64_t)(s_allocs() - m_allocs) * 100 / m_done;
+	char buf[64];
+	::snprintf(buf, sizeof(buf), ", " FMT64U ".%02u allocations per request",
+	    n / 100, (unsigned int)(n % 100));
+	allocs = buf;
+    }
+    Output("httpbench %s%s: %u connections, %u requests, %u errors in " FMT64U " ms: "
+	FMT64U " req/s, " FMT64U " KiB/s, latency avg " FMT64U " us, max " FMT64U " us, "
+	"CPU " FMT64U " ms, " FMT64U " KiB per CPU second%s",
+	m_addr.addr().c_str(), m_uri.c_str(), m_conns, m_done, m_errors, usec / 1000,
+	(u_int64_t)m_done * 1000000 / usec, m_bytes * 1000000 / 1024 / usec,
+	(m_done ? m_latency / m_done : 0), m_maxLatency,
+	cpu / 1000, m_bytes * 1000000 / 1024 / cpu, allocs.safe());
+    RefPointer<BenchRun> run = m_next;
+    m_next = 0;
+    if (run && !run->start())
+	Output("httpbench: failed to start benchmark threads");
+}
+
+/**
+ * BenchHandler
+ */
+int BenchHandler::serve(HttpExchange& xchg)
+{
+    xchg.setHeader("Content-Type", "text/plain");
+    xchg.setBody(s_body);
+    return 0;
+}
+
+/**
+ * BenchThread
+ */
+void BenchThread::run()
+{
+    allocIgnore(true);
+    unsigned int requests = 0;
+    unsigned int errors = 0;
+    u_int64_t bytes = 0;
+    u_int64_t latency = 0;
+    u_int64_t maxLatency = 0;
+    Socket sock;
+    DataBlock buf;
+    const String& req = m_run->request();
+    for (unsigned int i = 0; i < m_run->requests(); i++) {
+	if (!sock.valid()) {
+	    buf.clear();
+	    if (!(sock.create(AF_INET, SOCK_STREAM) && sock.connect(m_run->addr()))) {
+		errors++;
+		sock.terminate();
+		break;
+	    }
+	    int arg = 1;
+	    sock.setOption(IPPROTO_TCP, TCP_NODELAY, &arg, sizeof(arg));
+	}
+	u_int64_t t = Time::now();
+	int len = -1;
+	if (sock.writeData(req.c_str(), req.length()) == (int)req.length())
+	    len = readResponse(sock, buf);
+	if (len < 0) {
+	    errors++;
+	    sock.terminate();
+	    continue;
+	}
+	t = Time::now() - t;
+	latency += t;
+	if (maxLatency < t)
+	    maxLatency = t;
+	bytes += len;
+	requests++;
+    }
+    sock.terminate();
+    m_run->done(requests, errors, bytes, latency, maxLatency);
+    m_run = 0;
+}
+
+// Read one response, return it's length or -1 on error
+// Bytes past the response are left in buffer
+int BenchThread::readResponse(Socket& sock, DataBlock& buf)
+{
+    int hdrLen = -1;
+    int total = -1;
+    bool chunked = false;
+    for (;;) {
+	if (hdrLen < 0) {
+	    String tmp((const char*)buf.data(), buf.length());
+	    int pos = tmp.find("\r\n\r\n");
+	    if (pos >= 0) {
+		hdrLen = pos + 4;
+		String hdr = tmp.substr(0, hdrLen).toLower();
+		int cl = hdr.find("\r\ncontent-length:");
+		if (cl >= 0)
+		    total = hdrLen + hdr.substr(cl + 17, hdr.find("\r\n", cl + 2) - cl - 17).trimBlanks().toInteger(-1);
+		else
+		    chunked = hdr.find("\r\ntransfer-encoding: chunked") >= 0;
+		if (!(chunked || total >= 0))
+		    return -1;
+	    }
+	}
+	if (total >= 0) {
+	    // body is counted, not kept, so large files cost client little CPU
+	    int left = total - (int)buf.length();
+	    if (left <= 0) {
+		buf.cut(-total);
+		return total;
+	    }
+	    buf.clear();
+	    char tmp[16384];
+	    while (left > 0) {
+		int rd = sock.readData(tmp, (left < (int)sizeof(tmp)) ? left : (int)sizeof(tmp));
+		if (rd <= 0)
+		    return -1;
+		left -= rd;
+	    }
+	    return total;
+	}
+	if (chunked && buf.length() >= (unsigned int)hdrLen + 5 &&
+		!::memcmp(buf.data(buf.length() - 5, 5), "0\r\n\r\n", 5)) {
+	    int len = buf.length();
+	    buf.clear();
+	    return len;
+	}
+	char tmp[16384];
+	int rd = sock.readData(tmp, sizeof(tmp));
+	if (rd <= 0)
+	    return -1;
+	buf.append(tmp, rd);
+    }
+}
+
+/**
+ * BenchModule
+ */
+BenchModule::BenchModule()
+    : Module("benchhttp","misc")
+{
+    Output("Loaded module BenchHttp");
+}
+
+BenchModule::~BenchModule()
+{
+    Output("Unloading module BenchHttp");
+    if (s_handler) {
+	httpUnregister(s_handler);
+	TelEngine::destruct(s_handler);
+    }
+}
+
+void BenchModule::initialize()
+{
+    static bool notFirst = false;
+    Output("Initializing module BenchHttp");
+    if (notFirst)
+	return;
+    notFirst = true;
+#ifndef _WINDOWS
+    s_allocs = (unsigned long (*)())::dlsym(RTLD_DEFAULT, "httpbenchAllocs");
+    s_allocIgnore = (void (*)(int))::dlsym(RTLD_DEFAULT, "httpbenchAllocIgnore");
+    if (s_allocs)
+	Output("httpbench: counting allocations of server threads");
+#endif
+    setup();
+    installRelay(HttpRoute, "http.route", 100);
+    installRelay(HttpServe, "http.serve", 100);
+    s_handler = new BenchHandler;
+    // httpserver may come after us, try again when all are initialized
+    if (!httpRegister(s_handler, "/bench/direct"))
+	installRelay(EngineStart, "engine.start", 100);
+}
+
+bool BenchModule::received(Message& msg, int id)
+{
+    switch (id) {
+	case HttpRoute:
+	    return msg[YSTRING("uri")] == YSTRING("/bench/message");
+	case HttpServe:
+	    if (msg[YSTRING("uri")] != YSTRING("/bench/message"))
+		return false;
+	    msg.setParam("ohdr_Content-Type", "text/plain");
+	    msg.retValue() = s_body;
+	    return true;
+	case EngineStart:
+	    if (!httpRegister(s_handler, "/bench/direct"))
+		Debug(this, DebugWarn, "Could not register direct handler, is httpserver loaded?");
+	    return false;
+    }
+    return Module::received(msg, id);
+}
+
+bool BenchModule::commandExecute(String& retVal, const String& line)
+{
+    String l = line;
+    if (!l.startSkip("httpbench"))
+	return Module::commandExecute(retVal, line);
+    NamedList params("");
+    ObjList* words = l.split(' ', false);
+    for (ObjList* o = words->skipNull(); o; o = o->skipNext()) {
+	const String& w = o->get()->toString();
+	int eq = w.find('=');
+	if (eq > 0)
+	    params.setParam(w.substr(0, eq), w.substr(eq + 1));
+	else if (w == YSTRING("parse") || w == YSTRING("route"))
+	    params.setParam("mode", w);
+	else
+	    params.setParam("target", w);
+    }
+    TelEngine::destruct(words);
+    if (params["mode"] == YSTRING("parse")) {
+	parseBench(retVal, params);
+	return true;
+    }
+    RefPointer<BenchRun> direct;
+    if (params["mode"] == YSTRING("route")) {
+	// message path first, then direct one
+	params.setParam("uri", "/bench/direct");
+	direct = new BenchRun(params);
+	direct->deref();
+	params.setParam("uri", "/bench/message");
+    }
+    BenchRun* run = new BenchRun(params);
+    run->next(direct);
+    if (run->start())
+	retVal = "Benchmark started, results will be printed when done\r\n";
+    else
+	retVal = "Failed to start benchmark threads\r\n";
+    run->deref();
+    return true;
+}
+
+bool BenchModule::commandComplete(Message& msg, const String& partLine, const String& partWord)
+{
+    if (partLine.null() && itemComplete(msg.retValue(), "httpbench", partWord))
+	return false;
+    return Module::commandComplete(msg, partLine, partWord);
+}
+
+}; // anonymous namespace
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
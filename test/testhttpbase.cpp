@@ -35,6 +35,7 @@
  *
  */
 #include <yatengine.h>
+#include "../hpack.h"
 #include <string.h>
 
 using namespace TelEngine;
@@ -44,18 +45,27 @@ static String s_test1Uri = "/test/1";
 class TestThread : public Thread, private Mutex
 {
 public:
-    TestThread(): m_serverPort(0)
+    TestThread(): m_serverPort(0), m_timeout(10), m_headTimeout(10)
 	{ }
     virtual void run();
     virtual void cleanup();
     void configure(const NamedList& conf);
 private:
     bool connectSocket();
+    bool exchange(const String& req, String& rsp);
+    bool check(const char* test, const String& rsp, const char* status, const char* body);
     bool test_01_get_with_shutdown();
     bool test_02_get_with_keepalive();
+    bool test_03_post_chunked();
+    bool test_04_hpack();
+    bool test_05_timeouts();
+    bool test_06_ranges();
+    int waitClose(String& rsp, int maxwait);
 private:
     String m_serverAddr;
     int m_serverPort;
+    int m_timeout;
+    int m_headTimeout;
     Socket m_sock;
 };
 
@@ -70,6 +80,21 @@ private:
     bool m_first;
 };
 
+// Seekable body of known length, Range requests can be served from it
+class TestBody : public RefObject, public MemoryStream
+{
+public:
+    TestBody(const String& text)
+	: MemoryStream(DataBlock(const_cast<char*>(text.c_str()), text.length()))
+	{ }
+    virtual void* getObject(const String& name) const
+    {
+	if (name == YATOM("Stream"))
+	    return static_cast<Stream*>(const_cast<TestBody*>(this));
+	return RefObject::getObject(name);
+    }
+};
+
 class TestHandler : public MessageHandler
 {
 public:
@@ -82,6 +107,10 @@ void TestThread::run()
     sleep(5);
     Debug(DebugInfo,"TestThread::run() [%p]",this);
     test_01_get_with_shutdown();
+    test_03_post_chunked();
+    test_04_hpack();
+    test_05_timeouts();
+    test_06_ranges();
 }
 
 void TestThread::cleanup()
@@ -96,6 +125,8 @@ void TestThread::configure(const NamedList& conf)
     if(m_serverAddr == "0.0.0.0")
 	m_serverAddr = "127.0.0.1";
     m_serverPort = conf.getIntValue("port", 80);
+    m_timeout = conf.getIntValue("timeout", 10, 0);
+    m_headTimeout = conf.getIntValue("headtimeout", m_timeout, 0);
 }
 
 bool TestThread::connectSocket()
@@ -188,26 +219,275 @@ bool TestThread::test_02_get_with_keepalive()
     return true;
 }
 
-#if 0
-bool TestThread::test_post_chunked()
+// Send whole request, half close and collect response until server closes
+bool TestThread::exchange(const String& req, String& rsp)
+{
+    rsp.clear();
+    if(! connectSocket())
+	return false;
+    int w = m_sock.send(req.c_str(), req.length());
+    Debug(DebugAll, "Sent %d bytes to server: <<%s>>", w, req.c_str());
+    m_sock.shutdown(false, true);
+    char buf[8192];
+    for (;;) {
+	int r = m_sock.readData(buf, sizeof(buf));
+	if (r < 0) {
+	    Debug(DebugFail, "Socket read error: %s", strerror(m_sock.error()));
+	    break;
+	}
+	if (! r)
+	    break;
+	rsp.append(buf, r);
+    }
+    m_sock.shutdown(true, true);
+    m_sock.terminate();
+    return !rsp.null();
+}
+
+// Response must have status code and, if body is given, end with it
+bool TestThread::check(const char* test, const String& rsp, const char* status, const char* body)
+{
+    int sp = rsp.find(' ');
+    bool ok = sp > 0 && rsp.substr(sp + 1, 3) == status;
+    if (ok && body) {
+	int hend = rsp.find("\r\n\r\n");
+	ok = hend >= 0 && rsp.substr(hend + 4) == body;
+    }
+    if (ok)
+	Output("%s: passed", test);
+    else
+	Debug(DebugFail, "%s: expected %s '%s', got: %s", test, status, TelEngine::c_safe(body), rsp.c_str());
+    return ok;
+}
+
+bool TestThread::test_03_post_chunked()
+{
+    const char* chunked_data = "4;name=value\r\nWiki\r\n5\r\npedia\r\ne ; quoted=\"a;b\"\r\n in\r\n\r\nchunks.\r\n0\r\n"
+	"X-Checksum: 42\r\nExpect: 100-continue\r\n\r\n";
+    const char* chunked_xpct = "Wikipedia in\r\n\r\nchunks.|42|";
+    String head("POST /test/echo HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n"
+	"Transfer-Encoding: chunked\r\n\r\n");
+    String rsp;
+    bool ok = exchange(head + chunked_data, rsp) && check("test_03_post_chunked", rsp, "200", chunked_xpct);
+    // size that is not hex and size line with only an extension are rejected
+    if (exchange(head + "4x\r\nWiki\r\n0\r\n\r\n", rsp))
+	ok = check("test_03_post_chunked bad size", rsp, "400", 0) && ok;
+    if (exchange(head + ";name=value\r\nWiki\r\n0\r\n\r\n", rsp))
+	ok = check("test_03_post_chunked missing size", rsp, "400", 0) && ok;
+    return ok;
+}
+
+// Read until server closes, return seconds it took or -1 if it didn't in time
+int TestThread::waitClose(String& rsp, int maxwait)
+{
+    u_int64_t start = Time::now();
+    u_int64_t end = start + 1000000 * (u_int64_t)maxwait;
+    char buf[8192];
+    for (;;) {
+	u_int64_t now = Time::now();
+	bool readok = false;
+	if (now >= end || !m_sock.select(&readok, 0, 0, (int64_t)(end - now)))
+	    return -1;
+	if (!readok)
+	    continue;
+	int r = m_sock.readData(buf, sizeof(buf));
+	if (r <= 0)
+	    return (int)((Time::now() - start + 500000) / 1000000);
+	rsp.append(buf, r);
+    }
+}
+
+// Request pieces left hanging: timer wheel closes the connection once
+// headtimeout or, between keepalive requests, timeout went by
+bool TestThread::test_05_timeouts()
+{
+    if (!m_headTimeout || !m_timeout) {
+	Output("test_05_timeouts: skipped, timeouts disabled");
+	return true;
+    }
+    bool ok = true;
+    String rsp;
+    if (connectSocket()) {
+	String req("GET /test/1 HTTP/1.1\r\nHost: localhost\r\n");
+	m_sock.send(req.c_str(), req.length());
+	int secs = waitClose(rsp, m_headTimeout + 3);
+	// wheel has one second slots
+	if (secs < m_headTimeout - 1 || secs > m_headTimeout + 1 || !rsp.null()) {
+	    Debug(DebugFail, "test_05_timeouts: partial head closed after %d of %d seconds, got: %s",
+		secs, m_headTimeout, rsp.c_str());
+	    ok = false;
+	}
+	m_sock.terminate();
+    }
+    else
+	ok = false;
+    // idle keepalive connection goes after response was sent
+    rsp.clear();
+    if (connectSocket()) {
+	String req("GET /test/1 HTTP/1.1\r\nHost: localhost\r\n\r\n");
+	m_sock.send(req.c_str(), req.length());
+	int secs = waitClose(rsp, m_timeout + 3);
+	if (secs < m_timeout - 1 || secs > m_timeout + 1 || !rsp.endsWith("GET 1")) {
+	    Debug(DebugFail, "test_05_timeouts: idle connection closed after %d of %d seconds, got: %s",
+		secs, m_timeout, rsp.c_str());
+	    ok = false;
+	}
+	m_sock.terminate();
+    }
+    else
+	ok = false;
+    // both are counted in module status
+    Message m("engine.status");
+    m.addParam("module", "httpserver");
+    Engine::dispatch(m);
+    if (m.retValue().find("headtimeouts=0,") >= 0 || m.retValue().find("idletimeouts=0,") >= 0) {
+	Debug(DebugFail, "test_05_timeouts: timeouts not counted in status: %s", m.retValue().c_str());
+	ok = false;
+    }
+    if (ok)
+	Output("test_05_timeouts: passed");
+    return ok;
+}
+
+// Times a header appears in response head, whatever the case of it's name
+static int headerCount(const String& rsp, const char* name)
+{
+    int hend = rsp.find("\r\n\r\n");
+    String head = rsp.substr(0, hend < 0 ? rsp.length() : hend);
+    head.toLower();
+    String hdr("\r\n");
+    hdr << name << ":";
+    hdr.toLower();
+    int n = 0;
+    for (int pos = head.find(hdr); pos >= 0; pos = head.find(hdr, pos + 1))
+	n++;
+    return n;
+}
+
+// Parts of a stream body with it's own Content-Type, given in lower case
+bool TestThread::test_06_ranges()
+{
+    String head("GET /test/range HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n");
+    String rsp;
+    bool ok = exchange(head + "Range: bytes=2-5\r\n\r\n", rsp) &&
+	check("test_06_ranges part", rsp, "206", "cdef");
+    if (ok && rsp.find("\r\nContent-Range: bytes 2-5/10\r\n") < 0) {
+	Debug(DebugFail, "test_06_ranges part: bad Content-Range in: %s", rsp.c_str());
+	ok = false;
+    }
+    // range past the end gets a plain text body describing the error
+    if (! (exchange(head + "Range: bytes=20-\r\n\r\n", rsp) &&
+	    check("test_06_ranges unsatisfiable", rsp, "416", "416 Requested Range Not Satisfiable\r\n")))
+	return false;
+    if (rsp.find("\r\nContent-Range: bytes */10\r\n") < 0 || headerCount(rsp, "Content-Type") != 1 ||
+	    rsp.find("\r\nContent-Type: text/plain\r\n") < 0 || headerCount(rsp, "Content-Encoding")) {
+	Debug(DebugFail, "test_06_ranges unsatisfiable: bad headers in: %s", rsp.c_str());
+	ok = false;
+    }
+    return ok;
+}
+
+// Decode a hex header block, list fields as "name: value" lines
+static bool hpackDecode(HpackDecoder& dec, const char* hex, String& fields)
+{
+    DataBlock block;
+    if (!block.unHexify(hex, ::strlen(hex)))
+	return false;
+    NamedList hdrs("");
+    if (!dec.decode((const unsigned char*)block.data(), block.length(), hdrs))
+	return false;
+    fields.clear();
+    for (unsigned int i = 0; i < hdrs.length(); i++) {
+	const NamedString* ns = hdrs.getParam(i);
+	if (ns)
+	    fields << ns->name() << ": " << *ns << "\n";
+    }
+    return true;
+}
+
+// HPACK decoder alone, no server needed
+bool TestThread::test_04_hpack()
 {
-    const char* chunked_data = "4\r\nWiki\r\n5\r\npedia\r\ne\r\n in\r\n\r\nchunks.\r\n0\r\n\r\n";
-    const char* chunked_xpct = "Wikipedia\r\n in\r\n\r\nchunks.";
+    // request examples of RFC 7541 C.3 (literals) and C.4 (Huffman), each
+    // series on it's own decoder as they share dynamic table
+    static const char* const blocks[] = {
+	"828684410f7777772e6578616d706c652e636f6d",
+	"828684be58086e6f2d6361636865",
+	"828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565",
+	"828684418cf1e3c2e5f23a6ba0ab90f4ff",
+	"828684be5886a8eb10649cbf",
+	"828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+    };
+    static const char* const fields[] = {
+	":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n",
+	":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n",
+	":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n",
+    };
+    bool ok = true;
+    for (unsigned int s = 0; s < 2; s++) {
+	HpackDecoder dec;
+	for (unsigned int i = 0; i < 3; i++) {
+	    String got;
+	    if (!hpackDecode(dec, blocks[s * 3 + i], got) || got != fields[i]) {
+		Debug(DebugFail, "test_04_hpack: block %s decoded as: %s", blocks[s * 3 + i], got.c_str());
+		ok = false;
+	    }
+	}
+	// 3 entries of 57, 53 and 54 bytes are left in dynamic table
+	if (dec.size() != 164) {
+	    Debug(DebugFail, "test_04_hpack: dynamic table size %u, expected 164", dec.size());
+	    ok = false;
+	}
+    }
+
+    // one 233 bytes entry referenced 10 times goes over header list limit
+    HpackDecoder dec(4096, 1000);
+    String big("40017a7f49");
+    for (unsigned int i = 0; i < 200; i++)
+	big << "61";
+    String got;
+    String refs("bebebebebebebebebebe");
+    if (!hpackDecode(dec, big, got) || hpackDecode(dec, refs, got) || dec.listSize() <= 1000) {
+	Debug(DebugFail, "test_04_hpack: expanded header list was not refused");
+	ok = false;
+    }
+    // Huffman string padded with zero bits instead of EOS prefix
+    HpackDecoder dec2;
+    if (hpackDecode(dec2, "0081000161", got)) {
+	Debug(DebugFail, "test_04_hpack: bad Huffman padding was accepted");
+	ok = false;
+    }
+    if (ok)
+	Output("test_04_hpack: passed");
+    return ok;
 }
-#endif
 
 bool TestHandler::received(Message &msg)
 {
     Debug(DebugInfo, "Received message '%s' time=" FMT64U " thread=%p", msg.c_str(), msg.msgTime().usec(),Thread::current());
-    if(msg != YSTRING("http.request"))
+    if(msg != YSTRING("http.request") && msg != YSTRING("http.serve"))
 	return false;
     String method = msg.getValue("method");
     String uri = msg.getParam("uri");
     if(! uri.startSkip("/test/", false))
 	return false;
 
+    if (uri == YSTRING("range")) {
+	TestBody* body = new TestBody("abcdefghij");
+	msg.setParam("ohdr_Content-Length", "10");
+	msg.setParam("ohdr_content-type", "application/octet-stream");
+	msg.setParam("ohdr_content-encoding", "identity");
+	msg.userData(body);
+	body->deref();
+	return true;
+    }
+
     String r;
-    r << method << " " << uri;
+    if (uri == YSTRING("echo"))
+	// request body, a trailer field and one that must have been dropped
+	r << msg.getValue("content") << "|" << msg.getValue("hdr_X-Checksum") << "|" << msg.getValue("hdr_Expect");
+    else
+	r << method << " " << uri;
 
     msg.setParam("status", "200");
     msg.setParam("ohdr_Content-Type", "text/plain");
@@ -250,6 +530,7 @@ void TestPlugin::initialize()
 	m_first = false;
 	m_testThread->startup();
 	Engine::install(new TestHandler("http.request"));
+	Engine::install(new TestHandler("http.serve"));
     }
 //    delete httpdconf;
 }
@@ -9,6 +9,7 @@
  */
 
 #include <yatephone.h>
+#include "httphandler.h"
 #include <string.h>
 #include <signal.h>
 #include <stdio.h>
@@ -149,8 +150,11 @@ bool YWebCGIModule::received(Message &msg, int id)
     Debug(&plugin, DebugAll, "WebCGI is serving resource '%s'", path.c_str());
 
     Servant* s = reinterpret_cast<Servant*>(msg.userObject("Servant"));
-    if(! s)
+    if(! s) {
+	// CGI environment needs all request parameters, httpserver may keep them out
+	httpParams(msg);
 	s = new Servant(path, msg);
+    }
     return s->received(msg, id);
 }
 
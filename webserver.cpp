@@ -22,6 +22,7 @@
  */
 
 #include <yatephone.h>
+#include "httphandler.h"
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -223,7 +224,7 @@ bool WebServer::received(Message &msg, bool reqdata)
 	if (!status || *status != '3')
 	    msg.setParam("status", "302");
 	if (handler.find("://") < 0)
-	    handler = YSTRING("http://") + msg.getParam("hdr_Host") + handler;
+	    handler = YSTRING("http://") + httpParam(msg, "hdr_Host") + handler;
 	msg.setParam("ohdr_Location", handler);
 	return true;
     }
@@ -321,7 +322,7 @@ Servant::~Servant()
 
 void* Servant::getObject(const String& name) const
 {
-    if (name == YATOM("Stream"))
+    if (name == YATOM("Stream") || name == YATOM("File"))
 	return const_cast<File*>(&m_fh);
     if (name == YATOM("Servant"))
 	return const_cast<Servant*>(this);
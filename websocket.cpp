@@ -22,6 +22,7 @@
  */
 
 #include <yatephone.h>
+#include "httphandler.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -334,16 +335,16 @@ bool WebSocketModule::processUpgradeMsg(Message& msg)
 	DDebug(&plugin, DebugInfo, "Wrong HTTP version for websocket %s", msg.getValue("version"));
 	return false;
     }
-    if (String(msg.getValue("hdr_Upgrade")).toLower() != YSTRING("websocket")) {
-	XDebug(&plugin, DebugAll, "Upgrade header is not 'websocket': %s", msg.getValue("hdr_Upgrade"));
+    if (String(httpParam(msg, "hdr_Upgrade")).toLower() != YSTRING("websocket")) {
+	XDebug(&plugin, DebugAll, "Upgrade header is not 'websocket': %s", httpParam(msg, "hdr_Upgrade"));
 	return false;
     }
-    String key = msg.getParam("hdr_Sec-WebSocket-Key");
+    String key = httpParam(msg, "hdr_Sec-WebSocket-Key");
     if (! key.length()) {
 	DDebug(&plugin, DebugInfo, "Required header Sec-WebSocket-Key is missing");
 	return false;
     }
-    String version = msg.getValue("hdr_Sec-WebSocket-Version");
+    String version = httpParam(msg, "hdr_Sec-WebSocket-Version");
     if (version != "13") {
 	Debug(&plugin, DebugInfo, "Upgrade request with wrong websocket version %s", version.c_str());
 	return false;
@@ -549,10 +550,13 @@ bool WebSocketServer::init(Message& msg)
     Socket* sock = static_cast<Socket*>(msg.userObject("Socket"));
     if (!sock)
 	return false;
-    m_protocol = msg.getValue("hdr_Sec-WebSocket-Protocol");
-    m_extension = msg.getValue("hdr_Sec-WebSocket-Extensions");
+    m_protocol = httpParam(msg, "hdr_Sec-WebSocket-Protocol");
+    m_extension = httpParam(msg, "hdr_Sec-WebSocket-Extensions");
     m_socket = sock;
     m_headers = msg;
+    NamedList* req = static_cast<NamedList*>(msg.userObject(YATOM("NamedList")));
+    if (req)
+	m_headers.copyParams(*req);
 
     Message m("websocket.init");
     m.userData(this);